@@ -18,7 +18,13 @@
 #include <string>
 #include <windows.h>
 #include <sstream>
+#include <fstream>
+#include <vector>
+#include <list>
+#include <map>
 #include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
 
 // Framework includes
 #include "TskModuleDev.h"
@@ -27,13 +33,410 @@
 #include "Poco/UnicodeConverter.h"
 #include "Poco/File.h"
 #include "Poco/Path.h"
+#include "Poco/Mutex.h"
+#include "Poco/MD5Engine.h"
 
 // Magic includes
 #include "magic.h"
 
+// Least and, unless configured otherwise, most to read from the start of a
+// file. That is what the text stages look at, as before; the soft magic
+// tests that look further fetch what they need through magic_reader(), so
+// reading more up front only saves those reads for files that need them.
 static const uint32_t FILE_BUFFER_SIZE = 1024;
+static const uint32_t DEFAULT_MAX_READ_SIZE = FILE_BUFFER_SIZE;
 
-static magic_t magicHandle = NULL;
+// Files whose soft magic result libmagic remembers, so that files with the
+// same bytes where the tests looked are not matched again.
+static const size_t DEFAULT_MEMO_ENTRIES = 4096;
+
+// Bytes read from the start of each file: as far as the tests of the database
+// at fixed offsets look, within the bounds above. Set by initialize().
+static uint32_t readSize = FILE_BUFFER_SIZE;
+
+// The loaded magic database, shared read-only by all contexts below.
+static magic_db_t magicDb = NULL;
+
+// Flags the contexts are opened with.
+static int magicFlags = MAGIC_NONE;
+
+// Entries of the soft magic memo of the database; 0 turns it off.
+static size_t memoEntries = DEFAULT_MEMO_ENTRIES;
+
+// Number of the most expensive magic entries to log at finalize(); 0 unless
+// profiling was asked for.
+static size_t profileLines = 0;
+
+// Contexts that are not currently in use by run(). libmagic keeps per-call
+// state in each context, so a context may only be used by one thread at a
+// time. The pool grows to the number of threads calling run() concurrently,
+// but keeps no more than maxHandles of them if that is not 0.
+static std::vector<magic_ctx_t> freeHandles;
+static size_t maxHandles = 0;
+static Poco::FastMutex poolMutex;
+
+// What each stage of libmagic cost, summed over the contexts closed so far.
+// Guarded by poolMutex.
+static magic_stats stageTotals;
+
+// Types already found, keyed by the MD5 of the file contents, so that copies
+// of a file seen before are not matched again. Off unless initialize() is
+// given a size or a file to keep the types in between runs.
+static const size_t DEFAULT_CACHE_ENTRIES = 65536;
+static size_t cacheEntries = 0;
+static std::string cachePath;
+static std::string cacheStamp;
+
+// Whether the MIME type is posted too, as a second TSK_FILE_TYPE_SIG
+// attribute with context "mime". Off unless initialize() is asked for it,
+// since consumers may expect one attribute per file.
+static bool postMime = false;
+
+// A type as posted to the blackboard: the description and, if postMime is
+// set, the MIME type with its encoding.
+struct FileType
+{
+    std::string description;
+    std::string mime;
+};
+
+typedef std::list<std::pair<std::string, FileType> > TypeList;
+typedef std::map<std::string, TypeList::iterator> TypeIndex;
+
+// Most recently used first; the index points into the list.
+static TypeList cachedTypes;
+static TypeIndex cacheIndex;
+static Poco::FastMutex cacheMutex;
+
+namespace
+{
+    /**
+     * Adds the stage costs of a context to stageTotals and closes it. The
+     * caller holds poolMutex.
+     */
+    void closeHandle(magic_ctx_t handle)
+    {
+        magic_stats st;
+        if (magic_getstats(handle, &st) == 0) {
+            stageTotals.buffers += st.buffers;
+            for (int i = 0; i < MAGIC_NSTAGES; i++) {
+                stageTotals.stage[i].runs += st.stage[i].runs;
+                stageTotals.stage[i].decided += st.stage[i].decided;
+                stageTotals.stage[i].cycles += st.stage[i].cycles;
+                for (int j = 0; j < MAGIC_STATS_BUCKETS; j++)
+                    stageTotals.stage[i].hist[j] += st.stage[i].hist[j];
+            }
+        }
+        magic_close(handle);
+    }
+
+    /**
+     * Takes a context out of the pool for the lifetime of the object and
+     * puts it back when it goes out of scope.
+     */
+    class MagicHandleLease
+    {
+    public:
+        MagicHandleLease() : m_handle(NULL)
+        {
+            Poco::FastMutex::ScopedLock lock(poolMutex);
+            if (!freeHandles.empty()) {
+                m_handle = freeHandles.back();
+                freeHandles.pop_back();
+            }
+            else if (magicDb != NULL) {
+                m_handle = magic_ctx_open(magicDb, magicFlags);
+            }
+        }
+
+        ~MagicHandleLease()
+        {
+            if (m_handle != NULL) {
+                Poco::FastMutex::ScopedLock lock(poolMutex);
+                if (maxHandles == 0 || freeHandles.size() < maxHandles)
+                    freeHandles.push_back(m_handle);
+                else
+                    closeHandle(m_handle);
+            }
+        }
+
+        magic_ctx_t get() const { return m_handle; }
+
+    private:
+        MagicHandleLease(const MagicHandleLease&);
+        MagicHandleLease& operator=(const MagicHandleLease&);
+
+        magic_ctx_t m_handle;
+    };
+
+    /**
+     * Read callback for magic_reader(). Tests that look past the start of
+     * the file read the bytes they need through the TskFile.
+     * Exceptions must not unwind through libmagic, so errors are reported
+     * as a failed read.
+     */
+    ssize_t readFileAt(void *cookie, void *buf, size_t len, unsigned long long offset)
+    {
+        TskFile *pFile = static_cast<TskFile *>(cookie);
+        try {
+            if (pFile->seek((TSK_OFF_T)offset) != (TSK_OFF_T)offset)
+                return -1;
+            return pFile->read(static_cast<char *>(buf), len);
+        }
+        catch (...) {
+            return -1;
+        }
+    }
+
+    /**
+     * libmagic flags that may be given to initialize(), without their
+     * MAGIC_ prefix.
+     */
+    struct MagicFlagName
+    {
+        const char *name;
+        int flag;
+    };
+
+    const MagicFlagName MAGIC_FLAG_NAMES[] = {
+        { "NONE", MAGIC_NONE },
+        { "COMPRESS", MAGIC_COMPRESS },
+        { "MIME_TYPE", MAGIC_MIME_TYPE },
+        { "MIME_ENCODING", MAGIC_MIME_ENCODING },
+        { "MIME", MAGIC_MIME },
+        { "CONTINUE", MAGIC_CONTINUE },
+        { "RAW", MAGIC_RAW },
+        { "APPLE", MAGIC_APPLE },
+        { "NO_CHECK_COMPRESS", MAGIC_NO_CHECK_COMPRESS },
+        { "NO_CHECK_TAR", MAGIC_NO_CHECK_TAR },
+        { "NO_CHECK_SOFT", MAGIC_NO_CHECK_SOFT },
+        { "NO_CHECK_ELF", MAGIC_NO_CHECK_ELF },
+        { "NO_CHECK_TEXT", MAGIC_NO_CHECK_TEXT },
+        { "NO_CHECK_CDF", MAGIC_NO_CHECK_CDF },
+        { "NO_CHECK_TOKENS", MAGIC_NO_CHECK_TOKENS },
+        { "NO_CHECK_ENCODING", MAGIC_NO_CHECK_ENCODING },
+        { "NO_CHECK_BUILTIN", MAGIC_NO_CHECK_BUILTIN }
+    };
+
+    /**
+     * Parses libmagic flag names separated by '|' or ',', such as
+     * "MAGIC_NO_CHECK_CDF|MAGIC_NO_CHECK_TOKENS". Case and the MAGIC_ prefix
+     * do not matter.
+     * @returns false if a name is not known.
+     */
+    bool parseMagicFlags(const std::string &value, int &flags)
+    {
+        flags = MAGIC_NONE;
+        std::string::size_type start = 0;
+        while (start <= value.size()) {
+            std::string::size_type stop = value.find_first_of("|,", start);
+            if (stop == std::string::npos)
+                stop = value.size();
+            std::string name(value, start, stop - start);
+            start = stop + 1;
+
+            for (std::string::iterator it = name.begin(); it != name.end(); ++it)
+                *it = (char)toupper((unsigned char)*it);
+            if (name.compare(0, 6, "MAGIC_") == 0)
+                name.erase(0, 6);
+
+            size_t i = 0;
+            const size_t count = sizeof(MAGIC_FLAG_NAMES) / sizeof(MAGIC_FLAG_NAMES[0]);
+            while (i < count && name != MAGIC_FLAG_NAMES[i].name)
+                i++;
+            if (i == count)
+                return false;
+            flags |= MAGIC_FLAG_NAMES[i].flag;
+        }
+        return true;
+    }
+
+    /**
+     * Returns the cache key for the MD5 the framework computed for the file,
+     * or an empty string if it has not computed one.
+     */
+    std::string frameworkKey(TskFile *pFile)
+    {
+        std::string hash;
+        try {
+            hash = pFile->getHash(TskImgDB::MD5);
+        }
+        catch (TskException&) {
+            return "";
+        }
+        if (hash.size() != 32)
+            return "";
+        for (std::string::iterator it = hash.begin(); it != hash.end(); ++it) {
+            if (!isxdigit((unsigned char)*it))
+                return "";
+            *it = (char)tolower((unsigned char)*it);
+        }
+        return hash;
+    }
+
+    /**
+     * Returns the cache key for a file whose contents are all in buf. It is
+     * the same MD5 the framework would compute, so both kinds of key find
+     * the same entries.
+     */
+    std::string contentKey(const char *buf, size_t len)
+    {
+        Poco::MD5Engine md5;
+        md5.update(buf, len);
+        return Poco::DigestEngine::digestToHex(md5.digest());
+    }
+
+    /**
+     * Returns the type libmagic found. The MIME type and encoding are those
+     * magic_getmime() gave, if any.
+     */
+    FileType makeFileType(const char *description, const char *mimeType, const char *encoding)
+    {
+        FileType type;
+        type.description = description;
+        if (mimeType != NULL && *mimeType != '\0') {
+            type.mime = mimeType;
+            if (encoding != NULL && *encoding != '\0')
+                type.mime = type.mime + "; charset=" + encoding;
+        }
+        return type;
+    }
+
+    bool findCachedType(const std::string &key, FileType &type)
+    {
+        Poco::FastMutex::ScopedLock lock(cacheMutex);
+        TypeIndex::iterator it = cacheIndex.find(key);
+        if (it == cacheIndex.end())
+            return false;
+        cachedTypes.splice(cachedTypes.begin(), cachedTypes, it->second);
+        type = it->second->second;
+        return true;
+    }
+
+    void cacheType(const std::string &key, const FileType &type)
+    {
+        Poco::FastMutex::ScopedLock lock(cacheMutex);
+        if (cacheIndex.find(key) != cacheIndex.end())
+            return;
+        cachedTypes.push_front(std::make_pair(key, type));
+        cacheIndex[key] = cachedTypes.begin();
+        if (cacheIndex.size() > cacheEntries) {
+            cacheIndex.erase(cachedTypes.back().first);
+            cachedTypes.pop_back();
+        }
+    }
+
+    /**
+     * Reads the types saved by saveTypeCache(), one "key<TAB>mime<TAB>
+     * description" line each. The file is ignored if it was written by
+     * another version of the module or for another magic database, since
+     * the types could then differ.
+     */
+    void loadTypeCache()
+    {
+        std::ifstream in(cachePath.c_str(), std::ios::in | std::ios::binary);
+        if (!in)
+            return;
+
+        std::string line;
+        if (!std::getline(in, line) || line != cacheStamp) {
+            LOGINFO(L"FileTypeSigModule: Ignoring type cache made for another magic file");
+            return;
+        }
+
+        while (cacheIndex.size() < cacheEntries && std::getline(in, line)) {
+            std::string::size_type tab = line.find('\t');
+            std::string::size_type tab2 = tab == std::string::npos ? tab : line.find('\t', tab + 1);
+            if (tab2 == std::string::npos)
+                continue;
+            std::string key(line, 0, tab);
+            if (cacheIndex.find(key) != cacheIndex.end())
+                continue;
+            FileType type;
+            type.mime = line.substr(tab + 1, tab2 - tab - 1);
+            type.description = line.substr(tab2 + 1);
+            cachedTypes.push_back(std::make_pair(key, type));
+            cacheIndex[key] = --cachedTypes.end();
+        }
+    }
+
+    /**
+     * Writes the cached types, most recently used first, so that a smaller
+     * cache loading them keeps the ones most likely to be seen again.
+     */
+    bool saveTypeCache()
+    {
+        std::string tempPath = cachePath + ".tmp";
+        {
+            std::ofstream out(tempPath.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+            out << cacheStamp << '\n';
+            for (TypeList::const_iterator it = cachedTypes.begin(); it != cachedTypes.end(); ++it) {
+                const FileType &type = it->second;
+                if (type.description.find_first_of("\r\n") == std::string::npos &&
+                    type.mime.find_first_of("\t\r\n") == std::string::npos)
+                    out << it->first << '\t' << type.mime << '\t' << type.description << '\n';
+            }
+            out.close();
+            if (!out)
+                return false;
+        }
+        Poco::File(tempPath).renameTo(cachePath);
+        return true;
+    }
+
+    // Names of the MAGIC_STAGE_* stages, for the log.
+    const char *const STAGE_NAMES[MAGIC_NSTAGES] = {
+        "encoding", "compress", "tar", "cdf", "soft", "elf", "text",
+        "text/encoding", "data"
+    };
+
+    /**
+     * Returns the least number of cycles that at least the given share of
+     * the runs of a stage took no more than, to within a factor of two.
+     */
+    unsigned long long stagePercentile(const magic_stats::magic_stage_stats &st, double share)
+    {
+        unsigned long long seen = 0;
+        for (int i = 0; i < MAGIC_STATS_BUCKETS; i++) {
+            seen += st.hist[i];
+            if (seen != 0 && seen >= share * st.runs)
+                return (2ULL << i) - 1;
+        }
+        return 0;
+    }
+
+    /**
+     * Logs what each stage of libmagic cost over all the contexts closed.
+     */
+    void logStageStats(const magic_stats &total)
+    {
+        if (total.buffers == 0)
+            return;
+
+        std::stringstream msg;
+        msg << "FileTypeSigModule: libmagic stages over " << total.buffers << " buffers"
+            << " (stage, runs, decided, cycles per run, median, 99th percentile):";
+        for (int i = 0; i < MAGIC_NSTAGES; i++) {
+            const magic_stats::magic_stage_stats &st = total.stage[i];
+            if (st.runs == 0)
+                continue;
+            msg << "\n" << STAGE_NAMES[i] << " " << st.runs << " " << st.decided
+                << " " << st.cycles / st.runs << " " << stagePercentile(st, 0.5)
+                << " " << stagePercentile(st, 0.99);
+        }
+        LOGINFO(msg.str());
+    }
+
+    /**
+     * Closes the contexts in the pool. The caller holds poolMutex.
+     */
+    void closeHandles()
+    {
+        for (std::vector<magic_ctx_t>::iterator it = freeHandles.begin(); it != freeHandles.end(); ++it)
+            closeHandle(*it);
+        freeHandles.clear();
+    }
+}
 
 extern "C" 
 {
@@ -64,17 +467,124 @@ extern "C"
      */
     TSK_MODULE_EXPORT const char *version()
     {
-        return "1.0.2";
+        return "1.1.0";
     }
 
     /**
      * Module initialization function. Takes a string as input that allows
      * arguments to be passed into the module.
-     * @param arguments Tells the module which
+     * @param arguments Optional settings separated by semicolons:
+     * "flags=<names>" opens libmagic with the given flags, e.g.
+     * "flags=NO_CHECK_CDF|NO_CHECK_TOKENS" (MAGIC_NONE by default);
+     * "mime=1" also posts the MIME type, as a second TSK_FILE_TYPE_SIG
+     * attribute with context "mime" (unless the flags include MIME_TYPE,
+     * MIME_ENCODING or APPLE, which make that the description already);
+     * "maxread=<bytes>" changes how much of each file may be read up front
+     * (1 KB by default); "handles=<count>" opens that many libmagic
+     * contexts up front and keeps no more than that many idle;
+     * "memo=<entries>" sizes the soft magic memo of libmagic (4096 by
+     * default, 0 turns it off); "cache=<entries>" keeps the types of that
+     * many distinct files so that copies are not matched again;
+     * "cachefile=<path>" also keeps them in a file between runs (with
+     * 65536 entries unless "cache" says otherwise); "profile=<entries>"
+     * logs that many of the most expensive magic entries at finalize().
      */
     TskModule::Status TSK_MODULE_EXPORT initialize(const char* arguments)
     {
-        magicHandle = magic_open(MAGIC_NONE);
+        // Called again, drop what the last call set up: the contexts were
+        // opened with its flags on its database
+        {
+            Poco::FastMutex::ScopedLock lock(poolMutex);
+            closeHandles();
+            magic_db_close(magicDb);
+            magicDb = NULL;
+        }
+        {
+            Poco::FastMutex::ScopedLock lock(cacheMutex);
+            cachedTypes.clear();
+            cacheIndex.clear();
+        }
+
+        uint32_t maxReadSize = DEFAULT_MAX_READ_SIZE;
+        bool cacheSizeGiven = false;
+        int flags = MAGIC_NONE;
+        cacheEntries = 0;
+        cachePath.clear();
+        profileLines = 0;
+        memoEntries = DEFAULT_MEMO_ENTRIES;
+        maxHandles = 0;
+        postMime = false;
+        memset(&stageTotals, 0, sizeof(stageTotals));
+
+        std::string args(arguments != NULL ? arguments : "");
+        std::string::size_type start = 0;
+        while (start < args.size()) {
+            std::string::size_type stop = args.find(';', start);
+            if (stop == std::string::npos)
+                stop = args.size();
+            const std::string arg(args, start, stop - start);
+            start = stop + 1;
+            if (arg.empty())
+                continue;
+
+            std::string::size_type eq = arg.find('=');
+            const std::string key(arg, 0, eq);
+            const std::string value(eq == std::string::npos ? "" : arg.substr(eq + 1));
+            char *end = NULL;
+            unsigned long number = strtoul(value.c_str(), &end, 10);
+            bool isNumber = !value.empty() && *end == '\0';
+
+            bool valid = true;
+            if (key == "flags") {
+                valid = parseMagicFlags(value, flags);
+            }
+            else if (key == "mime" && isNumber) {
+                postMime = number != 0;
+            }
+            else if (key == "maxread" && isNumber && number != 0) {
+                maxReadSize = number < FILE_BUFFER_SIZE ? FILE_BUFFER_SIZE : (uint32_t)number;
+            }
+            else if (key == "handles" && isNumber) {
+                maxHandles = number;
+            }
+            else if (key == "memo" && isNumber) {
+                memoEntries = number;
+            }
+            else if (key == "cache" && isNumber) {
+                cacheEntries = number;
+                cacheSizeGiven = true;
+            }
+            else if (key == "cachefile" && !value.empty()) {
+                cachePath = value;
+            }
+            else if (key == "profile" && isNumber) {
+                profileLines = number;
+            }
+            else {
+                valid = false;
+            }
+
+            if (!valid) {
+                std::wstringstream msg;
+                msg << L"FileTypeSigModule: Invalid module arguments: " << arguments;
+                LOGERROR(msg.str());
+                return TskModule::FAIL;
+            }
+        }
+        if (!cachePath.empty() && !cacheSizeGiven)
+            cacheEntries = DEFAULT_CACHE_ENTRIES;
+        if (cacheEntries == 0)
+            cachePath.clear();
+        // The MIME type comes from the same pass as the description
+        if (postMime && (flags & (MAGIC_MIME | MAGIC_APPLE)) == 0)
+            flags |= MAGIC_MIME_FIELDS;
+        magicFlags = profileLines != 0 ? flags | MAGIC_PROFILE : flags;
+
+        magic_t magicHandle = magic_open(MAGIC_NONE);
+        if (magicHandle == NULL) {
+            LOGERROR(L"FileTypeSigModule: Error allocating libmagic handle");
+            return TskModule::FAIL;
+        }
         
         std::string path = GetSystemProperty(TskSystemProperties::MODULE_DIR) + Poco::Path::separator() + name() + Poco::Path::separator() + "magic.mgc";
 
@@ -83,6 +593,7 @@ extern "C"
             std::wstringstream msg;
             msg << L"FileTypeSigModule: Magic file not found";
             LOGERROR(msg.str());
+            magic_close(magicHandle);
             return TskModule::FAIL;
         }
 
@@ -90,12 +601,83 @@ extern "C"
             std::wstringstream msg;
             msg << L"FileTypeSigModule: Error loading magic file: " << magic_error(magicHandle) << GetSystemPropertyW(TskSystemProperties::MODULE_DIR);
             LOGERROR(msg.str());
+            magic_close(magicHandle);
             return TskModule::FAIL;
         }
 
+        // Keep only the database; run() works on lightweight contexts
+        magicDb = magic_getdb(magicHandle);
+        magic_close(magicHandle);
+
+        // Not fatal: files are then matched in full every time
+        if (memoEntries != 0 && magic_db_memo(magicDb, memoEntries) == -1)
+            LOGWARN(L"FileTypeSigModule: Could not allocate the magic result memo");
+
+        for (size_t i = 0; i < maxHandles; i++) {
+            magic_ctx_t handle = magic_ctx_open(magicDb, magicFlags);
+            Poco::FastMutex::ScopedLock lock(poolMutex);
+            if (handle == NULL) {
+                LOGERROR(L"FileTypeSigModule: Error allocating libmagic handle");
+                closeHandles();
+                magic_db_close(magicDb);
+                magicDb = NULL;
+                return TskModule::FAIL;
+            }
+            freeHandles.push_back(handle);
+        }
+
+        size_t reach = magic_db_reach(magicDb);
+        readSize = reach < FILE_BUFFER_SIZE ? FILE_BUFFER_SIZE :
+            reach > maxReadSize ? maxReadSize : (uint32_t)reach;
+
+        if (!cachePath.empty()) {
+            // Types of files larger than readSize depend on how much was read
+            std::stringstream stamp;
+            stamp << name() << " " << version() << " " << (magicFlags & ~MAGIC_PROFILE) << " " << readSize
+                << " " << magicFile.getSize() << " " << magicFile.getLastModified().epochTime();
+            cacheStamp = stamp.str();
+            loadTypeCache();
+        }
+
         return TskModule::OK;
     }
 
+    /**
+     * Posts the file type found by libmagic to the blackboard: the
+     * description and, if postMime is set and there is one, the MIME type
+     * with context "mime".
+     */
+    static void addTypeAttribute(TskFile * pFile, const FileType & type)
+    {
+        // clean up type -- we've seen invalid UTF-8 data being returned
+        char cleanType[1024];
+        cleanType[1023] = '\0';
+        strncpy(cleanType, type.description.c_str(), 1023);
+        TskUtilities::cleanUTF8(cleanType);
+
+        // Add to blackboard
+        TskBlackboardAttribute attr(TSK_FILE_TYPE_SIG, name(), "", cleanType);
+        pFile->addGenInfoAttribute(attr);
+
+        if (!type.mime.empty()) {
+            TskBlackboardAttribute mimeAttr(TSK_FILE_TYPE_SIG, name(), "mime", type.mime.c_str());
+            pFile->addGenInfoAttribute(mimeAttr);
+        }
+    }
+
+    /**
+     * Posts the type cached under key, if there is one.
+     * @returns true if the type was posted.
+     */
+    static bool addCachedType(TskFile * pFile, const std::string & key)
+    {
+        FileType type;
+        if (key.empty() || !findCachedType(key, type))
+            return false;
+        addTypeAttribute(pFile, type);
+        return true;
+    }
+
     /**
      * The run() method is where the module's work is performed.
      * The module will be passed a pointer to a file from which both
@@ -116,10 +698,20 @@ extern "C"
 
         try
         {
-            char buffer[FILE_BUFFER_SIZE];
+            // A copy of a file seen before needs no reading at all
+            std::string key;
+            if (cacheEntries != 0) {
+                key = frameworkKey(pFile);
+                if (addCachedType(pFile, key))
+                    return TskModule::OK;
+            }
+
+            TSK_OFF_T fileSize = pFile->getSize();
+            size_t bufferSize = fileSize < (TSK_OFF_T)readSize ? (size_t)fileSize : readSize;
+            std::vector<char> buffer(bufferSize);
 
             //Do that magic magic
-            ssize_t readLen = pFile->read(buffer, FILE_BUFFER_SIZE);
+            ssize_t readLen = pFile->read(&buffer[0], bufferSize);
             // we shouldn't get zero as a return value since we know the file is not 0 sized at this point
             if (readLen <= 0) {
                 std::stringstream msg;
@@ -128,23 +720,38 @@ extern "C"
                 return TskModule::FAIL;
             }
 
-            const char *type = magic_buffer(magicHandle, buffer, readLen);
+            // Without a framework hash only files that fit in the buffer can
+            // be looked up, as the type may depend on any byte of the file
+            if (cacheEntries != 0 && key.empty() && readLen == fileSize) {
+                key = contentKey(&buffer[0], readLen);
+                if (addCachedType(pFile, key))
+                    return TskModule::OK;
+            }
+
+            MagicHandleLease handle;
+            if (handle.get() == NULL) {
+                LOGERROR("FileTypeSigModule: Error allocating libmagic handle");
+                return TskModule::FAIL;
+            }
+
+            // Tests at offsets past the buffer read the rest of the file on demand
+            const char *type = magic_reader(handle.get(), &buffer[0], readLen,
+                fileSize, readFileAt, pFile);
             if (type == NULL) {
                 std::stringstream msg;
-                msg << "FileTypeSigModule: Error getting file type: " << magic_error(magicHandle);
+                msg << "FileTypeSigModule: Error getting file type: " << magic_error(handle.get());
                 LOGERROR(msg.str());
                 return TskModule::FAIL;
             }
 
-            // clean up type -- we've seen invalid UTF-8 data being returned
-            char cleanType[1024];
-            cleanType[1023] = '\0';
-            strncpy(cleanType, type, 1023);
-            TskUtilities::cleanUTF8(cleanType);
+            // Left NULL unless the flags asked for MAGIC_MIME_FIELDS
+            const char *mimeType = NULL, *encoding = NULL;
+            magic_getmime(handle.get(), &mimeType, &encoding);
+            FileType found = makeFileType(type, mimeType, encoding);
 
-            // Add to blackboard
-            TskBlackboardAttribute attr(TSK_FILE_TYPE_SIG, name(), "", cleanType);
-            pFile->addGenInfoAttribute(attr);
+            if (!key.empty())
+                cacheType(key, found);
+            addTypeAttribute(pFile, found);
         }
         catch (TskException& tskEx)
         {
@@ -164,8 +771,187 @@ extern "C"
         return TskModule::OK;
     }
 
+    /**
+     * Processes a block of files at once. Files that fit in the read window
+     * are classified together by magic_buffer_batch(), which spreads the
+     * per-call setup of libmagic over the block; larger files go to run().
+     * @param files The files to be processed.
+     * @param count The number of files.
+     * @returns TskModule::OK if all files were processed and TskModule::FAIL
+     * if any of them could not be.
+     */
+    TskModule::Status TSK_MODULE_EXPORT runBatch(TskFile ** files, size_t count)
+    {
+        if (files == NULL && count != 0)
+        {
+            LOGERROR("FileTypeSigModule: Passed NULL file array.");
+            return TskModule::FAIL;
+        }
+
+        TskModule::Status status = TskModule::OK;
+        std::vector<TskFile *> smallFiles;
+        std::vector<std::vector<char> > buffers;
+        std::vector<std::string> keys;
+
+        for (size_t i = 0; i < count; i++) {
+            TskFile * pFile = files[i];
+            if (pFile == NULL) {
+                LOGERROR("FileTypeSigModule: Passed NULL file pointer.");
+                status = TskModule::FAIL;
+                continue;
+            }
+
+            try
+            {
+                TSK_OFF_T fileSize = pFile->getSize();
+                if (fileSize == 0)
+                    continue;
+                if (fileSize > (TSK_OFF_T)readSize) {
+                    if (run(pFile) != TskModule::OK)
+                        status = TskModule::FAIL;
+                    continue;
+                }
+
+                std::string key;
+                if (cacheEntries != 0) {
+                    key = frameworkKey(pFile);
+                    if (addCachedType(pFile, key))
+                        continue;
+                }
+
+                std::vector<char> buffer((size_t)fileSize);
+                ssize_t readLen = pFile->read(&buffer[0], buffer.size());
+                if (readLen <= 0) {
+                    std::stringstream msg;
+                    msg << "FileTypeSigModule: Error reading file contents for file " << pFile->getId();
+                    LOGERROR(msg.str());
+                    status = TskModule::FAIL;
+                    continue;
+                }
+                buffer.resize(readLen);
+
+                if (cacheEntries != 0 && key.empty() && readLen == fileSize) {
+                    key = contentKey(&buffer[0], readLen);
+                    if (addCachedType(pFile, key))
+                        continue;
+                }
+
+                buffers.push_back(buffer);
+                smallFiles.push_back(pFile);
+                keys.push_back(key);
+            }
+            catch (TskException& tskEx)
+            {
+                std::stringstream msg;
+                msg << "FileTypeModule: Caught framework exception: " << tskEx.message();
+                LOGERROR(msg.str());
+                status = TskModule::FAIL;
+            }
+            catch (std::exception& ex)
+            {
+                std::stringstream msg;
+                msg << "FileTypeModule: Caught exception: " << ex.what();
+                LOGERROR(msg.str());
+                status = TskModule::FAIL;
+            }
+        }
+
+        if (smallFiles.empty())
+            return status;
+
+        std::vector<const void *> bufs(buffers.size());
+        std::vector<size_t> lens(buffers.size());
+        std::vector<const char *> types(buffers.size());
+        for (size_t i = 0; i < buffers.size(); i++) {
+            bufs[i] = &buffers[i][0];
+            lens[i] = buffers[i].size();
+        }
+
+        MagicHandleLease handle;
+        if (handle.get() == NULL) {
+            LOGERROR("FileTypeSigModule: Error allocating libmagic handle");
+            return TskModule::FAIL;
+        }
+        magic_buffer_batch(handle.get(), &bufs[0], &lens[0], bufs.size(), &types[0]);
+
+        for (size_t i = 0; i < smallFiles.size(); i++) {
+            if (types[i] == NULL) {
+                std::stringstream msg;
+                msg << "FileTypeSigModule: Error getting file type for file " << smallFiles[i]->getId();
+                LOGERROR(msg.str());
+                status = TskModule::FAIL;
+                continue;
+            }
+
+            try
+            {
+                const char *mimeType = NULL, *encoding = NULL;
+                magic_getmime_batch(handle.get(), i, &mimeType, &encoding);
+                FileType found = makeFileType(types[i], mimeType, encoding);
+
+                if (!keys[i].empty())
+                    cacheType(keys[i], found);
+                addTypeAttribute(smallFiles[i], found);
+            }
+            catch (TskException& tskEx)
+            {
+                std::stringstream msg;
+                msg << "FileTypeModule: Caught framework exception: " << tskEx.message();
+                LOGERROR(msg.str());
+                status = TskModule::FAIL;
+            }
+            catch (std::exception& ex)
+            {
+                std::stringstream msg;
+                msg << "FileTypeModule: Caught exception: " << ex.what();
+                LOGERROR(msg.str());
+                status = TskModule::FAIL;
+            }
+        }
+
+        return status;
+    }
+
     TskModule::Status TSK_MODULE_EXPORT finalize()
     {
+        if (!cachePath.empty()) {
+            try {
+                if (!saveTypeCache())
+                    LOGWARN(L"FileTypeSigModule: Error writing the type cache file");
+            }
+            catch (std::exception& ex) {
+                std::stringstream msg;
+                msg << "FileTypeSigModule: Error writing the type cache file: " << ex.what();
+                LOGWARN(msg.str());
+            }
+        }
+        cachedTypes.clear();
+        cacheIndex.clear();
+
+        Poco::FastMutex::ScopedLock lock(poolMutex);
+
+        closeHandles();
+        logStageStats(stageTotals);
+
+        // The counts of the contexts are in the database once they are closed
+        if (profileLines != 0 && magicDb != NULL) {
+            magic_ctx_t handle = magic_ctx_open(magicDb, MAGIC_NONE);
+            const char *report = handle != NULL ? magic_profile(handle, profileLines) : NULL;
+            if (report != NULL) {
+                std::stringstream msg;
+                msg << "FileTypeSigModule: Most expensive magic entries:\n" << report;
+                LOGINFO(msg.str());
+            }
+            else {
+                LOGWARN(L"FileTypeSigModule: Could not get the magic profile");
+            }
+            if (handle != NULL)
+                magic_close(handle);
+        }
+
+        magic_db_close(magicDb);
+        magicDb = NULL;
+
         return TskModule::OK;
     }
 }
@@ -71,8 +71,23 @@ FILE_RCSID("@(#)$File: apprentice.c,v 1.170 2011/06/10 09:23:28 christos Exp $")
 #define MAP_FILE 0
 #endif
 
+/* Where section n of a compiled image is */
+#define SECT(h, n)	((void *)((char *)(void *)(h) + (h)->sect[n].offset))
+
+/*
+ * The text of an entry as it is parsed, before it goes to the string
+ * pool of the list
+ */
+struct magic_text {
+	char desc[MAXDESC];	/* description */
+	char mimetype[MAXDESC]; /* MIME type */
+	char apple[8];
+};
+
 struct magic_entry {
 	struct magic *mp;	
+	struct magic_text *dp;	/* descriptions, parallel to mp */
+	const char *file;	/* magic file the entry is in */
 	uint32_t cont_count;
 	uint32_t max_count;
 };
@@ -90,23 +105,37 @@ private int parse(struct magic_set *, struct magic_entry **, uint32_t *,
     const char *, size_t, int);
 private void eatsize(const char **);
 private int apprentice_1(struct magic_set *, const char *, int, struct mlist *);
-private size_t apprentice_magic_strength(const struct magic *);
 private int apprentice_sort(const void *, const void *);
 private void apprentice_list(struct mlist *, int );
-private int apprentice_load(struct magic_set *, struct magic **, uint32_t *,
-    const char *, int);
-private void byteswap(struct magic *, uint32_t);
+private int apprentice_regex(struct magic_set *, struct mlist *);
+private int apprentice_index(struct magic_set *, struct mlist *);
+private int apprentice_search(struct magic_set *, struct mlist *);
+private int search_saved(const struct magic_hdr *);
+private void apprentice_reach(struct mlist *);
+private void apprentice_image(struct mlist *, struct magic_hdr *, int,
+    size_t);
+private int apprentice_load(struct magic_set *, struct magic_hdr **,
+    size_t *, const char *, int);
+private void byteswap(struct magic_hdr *);
 private void bs1(struct magic *);
+private void bshdr(struct magic_hdr *);
+private int apprentice_old(struct magic_set *, int, size_t, int,
+    struct magic_hdr **, size_t *);
 private uint16_t swap2(uint16_t);
 private uint32_t swap4(uint32_t);
 private uint64_t swap8(uint64_t);
 private char *mkdbname(struct magic_set *, const char *, int);
-private int apprentice_map(struct magic_set *, struct magic **, uint32_t *,
+private int apprentice_map(struct magic_set *, struct magic_hdr **, size_t *,
     const char *);
-private int apprentice_compile(struct magic_set *, struct magic **, uint32_t *,
+private int apprentice_checkhdr(struct magic_set *, const struct magic_hdr *,
+    size_t, const char *);
+private int apprentice_checkimg(struct magic_set *, struct magic_hdr *,
     const char *);
+private int apprentice_compile(struct magic_set *, struct magic_hdr *,
+    size_t, const char *);
 private int check_format_type(const char *, int);
-private int check_format(struct magic_set *, struct magic *);
+private int check_format(struct magic_set *, struct magic *,
+    const struct magic_text *);
 private int get_op(char);
 private int parse_mime(struct magic_set *, struct magic_entry *, const char *);
 private int parse_strength(struct magic_set *, struct magic_entry *, const char *);
@@ -115,6 +144,7 @@ private int parse_apple(struct magic_set *, struct magic_entry *, const char *);
 
 private size_t maxmagic = 0;
 private size_t magicsize = sizeof(struct magic);
+private size_t descsize = sizeof(struct magic_desc);
 
 private const char usg_hdr[] = "cont\toffset\ttype\topcode\tmask\tvalue\tdesc";
 
@@ -257,53 +287,78 @@ private int
 apprentice_1(struct magic_set *ms, const char *fn, int action,
     struct mlist *mlist)
 {
-	struct magic *magic = NULL;
-	uint32_t nmagic = 0;
+	struct magic_hdr *image = NULL;
+	size_t isize = 0;
 	struct mlist *ml;
 	int rv = -1;
 	int mapped;
 
 	if (magicsize != FILE_MAGICSIZE) {
 		file_error(ms, 0, "magic element size %lu != %lu",
-		    (unsigned long)sizeof(*magic),
+		    (unsigned long)magicsize,
 		    (unsigned long)FILE_MAGICSIZE);
 		return -1;
 	}
+	if (descsize != FILE_DESCSIZE) {
+		file_error(ms, 0, "magic description size %lu != %lu",
+		    (unsigned long)descsize,
+		    (unsigned long)FILE_DESCSIZE);
+		return -1;
+	}
 
 	if (action == FILE_COMPILE) {
-		rv = apprentice_load(ms, &magic, &nmagic, fn, action);
+		rv = apprentice_load(ms, &image, &isize, fn, action);
 		if (rv != 0)
 			return -1;
-		rv = apprentice_compile(ms, &magic, &nmagic, fn);
-		free(magic);
+		rv = apprentice_compile(ms, image, isize, fn);
+		free(image);
 		return rv;
 	}
 
 #ifndef COMPILE_ONLY
-	if ((rv = apprentice_map(ms, &magic, &nmagic, fn)) == -1) {
+	if ((rv = apprentice_map(ms, &image, &isize, fn)) == -1) {
 		if (ms->flags & MAGIC_CHECK)
 			file_magwarn(ms, "using regular magic file `%s'", fn);
-		rv = apprentice_load(ms, &magic, &nmagic, fn, action);
+		rv = apprentice_load(ms, &image, &isize, fn, action);
 		if (rv != 0)
 			return -1;
 	}
 
 	mapped = rv;
 	     
-	if (magic == NULL) {
-		file_delmagic(magic, mapped, nmagic);
+	if (image == NULL)
 		return -1;
-	}
 
 	if ((ml = CAST(struct mlist *, malloc(sizeof(*ml)))) == NULL) {
-		file_delmagic(magic, mapped, nmagic);
+		file_delmagic(image, mapped, isize);
 		file_oomem(ms, sizeof(*ml));
 		return -1;
 	}
 
-	ml->magic = magic;
-	ml->nmagic = nmagic;
-	ml->mapped = mapped;
+	apprentice_image(ml, image, mapped, isize);
+	ml->regex = NULL;
+	ml->index = NULL;
+	ml->search = NULL;
+	ml->reach = 0;
+
+	if (action == FILE_LOAD && (apprentice_regex(ms, ml) == -1 ||
+	    apprentice_index(ms, ml) == -1 ||
+	    apprentice_search(ms, ml) == -1)) {
+		file_delcompiled(ml);
+		file_delmagic(image, mapped, isize);
+		free(ml);
+		return -1;
+	}
+	apprentice_reach(ml);
+	if ((ml->name = strdup(fn)) == NULL) {
+		file_oomem(ms, strlen(fn));
+		file_delcompiled(ml);
+		file_delmagic(image, mapped, isize);
+		free(ml);
+		return -1;
+	}
+	ml->first = mlist->prev == mlist ? 0 :
+	    mlist->prev->first + mlist->prev->nmagic;
 
 	mlist->prev->next = ml;
 	ml->prev = mlist->prev;
@@ -321,27 +376,704 @@ apprentice_1(struct magic_set *ms, const char *fn, int action,
 #endif /* COMPILE_ONLY */
 }
 
+/*
+ * Point a list at the entries and descriptions in its image
+ */
+private void
+apprentice_image(struct mlist *ml, struct magic_hdr *image, int mapped,
+    size_t isize)
+{
+	ml->image = image;
+	ml->isize = isize;
+	ml->mapped = mapped;
+	ml->magic = CAST(struct magic *, SECT(image, MAGIC_SECT_MAGIC));
+	ml->desc = CAST(struct magic_desc *, SECT(image, MAGIC_SECT_DESC));
+	ml->nmagic = image->nmagic;
+}
+
+/*
+ * Get the regex patterns of a list compiled once, from the regex cache,
+ * instead of on every match. A pattern that does not compile is left
+ * out; magiccheck() then tries it itself and reports the error as
+ * before.
+ */
+private int
+apprentice_regex(struct magic_set *ms, struct mlist *ml)
+{
+	uint32_t i;
+	size_t len = (ml->nmagic ? ml->nmagic : 1) * sizeof(*ml->regex);
+
+	if ((ml->regex = CAST(struct magic_regex **, calloc(1, len))) == NULL) {
+		file_oomem(ms, len);
+		return -1;
+	}
+	for (i = 0; i < ml->nmagic; i++) {
+		struct magic *m = &ml->magic[i];
+
+		if (m->type == FILE_REGEX)
+			ml->regex[i] = file_regcomp(NULL, m->value.s,
+			    FILE_REGEX_CFLAGS(m));
+	}
+	return 0;
+}
+
+/*
+ * Find the bytes that a top-level entry needs at its offset, if it can
+ * only match when they are there. That holds for an equality test of a
+ * plain constant at a fixed offset: the raw value must then equal the
+ * low bits of the (sign extended) constant.
+ */
+private int
+index_key(const struct magic *m, struct magic_ikey *k)
+{
+	uint64_t l = m->value.q;
+	uint16_t h;
+	uint32_t w;
+
+	if (m->reln != '=' || (m->flag & INDIR) != 0 ||
+	    m->offset > 0x7fffffff)
+		return 0;
+
+	switch (m->type) {
+	case FILE_BYTE:
+	case FILE_SHORT:
+	case FILE_BESHORT:
+	case FILE_LESHORT:
+	case FILE_LONG:
+	case FILE_BELONG:
+	case FILE_LELONG:
+		if ((m->mask_op & FILE_OPINVERSE) != 0 || m->num_mask != 0)
+			return 0;
+		break;
+	case FILE_STRING:
+		if ((m->str_flags & (STRING_COMPACT_WHITESPACE|
+		    STRING_COMPACT_OPTIONAL_WHITESPACE|STRING_IGNORE_CASE))
+		    != 0 || m->vallen == 0)
+			return 0;
+		break;
+	default:
+		return 0;
+	}
+
+	switch (m->type) {
+	case FILE_BYTE:
+		k->len = 1;
+		k->val[0] = CAST(uint8_t, l);
+		break;
+	case FILE_SHORT:
+		h = CAST(uint16_t, l);
+		k->len = 2;
+		(void)memcpy(k->val, &h, sizeof(h));
+		break;
+	case FILE_BESHORT:
+		k->len = 2;
+		k->val[0] = CAST(uint8_t, l >> 8);
+		k->val[1] = CAST(uint8_t, l);
+		break;
+	case FILE_LESHORT:
+		k->len = 2;
+		k->val[0] = CAST(uint8_t, l);
+		k->val[1] = CAST(uint8_t, l >> 8);
+		break;
+	case FILE_LONG:
+		w = CAST(uint32_t, l);
+		k->len = 4;
+		(void)memcpy(k->val, &w, sizeof(w));
+		break;
+	case FILE_BELONG:
+		k->len = 4;
+		k->val[0] = CAST(uint8_t, l >> 24);
+		k->val[1] = CAST(uint8_t, l >> 16);
+		k->val[2] = CAST(uint8_t, l >> 8);
+		k->val[3] = CAST(uint8_t, l);
+		break;
+	case FILE_LELONG:
+		k->len = 4;
+		k->val[0] = CAST(uint8_t, l);
+		k->val[1] = CAST(uint8_t, l >> 8);
+		k->val[2] = CAST(uint8_t, l >> 16);
+		k->val[3] = CAST(uint8_t, l >> 24);
+		break;
+	case FILE_STRING:
+		k->len = MIN(m->vallen, sizeof(k->val));
+		(void)memcpy(k->val, m->value.s, k->len);
+		break;
+	}
+	k->offset = m->offset;
+	return 1;
+}
+
+private int
+cmpikey(const void *a, const void *b)
+{
+	const struct magic_ikey *ka = CAST(const struct magic_ikey *, a);
+	const struct magic_ikey *kb = CAST(const struct magic_ikey *, b);
+
+	if (ka->offset != kb->offset)
+		return ka->offset < kb->offset ? -1 : 1;
+	if (ka->val[0] != kb->val[0])
+		return ka->val[0] < kb->val[0] ? -1 : 1;
+	return ka->magindex < kb->magindex ? -1 : ka->magindex > kb->magindex;
+}
+
+/*
+ * Build the dispatch index over the top-level entries of a list
+ */
+private int
+apprentice_index(struct magic_set *ms, struct mlist *ml)
+{
+	struct magic_index *ix;
+	struct magic_ikey k;
+	uint32_t i, nkey, noff;
+	size_t len;
+
+	if ((ix = CAST(struct magic_index *, calloc(1, sizeof(*ix)))) == NULL) {
+		file_oomem(ms, sizeof(*ix));
+		return -1;
+	}
+	ml->index = ix;
+	ix->nwords = (ml->nmagic + 31) / 32 + 1;
+	if (ml->image->sect[MAGIC_SECT_IALWAYS].size != 0) {
+		/* Saved by apprentice_compile(); use it where it is */
+		struct magic_hdr *h = ml->image;
+		ix->always = CAST(uint32_t *, SECT(h, MAGIC_SECT_IALWAYS));
+		ix->off = CAST(struct magic_ioff *, SECT(h, MAGIC_SECT_IOFF));
+		ix->noff = h->sect[MAGIC_SECT_IOFF].size / sizeof(*ix->off);
+		ix->key = CAST(struct magic_ikey *, SECT(h, MAGIC_SECT_IKEY));
+		ix->nkey = h->sect[MAGIC_SECT_IKEY].size / sizeof(*ix->key);
+		ix->mapped = 1;
+		return 0;
+	}
+	len = ix->nwords * sizeof(*ix->always);
+	if ((ix->always = CAST(uint32_t *, calloc(1, len))) == NULL) {
+		file_oomem(ms, len);
+		return -1;
+	}
+
+	for (nkey = 0, i = 0; i < ml->nmagic; i++)
+		if (ml->magic[i].cont_level == 0 &&
+		    index_key(&ml->magic[i], &k))
+			nkey++;
+	len = (nkey ? nkey : 1) * sizeof(*ix->key);
+	/* cleared, as the keys are saved in compiled files */
+	if ((ix->key = CAST(struct magic_ikey *, calloc(1, len))) == NULL) {
+		file_oomem(ms, len);
+		return -1;
+	}
+
+	for (nkey = 0, i = 0; i < ml->nmagic; i++) {
+		if (ml->magic[i].cont_level != 0)
+			continue;
+		if (index_key(&ml->magic[i], &ix->key[nkey])) {
+			ix->key[nkey++].magindex = i;
+		} else
+			ix->always[i / 32] |= 1U << (i % 32);
+	}
+	qsort(ix->key, nkey, sizeof(*ix->key), cmpikey);
+	ix->nkey = nkey;
+
+	for (noff = 0, i = 0; i < nkey; i++)
+		if (i == 0 || ix->key[i].offset != ix->key[i - 1].offset)
+			noff++;
+	len = (noff ? noff : 1) * sizeof(*ix->off);
+	if ((ix->off = CAST(struct magic_ioff *, malloc(len))) == NULL) {
+		file_oomem(ms, len);
+		return -1;
+	}
+	for (noff = 0, i = 0; i < nkey; i++) {
+		if (i == 0 || ix->key[i].offset != ix->key[i - 1].offset) {
+			ix->off[noff].offset = ix->key[i].offset;
+			ix->off[noff].key = i;
+			ix->off[noff++].nkey = 0;
+		}
+		ix->off[noff - 1].nkey++;
+	}
+	ix->noff = noff;
+	return 0;
+}
+
+/*
+ * Skip a bracket expression or a parenthesized group of an extended
+ * regex; returns where it ends or NULL if it does not.
+ */
+private const char *
+regex_skip(const char *p)
+{
+	int depth = 0;
+
+	do {
+		switch (*p) {
+		case '\0':
+			return NULL;
+		case '\\':
+			if (*++p == '\0')
+				return NULL;
+			p++;
+			break;
+		case '[':
+			if (*++p == '^')
+				p++;
+			if (*p == ']')
+				p++;
+			for (; *p != ']'; p++) {
+				if (*p == '\0')
+					return NULL;
+				if (*p == '[' && (p[1] == ':' || p[1] == '.' ||
+				    p[1] == '=')) {
+					char d = p[1];
+					for (p += 2; *p != d || p[1] != ']'; p++)
+						if (*p == '\0')
+							return NULL;
+					p++;
+				}
+			}
+			p++;
+			break;
+		case '(':
+			depth++;
+			p++;
+			break;
+		case ')':
+			depth--;
+			p++;
+			break;
+		default:
+			p++;
+			break;
+		}
+	} while (depth > 0);
+	return p;
+}
+
+/*
+ * Get the folded literal that every match of a regex entry contains:
+ * the longest run of plain characters at the top level of the pattern,
+ * outside groups, alternatives and repetitions.  Returns its length,
+ * 0 if there is none or the pattern is not understood.
+ */
+private size_t
+regex_literal(const struct magic *m, unsigned char *lit)
+{
+	const char *p, *q;
+	unsigned char run[sizeof(m->value.s)];
+	size_t i, len = 0, best = 0;
+	int c, icase = (m->str_flags & STRING_IGNORE_CASE) != 0;
+
+	/* give up on alternatives at the top level */
+	for (p = m->value.s; *p; ) {
+		if (*p == '|' || *p == ')')
+			return 0;
+		if (*p == '[' || *p == '(') {
+			if ((p = regex_skip(p)) == NULL)
+				return 0;
+		} else
+			p += (*p == '\\' && p[1] != '\0') ? 2 : 1;
+	}
+
+	for (p = m->value.s; *p; p = q) {
+		c = -1;
+		switch (*p) {
+		case '[':
+		case '(':
+			q = regex_skip(p);
+			break;
+		case '\\':
+			/* letters, digits and these are GNU operators */
+			if (ispunct(CAST(unsigned char, p[1])) &&
+			    strchr("<>`'", p[1]) == NULL)
+				c = CAST(unsigned char, p[1]);
+			q = p[1] ? p + 2 : p + 1;
+			break;
+		case '.':
+		case '^':
+		case '$':
+			q = p + 1;
+			break;
+		case '*':
+		case '+':
+		case '?':
+		case '{':
+			return 0;	/* repeats nothing */
+		default:
+			c = CAST(unsigned char, *p);
+			q = p + 1;
+			break;
+		}
+		if (icase && c >= 0x80)	/* folded beyond tolower() */
+			c = -1;
+		if (*q == '*' || *q == '+' || *q == '?' || *q == '{') {
+			/* a repeated atom ends the run, once if at all */
+			if (*q == '*' || *q == '?' ||
+			    (*q == '{' && strtoul(q + 1, NULL, 10) == 0))
+				c = -1;
+			if (c != -1)
+				run[len++] = CAST(unsigned char, c);
+			c = -1;
+			if (*q == '{' && (q = strchr(q, '}')) == NULL)
+				return 0;
+			q++;
+			if (*q != '\0' && strchr("*+?{", *q) != NULL)
+				return 0;
+		}
+		if (c != -1) {
+			run[len++] = CAST(unsigned char, c);
+			continue;
+		}
+		if (len > best) {
+			best = len;
+			(void)memcpy(lit, run, MIN(len, SEARCH_MAXLIT));
+		}
+		len = 0;
+	}
+	if (len > best) {
+		best = len;
+		(void)memcpy(lit, run, MIN(len, SEARCH_MAXLIT));
+	}
+	best = MIN(best, SEARCH_MAXLIT);
+	for (i = 0; i < best; i++)
+		lit[i] = CAST(unsigned char, tolower(lit[i]));
+	return best;
+}
+
+/*
+ * Get the folded literal that every match of a search entry starts
+ * with, or that every match of a regex entry contains; returns its
+ * length, 0 if there is none.
+ */
+private size_t
+search_literal(const struct magic *m, unsigned char *lit)
+{
+	size_t i, len = MIN(m->vallen, sizeof(m->value.s));
+	int blanks = (m->str_flags & (STRING_COMPACT_WHITESPACE|
+	    STRING_COMPACT_OPTIONAL_WHITESPACE)) != 0;
+
+	/* only match or no match can be told from the literal */
+	if (m->reln != '=' && m->reln != '!')
+		return 0;
+	if (m->type == FILE_REGEX)
+		return regex_literal(m, lit);
+	if (m->type != FILE_SEARCH)
+		return 0;
+	len = MIN(len, SEARCH_MAXLIT);
+	for (i = 0; i < len; i++) {
+		unsigned char c = CAST(unsigned char, m->value.s[i]);
+		if (blanks && isspace(c))
+			break;
+		lit[i] = CAST(unsigned char, tolower(c));
+	}
+	return i;
+}
+
+/*
+ * Tell whether an image has a literal automaton saved with it that was
+ * built with the same case folding as the current locale has.
+ */
+private int
+search_saved(const struct magic_hdr *h)
+{
+	const unsigned char *fold;
+	int c;
+
+	if (h->sect[MAGIC_SECT_SOUT].size == 0)
+		return 0;
+	fold = CAST(const unsigned char *, (const void *)h) +
+	    h->sect[MAGIC_SECT_SFOLD].offset;
+	for (c = 0; c < 256; c++)
+		if (fold[c] != (tolower(c) & 0xff))
+			return 0;
+	return 1;
+}
+
+/*
+ * Build the literal automaton for the FILE_SEARCH and FILE_REGEX
+ * entries of a list, so that one pass over a region tells which of
+ * them can match there.
+ */
+private int
+apprentice_search(struct magic_set *ms, struct mlist *ml)
+{
+	struct magic_search *sr;
+	unsigned char *lits = NULL, lit[SEARCH_MAXLIT];
+	uint32_t *fail = NULL, *queue = NULL, *nout = NULL;
+	uint32_t i, j, c, q, r, len, maxstate, head, tail;
+	size_t n, reach;
+	int used[256];
+
+	if ((sr = CAST(struct magic_search *, calloc(1, sizeof(*sr))))
+	    == NULL) {
+		file_oomem(ms, sizeof(*sr));
+		return -1;
+	}
+	ml->search = sr;
+	if (search_saved(ml->image)) {
+		/* Saved by apprentice_compile(); use it where it is */
+		struct magic_hdr *h = ml->image;
+		sr->lit = CAST(uint32_t *, SECT(h, MAGIC_SECT_SLIT));
+		sr->litlen = CAST(uint8_t *, SECT(h, MAGIC_SECT_SLITLEN));
+		sr->nlit = h->sect[MAGIC_SECT_SLITLEN].size;
+		(void)memcpy(sr->class, SECT(h, MAGIC_SECT_SCLASS),
+		    sizeof(sr->class));
+		sr->nclass = h->nclass;
+		sr->delta = CAST(uint32_t *, SECT(h, MAGIC_SECT_SDELTA));
+		sr->out = CAST(uint32_t *, SECT(h, MAGIC_SECT_SOUT));
+		sr->nstate = h->sect[MAGIC_SECT_SOUT].size /
+		    sizeof(*sr->out) - 1;
+		sr->outs = CAST(uint32_t *, SECT(h, MAGIC_SECT_SOUTS));
+		sr->reach = h->reach;
+		sr->mapped = 1;
+		return 0;
+	}
+	n = (ml->nmagic ? ml->nmagic : 1) * sizeof(*sr->lit);
+	if ((sr->lit = CAST(uint32_t *, malloc(n))) == NULL ||
+	    (sr->litlen = CAST(uint8_t *, malloc(ml->nmagic + 1))) == NULL ||
+	    (lits = CAST(unsigned char *, malloc((ml->nmagic + 1) *
+	    SEARCH_MAXLIT))) == NULL)
+		goto oomem;
+
+	/* Collect the distinct literals */
+	(void)memset(used, 0, sizeof(used));
+	for (maxstate = 1, i = 0; i < ml->nmagic; i++) {
+		struct magic *m = &ml->magic[i];
+
+		sr->lit[i] = SEARCH_NOLIT;
+		if ((len = search_literal(m, lit)) == 0)
+			continue;
+		for (j = 0; j < sr->nlit; j++)
+			if (sr->litlen[j] == len &&
+			    memcmp(lits + j * SEARCH_MAXLIT, lit, len) == 0)
+				break;
+		if (j == sr->nlit) {
+			(void)memcpy(lits + j * SEARCH_MAXLIT, lit, len);
+			sr->litlen[sr->nlit++] = CAST(uint8_t, len);
+			maxstate += len;
+			for (c = 0; c < len; c++)
+				used[lit[c]] = 1;
+		}
+		sr->lit[i] = j;
+		if (m->type != FILE_SEARCH)
+			continue;	/* regexes count lines, not bytes */
+		reach = m->str_range + MIN(m->vallen, sizeof(m->value.s));
+		sr->reach = MAX(sr->reach, reach);
+	}
+
+	/* Symbol classes: one per folded byte used, 0 for the rest */
+	sr->nclass = 1;
+	for (c = 0; c < 256; c++)
+		if (used[c])
+			used[c] = sr->nclass++;
+	for (c = 0; c < 256; c++)
+		sr->class[c] = CAST(uint16_t, used[tolower(c) & 0xff]);
+
+	/* The trie; transition 0 means none, as no edge leads to the root */
+	n = maxstate * sr->nclass * sizeof(*sr->delta);
+	if ((sr->delta = CAST(uint32_t *, calloc(1, n))) == NULL ||
+	    (fail = CAST(uint32_t *, calloc(maxstate, sizeof(*fail)))) == NULL ||
+	    (queue = CAST(uint32_t *, malloc(maxstate * sizeof(*queue))))
+	    == NULL ||
+	    (nout = CAST(uint32_t *, calloc(maxstate, sizeof(*nout)))) == NULL)
+		goto oomem;
+	sr->nstate = 1;
+	for (j = 0; j < sr->nlit; j++) {
+		for (q = 0, c = 0; c < sr->litlen[j]; c++) {
+			uint32_t *d = &sr->delta[q * sr->nclass +
+			    used[lits[j * SEARCH_MAXLIT + c]]];
+			if (*d == 0)
+				*d = sr->nstate++;
+			q = *d;
+		}
+		nout[q] = j + 1;	/* literal ending here, plus one */
+	}
+
+	/*
+	 * Breadth first, complete each state's row from its failure state
+	 * and count the literals that end there.
+	 */
+	head = tail = 0;
+	queue[tail++] = 0;
+	while (head < tail) {
+		q = queue[head++];
+		for (c = 0; c < sr->nclass; c++) {
+			uint32_t *d = &sr->delta[q * sr->nclass + c];
+			if (*d != 0) {
+				r = *d;
+				fail[r] = q ? sr->delta[fail[q] * sr->nclass + c]
+				    : 0;
+				queue[tail++] = r;
+			} else if (q != 0)
+				*d = sr->delta[fail[q] * sr->nclass + c];
+		}
+	}
+
+	/*
+	 * List the literals ending at each state: its own and those of
+	 * its failure states, found in out[q] .. out[q + 1] of outs[].
+	 */
+	if ((sr->out = CAST(uint32_t *, malloc((sr->nstate + 1) *
+	    sizeof(*sr->out)))) == NULL)
+		goto oomem;
+	for (n = 0, q = 0; q < sr->nstate; q++) {
+		sr->out[q] = CAST(uint32_t, n);
+		for (r = q; r != 0; r = fail[r])
+			if (nout[r])
+				n++;
+	}
+	sr->out[sr->nstate] = CAST(uint32_t, n);
+	if ((sr->outs = CAST(uint32_t *, malloc((n ? n : 1) *
+	    sizeof(*sr->outs)))) == NULL)
+		goto oomem;
+	for (n = 0, q = 0; q < sr->nstate; q++)
+		for (r = q; r != 0; r = fail[r])
+			if (nout[r])
+				sr->outs[n++] = nout[r] - 1;
+
+	free(lits);
+	free(fail);
+	free(queue);
+	free(nout);
+	return 0;
+oomem:
+	free(lits);
+	free(fail);
+	free(queue);
+	free(nout);
+	file_oomem(ms, n);
+	return -1;
+}
+
+/*
+ * Find how far from the start of a file the entries of a list can look
+ * when their offsets are fixed: not indirect, nor relative to an
+ * earlier match.  Regex and FILE_INDIRECT entries look as far as the
+ * data lets them, so they do not count.
+ */
+private void
+apprentice_reach(struct mlist *ml)
+{
+	const struct magic *m;
+	size_t len, reach = 0;
+	uint32_t i;
+
+	for (i = 0; i < ml->nmagic; i++) {
+		m = &ml->magic[i];
+		if ((m->flag & (INDIR|OFFADD)) != 0)
+			continue;
+		switch (m->type) {
+		case FILE_BYTE:
+			len = 1;
+			break;
+		case FILE_SHORT:
+		case FILE_BESHORT:
+		case FILE_LESHORT:
+			len = 2;
+			break;
+		case FILE_LONG:
+		case FILE_BELONG:
+		case FILE_LELONG:
+		case FILE_MELONG:
+		case FILE_DATE:
+		case FILE_BEDATE:
+		case FILE_LEDATE:
+		case FILE_MEDATE:
+		case FILE_LDATE:
+		case FILE_BELDATE:
+		case FILE_LELDATE:
+		case FILE_MELDATE:
+		case FILE_FLOAT:
+		case FILE_BEFLOAT:
+		case FILE_LEFLOAT:
+		case FILE_BEID3:
+		case FILE_LEID3:
+			len = 4;
+			break;
+		case FILE_QUAD:
+		case FILE_BEQUAD:
+		case FILE_LEQUAD:
+		case FILE_QDATE:
+		case FILE_BEQDATE:
+		case FILE_LEQDATE:
+		case FILE_QLDATE:
+		case FILE_BEQLDATE:
+		case FILE_LEQLDATE:
+		case FILE_DOUBLE:
+		case FILE_BEDOUBLE:
+		case FILE_LEDOUBLE:
+			len = 8;
+			break;
+		case FILE_STRING:
+		case FILE_PSTRING:
+			/* what is printed may be longer than what is tested */
+			len = sizeof(m->value);
+			break;
+		case FILE_BESTRING16:
+		case FILE_LESTRING16:
+			len = 2 * sizeof(m->value);
+			break;
+		case FILE_SEARCH:
+			len = m->str_range + m->vallen;
+			break;
+		default:
+			continue;
+		}
+		reach = MAX(reach, m->offset + len);
+	}
+	ml->reach = reach;
+}
+
+/*
+ * Free what was built from a list when it was loaded
+ */
+protected void
+file_delcompiled(struct mlist *ml)
+{
+	uint32_t i;
+
+	if (ml->search != NULL) {
+		if (!ml->search->mapped) {
+			free(ml->search->lit);
+			free(ml->search->litlen);
+			free(ml->search->delta);
+			free(ml->search->out);
+			free(ml->search->outs);
+		}
+		free(ml->search);
+		ml->search = NULL;
+	}
+	if (ml->index != NULL) {
+		if (!ml->index->mapped) {
+			free(ml->index->always);
+			free(ml->index->off);
+			free(ml->index->key);
+		}
+		free(ml->index);
+		ml->index = NULL;
+	}
+	if (ml->regex == NULL)
+		return;
+	for (i = 0; i < ml->nmagic; i++)
+		if (ml->regex[i] != NULL)
+			file_regfree(ml->regex[i]);
+	free(ml->regex);
+	ml->regex = NULL;
+}
+
 protected void
-file_delmagic(struct magic *p, int type, size_t entries)
+file_delmagic(struct magic_hdr *image, int type, size_t size)
 {
-	if (p == NULL)
+	if (image == NULL)
 		return;
 	switch (type) {
 	case 2:
 #ifdef QUICK
-		p--;
-		(void)munmap((void *)p, sizeof(*p) * (entries + 1));
+		(void)munmap((void *)image, size);
 		break;
 #else
-		(void)&entries;
+		(void)&size;
 		abort();
 		/*NOTREACHED*/
 #endif
 	case 1:
-		p--;
-		/*FALLTHROUGH*/
 	case 0:
-		free(p);
+		free(image);
 		break;
 	default:
 		abort();
@@ -398,8 +1130,8 @@ file_apprentice(struct magic_set *ms, const char *fn, int action)
 /*
  * Get weight of this magic entry, for sorting purposes.
  */
-private size_t
-apprentice_magic_strength(const struct magic *m)
+protected size_t
+file_magic_strength(const struct magic *m, const char *desc)
 {
 #define MULT 10
 	size_t val = 2 * MULT;	/* baseline strength */
@@ -528,7 +1260,7 @@ apprentice_magic_strength(const struct magic *m)
 	 * Magic entries with no description get a bonus because they depend
 	 * on subsequent magic entries to print something.
 	 */
-	if (m->desc[0] == '\0')
+	if (desc[0] == '\0')
 		val++;
 	return val;
 }
@@ -541,8 +1273,8 @@ apprentice_sort(const void *a, const void *b)
 {
 	const struct magic_entry *ma = CAST(const struct magic_entry *, a);
 	const struct magic_entry *mb = CAST(const struct magic_entry *, b);
-	size_t sa = apprentice_magic_strength(ma->mp);
-	size_t sb = apprentice_magic_strength(mb->mp);
+	size_t sa = file_magic_strength(ma->mp, ma->dp->desc);
+	size_t sb = file_magic_strength(mb->mp, mb->dp->desc);
 	if (sa == sb)
 		return 0;
 	else if (sa > sb)
@@ -562,6 +1294,7 @@ apprentice_list(struct mlist *mlist, int mode)
 	for (ml = mlist->next; ml != mlist; ml = ml->next) {
 		for (magindex = 0; magindex < ml->nmagic; magindex++) {
 			struct magic *m = &ml->magic[magindex];
+			struct magic_desc *d = &ml->desc[magindex];
 			if ((m->flag & mode) != mode) {
 				/* Skip sub-tests */
 				while (magindex + 1 < ml->nmagic &&
@@ -576,14 +1309,14 @@ apprentice_list(struct mlist *mlist, int mode)
 			 */
 			while (magindex + 1 < ml->nmagic &&
 			       ml->magic[magindex + 1].cont_level != 0 &&
-			       *ml->magic[magindex].desc == '\0' &&
-			       *ml->magic[magindex].mimetype == '\0')
+			       *DESC_STR(&ml->desc[magindex], desc) == '\0' &&
+			       *DESC_STR(&ml->desc[magindex], mimetype) == '\0')
 				magindex++;
 
 			printf("Strength = %3" SIZE_T_FORMAT "u : %s [%s]\n",
-			    apprentice_magic_strength(m),
-			    ml->magic[magindex].desc,
-			    ml->magic[magindex].mimetype);
+			    file_magic_strength(m, DESC_STR(d, desc)),
+			    DESC_STR(&ml->desc[magindex], desc),
+			    DESC_STR(&ml->desc[magindex], mimetype));
 		}
 	}
 }
@@ -751,14 +1484,183 @@ cmpstrp(const void *p1, const void *p2)
         return strcmp(*(char *const *)p1, *(char *const *)p2);
 }
 
+/*
+ * The string pool of a list being loaded: each distinct string once,
+ * found through an open hash table of their offsets plus one
+ */
+struct magic_pool {
+	char *s;
+	size_t len, size;
+	uint32_t *slot;
+	size_t nslot;			/* a power of 2 */
+};
+
+private int
+pool_init(struct magic_set *ms, struct magic_pool *sp, size_t nstr)
+{
+	sp->len = sp->size = 0;
+	sp->s = NULL;
+	for (sp->nslot = 16; sp->nslot < 2 * nstr; sp->nslot *= 2)
+		continue;
+	if ((sp->slot = CAST(uint32_t *, calloc(sp->nslot,
+	    sizeof(*sp->slot)))) == NULL) {
+		file_oomem(ms, sp->nslot * sizeof(*sp->slot));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Add the len bytes at str to the pool, unless they are there already,
+ * and get their offset; at most nstr distinct strings are added.
+ */
+private int
+pool_add(struct magic_set *ms, struct magic_pool *sp, const char *str,
+    size_t len, uint32_t *off)
+{
+	uint32_t h = 0, *slot;
+	size_t i;
+	char *s;
+
+	for (i = 0; i < len; i++)
+		h = h * 31 + CAST(unsigned char, str[i]);
+	for (i = h & (sp->nslot - 1); *(slot = &sp->slot[i]) != 0;
+	    i = (i + 1) & (sp->nslot - 1)) {
+		s = sp->s + *slot - 1;
+		if (strncmp(s, str, len) == 0 && s[len] == '\0') {
+			*off = *slot - 1;
+			return 0;
+		}
+	}
+	if (sp->len + len + 1 > sp->size) {
+		size_t size = MAX(sp->size * 2, sp->len + len + 1 + 1024);
+		if ((s = CAST(char *, realloc(sp->s, size))) == NULL) {
+			file_oomem(ms, size);
+			return -1;
+		}
+		sp->s = s;
+		sp->size = size;
+	}
+	(void)memcpy(sp->s + sp->len, str, len);
+	sp->s[sp->len + len] = '\0';
+	*off = CAST(uint32_t, sp->len);
+	*slot = *off + 1;
+	sp->len += len + 1;
+	return 0;
+}
+
+/*
+ * Lay out the parsed entries of a list as a compiled file without the
+ * indexes: header, entries, descriptions and their string pool.
+ */
+private int
+apprentice_pack(struct magic_set *ms, struct magic_entry *marray,
+    uint32_t marraycount, uint32_t nmagic, struct magic_hdr **imagep,
+    size_t *sizep)
+{
+	struct magic_pool sp;
+	struct magic_desc *pd = NULL, *desc;
+	struct magic_hdr *h;
+	struct magic *magic;
+	const char *file, *p;
+	uint32_t i, j, n;
+	size_t moff, doff, soff, size, len;
+
+	if (pool_init(ms, &sp, 4 * (size_t)nmagic) == -1)
+		return -1;
+	len = (nmagic ? nmagic : 1) * sizeof(*pd);
+	if ((pd = CAST(struct magic_desc *, malloc(len))) == NULL) {
+		file_oomem(ms, len);
+		goto out;
+	}
+	for (n = 0, i = 0; i < marraycount; i++) {
+		/* the directory is left out, as it differs between hosts */
+		if ((file = marray[i].file) == NULL)
+			file = "";
+		if ((p = strrchr(file, '/')) != NULL)
+			file = p + 1;
+#ifdef WIN32
+		if ((p = strrchr(file, '\\')) != NULL)
+			file = p + 1;
+#endif
+		for (j = 0; j < marray[i].cont_count; j++, n++) {
+			const struct magic_text *t = &marray[i].dp[j];
+			for (len = 0; len < sizeof(t->apple) && t->apple[len];
+			    len++)
+				continue;
+			if (pool_add(ms, &sp, t->desc, strlen(t->desc),
+			    &pd[n].desc) == -1 ||
+			    pool_add(ms, &sp, t->mimetype,
+			    strlen(t->mimetype), &pd[n].mimetype) == -1 ||
+			    pool_add(ms, &sp, t->apple, len,
+			    &pd[n].apple) == -1 ||
+			    pool_add(ms, &sp, file, strlen(file),
+			    &pd[n].file) == -1)
+				goto out;
+		}
+	}
+
+	moff = (sizeof(*h) + 7) & ~(size_t)7;
+	doff = moff + nmagic * sizeof(*magic);
+	soff = (doff + nmagic * sizeof(*desc) + 7) & ~(size_t)7;
+	size = soff + sp.len;
+	if (size > 0xffffffff) {
+		file_error(ms, 0, "too many magic entries");
+		goto out;
+	}
+	if ((h = CAST(struct magic_hdr *, calloc(1, size))) == NULL) {
+		file_oomem(ms, size);
+		goto out;
+	}
+	h->magic = MAGICNO;
+	h->version = VERSIONNO;
+	h->nmagic = nmagic;
+	h->magicsize = sizeof(*magic);
+	h->nsect = MAGIC_NSECT;
+	h->sect[MAGIC_SECT_MAGIC].offset = CAST(uint32_t, moff);
+	h->sect[MAGIC_SECT_MAGIC].size = nmagic * sizeof(*magic);
+	h->sect[MAGIC_SECT_DESC].offset = CAST(uint32_t, doff);
+	h->sect[MAGIC_SECT_DESC].size = nmagic * sizeof(*desc);
+	h->sect[MAGIC_SECT_STRS].offset = CAST(uint32_t, soff);
+	h->sect[MAGIC_SECT_STRS].size = CAST(uint32_t, sp.len);
+
+	magic = CAST(struct magic *, SECT(h, MAGIC_SECT_MAGIC));
+	desc = CAST(struct magic_desc *, SECT(h, MAGIC_SECT_DESC));
+	for (n = 0, i = 0; i < marraycount; i++) {
+		(void)memcpy(magic + n, marray[i].mp,
+		    marray[i].cont_count * sizeof(*magic));
+		n += marray[i].cont_count;
+	}
+	/* The string offsets count from each record */
+	for (n = 0; n < nmagic; n++) {
+		uint32_t rel = CAST(uint32_t, soff - doff - n * sizeof(*desc));
+		desc[n].desc = rel + pd[n].desc;
+		desc[n].mimetype = rel + pd[n].mimetype;
+		desc[n].apple = rel + pd[n].apple;
+		desc[n].file = rel + pd[n].file;
+	}
+	(void)memcpy(SECT(h, MAGIC_SECT_STRS), sp.s, sp.len);
+	*imagep = h;
+	*sizep = size;
+	free(pd);
+	free(sp.s);
+	free(sp.slot);
+	return 0;
+out:
+	free(pd);
+	free(sp.s);
+	free(sp.slot);
+	return -1;
+}
+
 private int
-apprentice_load(struct magic_set *ms, struct magic **magicp, uint32_t *nmagicp,
-    const char *fn, int action)
+apprentice_load(struct magic_set *ms, struct magic_hdr **imagep,
+    size_t *sizep, const char *fn, int action)
 {
 	int errs = 0;
 	struct magic_entry *marray;
 	uint32_t marraycount, i, mentrycount = 0, starttest;
-	size_t slen, files = 0, maxfiles = 0;
+	size_t files = 0, maxfiles = 0;
 	char **filearr = NULL, *mfn;
 	struct stat st;
 	DIR *dir;
@@ -812,12 +1714,10 @@ apprentice_load(struct magic_set *ms, struct magic **magicp, uint32_t *nmagicp,
 		}
 		closedir(dir);
 		qsort(filearr, files, sizeof(*filearr), cmpstrp);
-		for (i = 0; i < files; i++) {
+		/* the entries point at the names until they are packed */
+		for (i = 0; i < files; i++)
 			load_1(ms, action, filearr[i], &errs, &marray,
 			    &marraycount);
-			free(filearr[i]);
-		}
-		free(filearr);
 	} else
 		load_1(ms, action, fn, &errs, &marray, &marraycount);
 	if (errs)
@@ -839,16 +1739,16 @@ apprentice_load(struct magic_set *ms, struct magic **magicp, uint32_t *nmagicp,
 			if ((ms->flags & MAGIC_DEBUG) == 0)
 				continue;
 			(void)fprintf(stderr, "%s%s%s: %s\n",
-			    marray[i].mp->mimetype,
-			    marray[i].mp->mimetype[0] == '\0' ? "" : "; ",
-			    marray[i].mp->desc[0] ? marray[i].mp->desc :
+			    marray[i].dp->mimetype,
+			    marray[i].dp->mimetype[0] == '\0' ? "" : "; ",
+			    marray[i].dp->desc[0] ? marray[i].dp->desc :
 			    "(no description)",
 			    marray[i].mp->flag & BINTEST ? binary : text);
 			if (marray[i].mp->flag & BINTEST) {
-				char *p = strstr(marray[i].mp->desc, text);
-				if (p && (p == marray[i].mp->desc ||
+				char *p = strstr(marray[i].dp->desc, text);
+				if (p && (p == marray[i].dp->desc ||
 				    isspace((unsigned char)p[-1])) &&
-				    (p + len - marray[i].mp->desc == 
+				    (p + len - marray[i].dp->desc == 
 				    MAXstring || (p[len] == '\0' ||
 				    isspace((unsigned char)p[len]))))
 					(void)fprintf(stderr, "*** Possible "
@@ -881,32 +1781,24 @@ apprentice_load(struct magic_set *ms, struct magic **magicp, uint32_t *nmagicp,
 	for (i = 0; i < marraycount; i++)
 		mentrycount += marray[i].cont_count;
 
-	slen = sizeof(**magicp) * mentrycount;
-	if ((*magicp = CAST(struct magic *, malloc(slen))) == NULL) {
-		file_oomem(ms, slen);
+	if (apprentice_pack(ms, marray, marraycount, mentrycount, imagep,
+	    sizep) == -1)
 		errs++;
-		goto out;
-	}
-
-	mentrycount = 0;
-	for (i = 0; i < marraycount; i++) {
-		(void)memcpy(*magicp + mentrycount, marray[i].mp,
-		    marray[i].cont_count * sizeof(**magicp));
-		mentrycount += marray[i].cont_count;
-	}
 out:
-	for (i = 0; i < marraycount; i++)
+	for (i = 0; i < marraycount; i++) {
 		free(marray[i].mp);
+		free(marray[i].dp);
+	}
 	free(marray);
+	for (i = 0; i < files; i++)
+		free(filearr[i]);
+	free(filearr);
 	if (errs) {
-		*magicp = NULL;
-		*nmagicp = 0;
+		*imagep = NULL;
+		*sizep = 0;
 		return errs;
-	} else {
-		*nmagicp = mentrycount;
-		return 0;
 	}
-
+	return 0;
 }
 
 /*
@@ -1147,6 +2039,7 @@ parse(struct magic_set *ms, struct magic_entry **mentryp, uint32_t *nmentryp,
 	size_t i;
 	struct magic_entry *me;
 	struct magic *m;
+	struct magic_text *d;
 	const char *l = line;
 	char *t;
 	int op;
@@ -1176,6 +2069,7 @@ parse(struct magic_set *ms, struct magic_entry **mentryp, uint32_t *nmentryp,
 		me = &(*mentryp)[*nmentryp - 1];
 		if (me->cont_count == me->max_count) {
 			struct magic *nm;
+			struct magic_text *nd;
 			size_t cnt = me->max_count + ALLOC_CHUNK;
 			if ((nm = CAST(struct magic *, realloc(me->mp,
 			    sizeof(*nm) * cnt))) == NULL) {
@@ -1183,10 +2077,18 @@ parse(struct magic_set *ms, struct magic_entry **mentryp, uint32_t *nmentryp,
 				return -1;
 			}
 			me->mp = m = nm;
+			if ((nd = CAST(struct magic_text *, realloc(me->dp,
+			    sizeof(*nd) * cnt))) == NULL) {
+				file_oomem(ms, sizeof(*nd) * cnt);
+				return -1;
+			}
+			me->dp = nd;
 			me->max_count = CAST(uint32_t, cnt);
 		}
+		d = &me->dp[me->cont_count];
 		m = &me->mp[me->cont_count++];
 		(void)memset(m, 0, sizeof(*m));
+		(void)memset(d, 0, sizeof(*d));
 		m->cont_level = cont_level;
 	} else {
 		if (*nmentryp == maxmagic) {
@@ -1211,12 +2113,23 @@ parse(struct magic_set *ms, struct magic_entry **mentryp, uint32_t *nmentryp,
 				return -1;
 			}
 			me->mp = m;
+			len = sizeof(*d) * ALLOC_CHUNK;
+			if ((d = CAST(struct magic_text *, malloc(len)))
+			    == NULL) {
+				file_oomem(ms, len);
+				return -1;
+			}
+			me->dp = d;
 			me->max_count = ALLOC_CHUNK;
-		} else
+		} else {
 			m = me->mp;
+			d = me->dp;
+		}
 		(void)memset(m, 0, sizeof(*m));
+		(void)memset(d, 0, sizeof(*d));
 		m->factor_op = FILE_FACTOR_OP_NONE;
 		m->cont_level = 0;
+		me->file = ms->file;
 		me->cont_count = 1;
 	}
 	m->lineno = CAST(uint32_t, lineno);
@@ -1541,12 +2454,12 @@ parse(struct magic_set *ms, struct magic_entry **mentryp, uint32_t *nmentryp,
 		++l;
 		m->flag |= NOSPACE;
 	}
-	for (i = 0; (m->desc[i++] = *l++) != '\0' && i < sizeof(m->desc); )
+	for (i = 0; (d->desc[i++] = *l++) != '\0' && i < sizeof(d->desc); )
 		continue;
-	if (i == sizeof(m->desc)) {
-		m->desc[sizeof(m->desc) - 1] = '\0';
+	if (i == sizeof(d->desc)) {
+		d->desc[sizeof(d->desc) - 1] = '\0';
 		if (ms->flags & MAGIC_CHECK)
-			file_magwarn(ms, "description `%s' truncated", m->desc);
+			file_magwarn(ms, "description `%s' truncated", d->desc);
 	}
 
         /*
@@ -1554,15 +2467,15 @@ parse(struct magic_set *ms, struct magic_entry **mentryp, uint32_t *nmentryp,
 	 * files were not compiled.
          */
         if (ms->flags & MAGIC_CHECK) {
-		if (check_format(ms, m) == -1)
+		if (check_format(ms, m, d) == -1)
 			return -1;
 	}
 #ifndef COMPILE_ONLY
 	if (action == FILE_CHECK) {
-		file_mdump(m);
+		file_mdump(m, d->desc);
 	}
 #endif
-	m->mimetype[0] = '\0';		/* initialise MIME type to none */
+	d->mimetype[0] = '\0';		/* initialise MIME type to none */
 	if (m->cont_level == 0)
 		++(*nmentryp);		/* make room for next */
 	return 0;
@@ -1631,20 +2544,21 @@ parse_apple(struct magic_set *ms, struct magic_entry *me, const char *line)
 {
 	size_t i;
 	const char *l = line;
-	struct magic *m = &me->mp[me->cont_count == 0 ? 0 : me->cont_count - 1];
+	struct magic_text *d =
+	    &me->dp[me->cont_count == 0 ? 0 : me->cont_count - 1];
 
-	if (m->apple[0] != '\0') {
+	if (d->apple[0] != '\0') {
 		file_magwarn(ms, "Current entry already has a APPLE type "
-		    "`%.8s', new type `%s'", m->mimetype, l);
+		    "`%.8s', new type `%s'", d->mimetype, l);
 		return -1;
 	}	
 
 	EATAB;
 	for (i = 0; *l && ((isascii((unsigned char)*l) &&
 	    isalnum((unsigned char)*l)) || strchr("-+/.", *l)) &&
-	    i < sizeof(m->apple); m->apple[i++] = *l++)
+	    i < sizeof(d->apple); d->apple[i++] = *l++)
 		continue;
-	if (i == sizeof(m->apple) && *l) {
+	if (i == sizeof(d->apple) && *l) {
 		/* We don't need to NUL terminate here, printing handles it */
 		if (ms->flags & MAGIC_CHECK)
 			file_magwarn(ms, "APPLE type `%s' truncated %"
@@ -1666,26 +2580,27 @@ parse_mime(struct magic_set *ms, struct magic_entry *me, const char *line)
 {
 	size_t i;
 	const char *l = line;
-	struct magic *m = &me->mp[me->cont_count == 0 ? 0 : me->cont_count - 1];
+	struct magic_text *d =
+	    &me->dp[me->cont_count == 0 ? 0 : me->cont_count - 1];
 
-	if (m->mimetype[0] != '\0') {
+	if (d->mimetype[0] != '\0') {
 		file_magwarn(ms, "Current entry already has a MIME type `%s',"
-		    " new type `%s'", m->mimetype, l);
+		    " new type `%s'", d->mimetype, l);
 		return -1;
 	}	
 
 	EATAB;
 	for (i = 0; *l && ((isascii((unsigned char)*l) &&
 	    isalnum((unsigned char)*l)) || strchr("-+/.", *l)) &&
-	    i < sizeof(m->mimetype); m->mimetype[i++] = *l++)
+	    i < sizeof(d->mimetype); d->mimetype[i++] = *l++)
 		continue;
-	if (i == sizeof(m->mimetype)) {
-		m->mimetype[sizeof(m->mimetype) - 1] = '\0';
+	if (i == sizeof(d->mimetype)) {
+		d->mimetype[sizeof(d->mimetype) - 1] = '\0';
 		if (ms->flags & MAGIC_CHECK)
 			file_magwarn(ms, "MIME type `%s' truncated %"
-			    SIZE_T_FORMAT "u", m->mimetype, i);
+			    SIZE_T_FORMAT "u", d->mimetype, i);
 	} else
-		m->mimetype[i] = '\0';
+		d->mimetype[i] = '\0';
 
 	if (i > 0)
 		return 0;
@@ -1822,11 +2737,12 @@ check_format_type(const char *ptr, int type)
  * the type of the magic.
  */
 private int
-check_format(struct magic_set *ms, struct magic *m)
+check_format(struct magic_set *ms, struct magic *m,
+    const struct magic_text *d)
 {
-	char *ptr;
+	const char *ptr;
 
-	for (ptr = m->desc; *ptr; ptr++)
+	for (ptr = d->desc; *ptr; ptr++)
 		if (*ptr == '%')
 			break;
 	if (*ptr == '\0') {
@@ -1843,7 +2759,7 @@ check_format(struct magic_set *ms, struct magic *m)
 	}
 	if (file_formats[m->type] == FILE_FMT_NONE) {
 		file_magwarn(ms, "No format string for `%s' with description "
-		    "`%s'", m->desc, file_names[m->type]);
+		    "`%s'", d->desc, file_names[m->type]);
 		return -1;
 	}
 
@@ -1855,7 +2771,7 @@ check_format(struct magic_set *ms, struct magic *m)
 		 */
 		file_magwarn(ms, "Printf format `%c' is not valid for type "
 		    "`%s' in description `%s'", *ptr ? *ptr : '?',
-		    file_names[m->type], m->desc);
+		    file_names[m->type], d->desc);
 		return -1;
 	}
 	
@@ -1864,7 +2780,7 @@ check_format(struct magic_set *ms, struct magic *m)
 			file_magwarn(ms,
 			    "Too many format strings (should have at most one) "
 			    "for `%s' with description `%s'",
-			    file_names[m->type], m->desc);
+			    file_names[m->type], d->desc);
 			return -1;
 		}
 	}
@@ -2196,16 +3112,18 @@ eatsize(const char **p)
  * handle a compiled file.
  */
 private int
-apprentice_map(struct magic_set *ms, struct magic **magicp, uint32_t *nmagicp,
-    const char *fn)
+apprentice_map(struct magic_set *ms, struct magic_hdr **imagep,
+    size_t *sizep, const char *fn)
 {
 	int fd;
 	struct stat st;
-	uint32_t *ptr;
+	struct magic_hdr hdr;
 	uint32_t version;
 	int needsbyteswap;
 	char *dbname = NULL;
 	void *mm = NULL;
+	size_t size = 0;
+	int rv = -1;
 
 	dbname = mkdbname(ms, fn, 0);
 	if (dbname == NULL)
@@ -2222,31 +3140,12 @@ apprentice_map(struct magic_set *ms, struct magic **magicp, uint32_t *nmagicp,
 		file_error(ms, 0, "file `%s' is too small", dbname);
 		goto error1;
 	}
-
-#ifdef QUICK
-	if ((mm = mmap(0, (size_t)st.st_size, PROT_READ|PROT_WRITE,
-	    MAP_PRIVATE|MAP_FILE, fd, (off_t)0)) == MAP_FAILED) {
-		file_error(ms, errno, "cannot map `%s'", dbname);
-		goto error1;
-	}
-#define RET	2
-#else
-	if ((mm = CAST(void *, malloc((size_t)st.st_size))) == NULL) {
-		file_oomem(ms, (size_t)st.st_size);
-		goto error1;
-	}
-	if (read(fd, mm, (size_t)st.st_size) != (ssize_t)st.st_size) {
+	if (read(fd, &hdr, 8) != 8) {
 		file_badread(ms);
 		goto error1;
 	}
-#define RET	1
-#endif
-	*magicp = CAST(struct magic *, mm);
-	(void)close(fd);
-	fd = -1;
-	ptr = (uint32_t *)(void *)*magicp;
-	if (*ptr != MAGICNO) {
-		if (swap4(*ptr) != MAGICNO) {
+	if (hdr.magic != MAGICNO) {
+		if (swap4(hdr.magic) != MAGICNO) {
 			file_error(ms, 0, "bad magic in `%s'", dbname);
 			goto error1;
 		}
@@ -2254,86 +3153,392 @@ apprentice_map(struct magic_set *ms, struct magic **magicp, uint32_t *nmagicp,
 	} else
 		needsbyteswap = 0;
 	if (needsbyteswap)
-		version = swap4(ptr[1]);
+		version = swap4(hdr.version);
 	else
-		version = ptr[1];
+		version = hdr.version;
+	if (version == OLD_VERSIONNO && st.st_size <= 0xffffffff) {
+		rv = apprentice_old(ms, fd, (size_t)st.st_size, needsbyteswap,
+		    imagep, sizep);
+		(void)close(fd);
+		free(dbname);
+		return rv;
+	}
 	if (version != VERSIONNO) {
 		file_error(ms, 0, "File %s supports only version %d magic "
 		    "files. `%s' is version %d", VERSION,
 		    VERSIONNO, dbname, version);
 		goto error1;
 	}
-	*nmagicp = (uint32_t)(st.st_size / sizeof(struct magic));
-	if (*nmagicp > 0)
-		(*nmagicp)--;
-	(*magicp)++;
+	if (st.st_size < (off_t)sizeof(hdr) || st.st_size > 0xffffffff) {
+		file_error(ms, 0, "file `%s' is too %s", dbname,
+		    st.st_size < (off_t)sizeof(hdr) ? "small" : "large");
+		goto error1;
+	}
+	size = (size_t)st.st_size;
+
+	/*
+	 * One in the byte order of this host is used as it is, so mapped
+	 * read-only its pages are shared with every other process using
+	 * it. Another one is read into memory and swapped, without the
+	 * indexes, which are built again.
+	 */
+#ifdef QUICK
+	if (!needsbyteswap) {
+		if ((mm = mmap(0, size, PROT_READ, MAP_PRIVATE|MAP_FILE, fd,
+		    (off_t)0)) == MAP_FAILED) {
+			mm = NULL;
+			file_error(ms, errno, "cannot map `%s'", dbname);
+			goto error1;
+		}
+		rv = 2;
+	} else
+#endif
+	{
+		if ((mm = CAST(void *, malloc(size))) == NULL) {
+			file_oomem(ms, size);
+			goto error1;
+		}
+		rv = 1;
+		if (lseek(fd, (off_t)0, SEEK_SET) != 0 ||
+		    read(fd, mm, size) != (ssize_t)size) {
+			file_badread(ms);
+			goto error1;
+		}
+	}
+	(void)close(fd);
+	fd = -1;
+
 	if (needsbyteswap)
-		byteswap(*magicp, *nmagicp);
+		bshdr(CAST(struct magic_hdr *, mm));
+	if (apprentice_checkhdr(ms, CAST(struct magic_hdr *, mm), size,
+	    dbname) == -1)
+		goto error1;
+	if (needsbyteswap)
+		byteswap(CAST(struct magic_hdr *, mm));
+	if (apprentice_checkimg(ms, CAST(struct magic_hdr *, mm), dbname)
+	    == -1)
+		goto error1;
+	*imagep = CAST(struct magic_hdr *, mm);
+	*sizep = size;
 	free(dbname);
-	return RET;
+	return rv;
 
 error1:
 	if (fd != -1)
 		(void)close(fd);
-	if (mm) {
-#ifdef QUICK
-		(void)munmap((void *)mm, (size_t)st.st_size);
-#else
-		free(mm);
-#endif
-	} else {
-		*magicp = NULL;
-		*nmagicp = 0;
-	}
+	file_delmagic(CAST(struct magic_hdr *, mm), rv, size);
 error2:
+	*imagep = NULL;
+	*sizep = 0;
 	free(dbname);
 	return -1;
 }
 
-private const uint32_t ar[] = {
-    MAGICNO, VERSIONNO
-};
 /*
- * handle an mmaped file.
+ * Read a compiled file in the format before the sectioned one, which
+ * older builds of libmagic, such as the libmagic-1.dll kept with the
+ * module, write: after a record with the magic number and version,
+ * each entry is a struct magic followed by its description, MIME type
+ * and Apple type.  The entries are laid out as apprentice_load() lays
+ * them out, without the magic file each came from, which that format
+ * does not keep.
  */
 private int
-apprentice_compile(struct magic_set *ms, struct magic **magicp,
-    uint32_t *nmagicp, const char *fn)
+apprentice_old(struct magic_set *ms, int fd, size_t size, int needsbyteswap,
+    struct magic_hdr **imagep, size_t *sizep)
 {
-	int fd;
-	char *dbname;
+	struct magic_entry *marray = NULL;
+	struct magic *mp = NULL;
+	struct magic_text *dp = NULL;
+	char *buf, *rec;
+	uint32_t i, n;
 	int rv = -1;
 
+	if ((buf = CAST(char *, malloc(size))) == NULL) {
+		file_oomem(ms, size);
+		return -1;
+	}
+	if (lseek(fd, (off_t)0, SEEK_SET) != 0 ||
+	    read(fd, buf, size) != (ssize_t)size) {
+		file_badread(ms);
+		goto out;
+	}
+	n = CAST(uint32_t, size / OLD_MAGICSIZE);
+	if (n > 0)
+		n--;
+	if ((marray = CAST(struct magic_entry *, calloc(n ? n : 1,
+	    sizeof(*marray)))) == NULL ||
+	    (mp = CAST(struct magic *, malloc((n ? n : 1) *
+	    sizeof(*mp)))) == NULL ||
+	    (dp = CAST(struct magic_text *, calloc(n ? n : 1,
+	    sizeof(*dp)))) == NULL) {
+		file_oomem(ms, n * (sizeof(*marray) + sizeof(*mp) +
+		    sizeof(*dp)));
+		goto out;
+	}
+	for (i = 0; i < n; i++) {
+		rec = buf + (size_t)(i + 1) * OLD_MAGICSIZE;
+		(void)memcpy(&mp[i], rec, sizeof(*mp));
+		if (needsbyteswap)
+			bs1(&mp[i]);
+		rec += sizeof(*mp);
+		(void)memcpy(dp[i].desc, rec, MAXDESC);
+		dp[i].desc[MAXDESC - 1] = '\0';
+		rec += MAXDESC;
+		(void)memcpy(dp[i].mimetype, rec, MAXDESC);
+		dp[i].mimetype[MAXDESC - 1] = '\0';
+		rec += MAXDESC;
+		(void)memcpy(dp[i].apple, rec, sizeof(dp[i].apple));
+		marray[i].mp = &mp[i];
+		marray[i].dp = &dp[i];
+		marray[i].cont_count = 1;
+	}
+	if (apprentice_pack(ms, marray, n, n, imagep, sizep) == 0)
+		rv = 1;
+out:
+	free(dp);
+	free(mp);
+	free(marray);
+	free(buf);
+	return rv;
+}
+
+/*
+ * Check that the sections of a compiled file are where they can be,
+ * and that the entries and descriptions are what this program has.
+ */
+private int
+apprentice_checkhdr(struct magic_set *ms, const struct magic_hdr *h,
+    size_t size, const char *dbname)
+{
+	const struct magic_sect *sm = &h->sect[MAGIC_SECT_MAGIC];
+	const struct magic_sect *sd = &h->sect[MAGIC_SECT_DESC];
+	const struct magic_sect *ss = &h->sect[MAGIC_SECT_STRS];
+	const char *base = CAST(const char *, (const void *)h);
+	uint32_t i;
+
+	if (h->magicsize != sizeof(struct magic) ||
+	    h->nsect != MAGIC_NSECT) {
+		file_error(ms, 0, "`%s' has entries of %u bytes in %u "
+		    "sections, not %u in %u", dbname, h->magicsize, h->nsect,
+		    (unsigned int)sizeof(struct magic), MAGIC_NSECT);
+		return -1;
+	}
+	for (i = 0; i < MAGIC_NSECT; i++) {
+		const struct magic_sect *sc = &h->sect[i];
+		if (sc->size != 0 && (sc->offset % 8 != 0 ||
+		    sc->offset < sizeof(*h) || sc->offset > size ||
+		    sc->size > size - sc->offset))
+			goto bad;
+	}
+	if (sm->size / sizeof(struct magic) != h->nmagic ||
+	    sm->size % sizeof(struct magic) != 0 ||
+	    sd->size / sizeof(struct magic_desc) != h->nmagic ||
+	    sd->size % sizeof(struct magic_desc) != 0)
+		goto bad;
+	/* the entries are read one past the last, into the descriptions */
+	if (h->nmagic != 0 && sd->offset != sm->offset + sm->size)
+		goto bad;
+	if (ss->size != 0 && base[ss->offset + ss->size - 1] != '\0')
+		goto bad;
+	return 0;
+bad:
+	file_error(ms, 0, "corrupt compiled magic file `%s'", dbname);
+	return -1;
+}
+
+/*
+ * Check that the descriptions and the saved indexes of a compiled file
+ * stay within it. This only reads the image, so a mapped one stays
+ * shared.
+ */
+private int
+apprentice_checkimg(struct magic_set *ms, struct magic_hdr *h,
+    const char *dbname)
+{
+	const struct magic_sect *sc = h->sect;
+	const struct magic_desc *d = CAST(const struct magic_desc *,
+	    SECT(h, MAGIC_SECT_DESC));
+	uint64_t lo = sc[MAGIC_SECT_STRS].offset;
+	uint64_t hi = lo + sc[MAGIC_SECT_STRS].size, at;
+	uint32_t i, n, nstate, nlit;
+
+	for (i = 0; i < h->nmagic; i++) {
+		at = sc[MAGIC_SECT_DESC].offset + (uint64_t)i * sizeof(*d);
+		if (at + d[i].desc < lo || at + d[i].desc >= hi ||
+		    at + d[i].mimetype < lo || at + d[i].mimetype >= hi ||
+		    at + d[i].apple < lo || at + d[i].apple >= hi ||
+		    at + d[i].file < lo || at + d[i].file >= hi)
+			goto bad;
+	}
+
+	if (sc[MAGIC_SECT_IALWAYS].size != 0) {
+		const struct magic_ikey *k = CAST(const struct magic_ikey *,
+		    SECT(h, MAGIC_SECT_IKEY));
+		const struct magic_ioff *o = CAST(const struct magic_ioff *,
+		    SECT(h, MAGIC_SECT_IOFF));
+		uint32_t nkey = sc[MAGIC_SECT_IKEY].size / sizeof(*k);
+
+		if (sc[MAGIC_SECT_IALWAYS].size !=
+		    ((h->nmagic + 31) / 32 + 1) * sizeof(uint32_t) ||
+		    sc[MAGIC_SECT_IKEY].size % sizeof(*k) != 0 ||
+		    sc[MAGIC_SECT_IOFF].size % sizeof(*o) != 0)
+			goto bad;
+		for (i = 0; i < nkey; i++)
+			if (k[i].magindex >= h->nmagic || k[i].len == 0 ||
+			    k[i].len > sizeof(k[i].val))
+				goto bad;
+		n = sc[MAGIC_SECT_IOFF].size / sizeof(*o);
+		for (i = 0; i < n; i++)
+			if (o[i].key > nkey || o[i].nkey > nkey - o[i].key)
+				goto bad;
+	}
+
+	if (sc[MAGIC_SECT_SOUT].size != 0) {
+		const uint32_t *lit = CAST(const uint32_t *,
+		    SECT(h, MAGIC_SECT_SLIT));
+		const uint8_t *litlen = CAST(const uint8_t *,
+		    SECT(h, MAGIC_SECT_SLITLEN));
+		const uint16_t *class = CAST(const uint16_t *,
+		    SECT(h, MAGIC_SECT_SCLASS));
+		const uint32_t *delta = CAST(const uint32_t *,
+		    SECT(h, MAGIC_SECT_SDELTA));
+		const uint32_t *out = CAST(const uint32_t *,
+		    SECT(h, MAGIC_SECT_SOUT));
+		const uint32_t *outs = CAST(const uint32_t *,
+		    SECT(h, MAGIC_SECT_SOUTS));
+
+		nlit = sc[MAGIC_SECT_SLITLEN].size;
+		nstate = sc[MAGIC_SECT_SOUT].size / sizeof(*out) - 1;
+		n = sc[MAGIC_SECT_SOUTS].size / sizeof(*outs);
+		if (sc[MAGIC_SECT_SLIT].size != h->nmagic * sizeof(*lit) ||
+		    sc[MAGIC_SECT_SCLASS].size != 256 * sizeof(*class) ||
+		    sc[MAGIC_SECT_SFOLD].size != 256 ||
+		    sc[MAGIC_SECT_SOUT].size % sizeof(*out) != 0 ||
+		    sc[MAGIC_SECT_SOUTS].size % sizeof(*outs) != 0 ||
+		    nstate == 0 || h->nclass == 0 ||
+		    sc[MAGIC_SECT_SDELTA].size / sizeof(*delta) / nstate !=
+		    h->nclass ||
+		    sc[MAGIC_SECT_SDELTA].size % (sizeof(*delta) * nstate) !=
+		    0 || out[0] != 0 || out[nstate] != n)
+			goto bad;
+		for (i = 0; i < h->nmagic; i++)
+			if (lit[i] != SEARCH_NOLIT && lit[i] >= nlit)
+				goto bad;
+		for (i = 0; i < nlit; i++)
+			if (litlen[i] == 0 || litlen[i] > SEARCH_MAXLIT)
+				goto bad;
+		for (i = 0; i < 256; i++)
+			if (class[i] >= h->nclass)
+				goto bad;
+		for (i = 0; i < nstate * h->nclass; i++)
+			if (delta[i] >= nstate)
+				goto bad;
+		for (i = 0; i < nstate; i++)
+			if (out[i] > out[i + 1])
+				goto bad;
+		for (i = 0; i < n; i++)
+			if (outs[i] >= nlit)
+				goto bad;
+	}
+	return 0;
+bad:
+	file_error(ms, 0, "corrupt compiled magic file `%s'", dbname);
+	return -1;
+}
+
+/*
+ * Write a compiled file: the image apprentice_load() made, then the
+ * indexes, built here, each in a section of its own.
+ */
+private int
+apprentice_compile(struct magic_set *ms, struct magic_hdr *image,
+    size_t isize, const char *fn)
+{
+	struct mlist ml;
+	struct magic_hdr *h = NULL;
+	struct magic_index *ix;
+	struct magic_search *sr;
+	unsigned char fold[256];
+	const void *data[MAGIC_NSECT];
+	size_t len[MAGIC_NSECT], size;
+	char *dbname;
+	int fd = -1, rv = -1;
+	uint32_t i;
+
+	(void)memset(&ml, 0, sizeof(ml));
 	dbname = mkdbname(ms, fn, 1);
 
 	if (dbname == NULL) 
 		goto out;
 
-	if ((fd = open(dbname, O_WRONLY|O_CREAT|O_TRUNC|O_BINARY, 0644)) == -1) {
-		file_error(ms, errno, "cannot open `%s'", dbname);
+	/* The indexes depend on the entries only, so they are saved too */
+	apprentice_image(&ml, image, 0, isize);
+	if (apprentice_index(ms, &ml) == -1 ||
+	    apprentice_search(ms, &ml) == -1)
+		goto out;
+	ix = ml.index;
+	sr = ml.search;
+	for (i = 0; i < 256; i++)
+		fold[i] = CAST(unsigned char, tolower(CAST(int, i)));
+	data[MAGIC_SECT_IKEY] = ix->key;
+	len[MAGIC_SECT_IKEY] = ix->nkey * sizeof(*ix->key);
+	data[MAGIC_SECT_IOFF] = ix->off;
+	len[MAGIC_SECT_IOFF] = ix->noff * sizeof(*ix->off);
+	data[MAGIC_SECT_IALWAYS] = ix->always;
+	len[MAGIC_SECT_IALWAYS] = ix->nwords * sizeof(*ix->always);
+	data[MAGIC_SECT_SLIT] = sr->lit;
+	len[MAGIC_SECT_SLIT] = ml.nmagic * sizeof(*sr->lit);
+	data[MAGIC_SECT_SLITLEN] = sr->litlen;
+	len[MAGIC_SECT_SLITLEN] = sr->nlit;
+	data[MAGIC_SECT_SCLASS] = sr->class;
+	len[MAGIC_SECT_SCLASS] = sizeof(sr->class);
+	data[MAGIC_SECT_SDELTA] = sr->delta;
+	len[MAGIC_SECT_SDELTA] = sr->nstate * sr->nclass * sizeof(*sr->delta);
+	data[MAGIC_SECT_SOUT] = sr->out;
+	len[MAGIC_SECT_SOUT] = (sr->nstate + 1) * sizeof(*sr->out);
+	data[MAGIC_SECT_SOUTS] = sr->outs;
+	len[MAGIC_SECT_SOUTS] = sr->out[sr->nstate] * sizeof(*sr->outs);
+	data[MAGIC_SECT_SFOLD] = fold;
+	len[MAGIC_SECT_SFOLD] = sizeof(fold);
+
+	for (size = isize, i = MAGIC_SECT_IKEY; i < MAGIC_NSECT; i++)
+		size = ((size + 7) & ~(size_t)7) + len[i];
+	if (size > 0xffffffff) {
+		file_error(ms, 0, "too many magic entries");
 		goto out;
 	}
-
-	if (write(fd, ar, sizeof(ar)) != (ssize_t)sizeof(ar)) {
-		file_error(ms, errno, "error writing `%s'", dbname);
+	if ((h = CAST(struct magic_hdr *, calloc(1, size))) == NULL) {
+		file_oomem(ms, size);
 		goto out;
 	}
+	(void)memcpy(h, image, isize);
+	for (size = isize, i = MAGIC_SECT_IKEY; i < MAGIC_NSECT; i++) {
+		size = (size + 7) & ~(size_t)7;
+		h->sect[i].offset = CAST(uint32_t, size);
+		h->sect[i].size = CAST(uint32_t, len[i]);
+		(void)memcpy(CAST(char *, (void *)h) + size, data[i], len[i]);
+		size += len[i];
+	}
+	h->nclass = sr->nclass;
+	h->reach = CAST(uint32_t, MIN(sr->reach, 0xffffffff));
 
-	if (lseek(fd, (off_t)sizeof(struct magic), SEEK_SET)
-	    != sizeof(struct magic)) {
-		file_error(ms, errno, "error seeking `%s'", dbname);
+	if ((fd = open(dbname, O_WRONLY|O_CREAT|O_TRUNC|O_BINARY, 0644)) == -1) {
+		file_error(ms, errno, "cannot open `%s'", dbname);
 		goto out;
 	}
 
-	if (write(fd, *magicp, (sizeof(struct magic) * *nmagicp)) 
-	    != (ssize_t)(sizeof(struct magic) * *nmagicp)) {
+	if (write(fd, h, size) != (ssize_t)size) {
 		file_error(ms, errno, "error writing `%s'", dbname);
 		goto out;
 	}
 
-	(void)close(fd);
 	rv = 0;
 out:
+	if (fd != -1)
+		(void)close(fd);
+	file_delcompiled(&ml);
+	free(h);
 	free(dbname);
 	return rv;
 }
@@ -2384,14 +3589,39 @@ mkdbname(struct magic_set *ms, const char *fn, int strip)
 }
 
 /*
- * Byteswap an mmap'ed file if needed
+ * Byteswap the header of a compiled file
  */
 private void
-byteswap(struct magic *magic, uint32_t nmagic)
+bshdr(struct magic_hdr *h)
 {
+	uint32_t *p = &h->magic;
+	size_t i;
+
+	for (i = 0; i < sizeof(*h) / sizeof(*p); i++)
+		p[i] = swap4(p[i]);
+}
+
+/*
+ * Byteswap the entries and descriptions of a compiled file whose header
+ * is already swapped, and leave out its indexes, which are not.
+ */
+private void
+byteswap(struct magic_hdr *h)
+{
+	struct magic *magic = CAST(struct magic *, SECT(h, MAGIC_SECT_MAGIC));
+	struct magic_desc *d = CAST(struct magic_desc *,
+	    SECT(h, MAGIC_SECT_DESC));
 	uint32_t i;
-	for (i = 0; i < nmagic; i++)
+
+	for (i = 0; i < h->nmagic; i++) {
 		bs1(&magic[i]);
+		d[i].desc = swap4(d[i].desc);
+		d[i].mimetype = swap4(d[i].mimetype);
+		d[i].apple = swap4(d[i].apple);
+		d[i].file = swap4(d[i].file);
+	}
+	for (i = MAGIC_SECT_IKEY; i < MAGIC_NSECT; i++)
+		h->sect[i].size = 0;
 }
 
 /*
@@ -75,6 +75,7 @@ file_ascmagic(struct magic_set *ms, const unsigned char *buf, size_t nbytes)
 	unichar *ubuf = NULL;
 	size_t ulen;
 	int rv = 1;
+	struct arena_mark mark;
 
 	const char *code = NULL;
 	const char *code_mime = NULL;
@@ -84,6 +85,7 @@ file_ascmagic(struct magic_set *ms, const unsigned char *buf, size_t nbytes)
 		return 0;
 
 	nbytes = trim_nuls(buf, nbytes);
+	file_arena_mark(ms, &mark);
 
 	/* If file doesn't look like any sort of text, give up. */
 	if (file_encoding(ms, buf, nbytes, &ubuf, &ulen, &code, &code_mime,
@@ -96,8 +98,7 @@ file_ascmagic(struct magic_set *ms, const unsigned char *buf, size_t nbytes)
 	    type);
 
  done:
-	if (ubuf)
-		free(ubuf);
+	file_arena_release(ms, &mark);
 
 	return rv;
 }
@@ -124,15 +125,17 @@ file_ascmagic_with_encoding(struct magic_set *ms, const unsigned char *buf,
 	int n_lf = 0;
 	int n_cr = 0;
 	int n_nel = 0;
-	int score, curtype, executable = 0;
+	int score, curtype, executable = 0, mimeonly = 0;
 
 	size_t last_line_end = (size_t)-1;
 	int has_long_lines = 0;
+	struct arena_mark mark;
 
 	if (ms->flags & MAGIC_APPLE)
 		return 0;
 
 	nbytes = trim_nuls(buf, nbytes);
+	file_arena_mark(ms, &mark);
 
 	/* If we have fewer than 2 bytes, give up. */
 	if (nbytes <= 1) {
@@ -142,20 +145,28 @@ file_ascmagic_with_encoding(struct magic_set *ms, const unsigned char *buf,
 
 	if ((ms->flags & MAGIC_NO_CHECK_SOFT) == 0) {
 		/* Convert ubuf to UTF-8 and try text soft magic */
-		/* malloc size is a conservative overestimate; could be
-		   improved, or at least realloced after conversion. */
+		/* size is a conservative overestimate, but the scratch
+		   space is kept for the next file anyway.  + 1 for the
+		   NUL that regexec() may look for. */
 		mlen = ulen * 6;
-		if ((utf8_buf = CAST(unsigned char *, malloc(mlen))) == NULL) {
-			file_oomem(ms, mlen);
+		if ((utf8_buf = CAST(unsigned char *,
+		    file_arena_alloc(ms, mlen + 1))) == NULL)
 			goto done;
-		}
 		if ((utf8_end = encode_utf8(utf8_buf, mlen, ubuf, ulen))
 		    == NULL)
 			goto done;
+		*utf8_end = '\0';
 		if ((rv = file_softmagic(ms, utf8_buf,
-		    (size_t)(utf8_end - utf8_buf), TEXTTEST)) != 0)
-			goto subtype_identified;
-		else
+		    (size_t)(utf8_end - utf8_buf), TEXTTEST)) != 0) {
+			/*
+			 * The MIME type still comes from the tokens when
+			 * what matched did not give one, as it would
+			 * with MAGIC_MIME_TYPE
+			 */
+			if (rv == -1 || !MIME_FIELDS(ms) || ms->mime.type[0])
+				goto subtype_identified;
+			mimeonly = 1;
+		} else
 			rv = -1;
 	}
 
@@ -192,7 +203,8 @@ file_ascmagic_with_encoding(struct magic_set *ms, const unsigned char *buf,
 				} else
 					score += p->score;
 				if (score > 1) {
-					subtype = types[p->type].human;
+					if (!mimeonly)
+						subtype = types[p->type].human;
 					subtype_mime = types[p->type].mime;
 					goto subtype_identified;
 				}
@@ -256,6 +268,8 @@ subtype_identified:
 			}
 		}
 	} else {
+		file_setmime(ms, subtype_mime ? subtype_mime : "text/plain",
+		    NULL);
 		if (file_printedlen(ms)) {
 			switch (file_replace(ms, " text$", ", ")) {
 			case 0:
@@ -349,8 +363,7 @@ subtype_identified:
 	}
 	rv = 1;
 done:
-	if (utf8_buf)
-		free(utf8_buf);
+	file_arena_release(ms, &mark);
 
 	return rv;
 }
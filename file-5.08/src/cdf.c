@@ -67,10 +67,10 @@ FILE_RCSID("@(#)$File: cdf.c,v 1.43 2011/03/30 19:48:13 christos Exp $")
 #define DPRINTF(a)
 #endif
 
-static union {
+static const union {
 	char s[4];
 	uint32_t u;
-} cdf_bo;
+} cdf_bo = { { 1, 2, 3, 4 } };
 
 #define NEED_SWAP	(cdf_bo.u == (uint32_t)0x01020304)
 
@@ -295,7 +295,6 @@ cdf_read_header(const cdf_info_t *info, cdf_header_t *h)
 {
 	char buf[512];
 
-	(void)memcpy(cdf_bo.s, "\01\02\03\04", 4);
 	if (cdf_read(info, (off_t)0, buf, sizeof(buf)) == -1)
 		return -1;
 	cdf_unpack_header(h, buf);
@@ -1084,6 +1083,7 @@ cdf_dump_dir(const cdf_info_t *info, const cdf_header_t *h,
 	size_t i, j;
 	cdf_directory_t *d;
 	char name[__arraycount(d->d_name)];
+	char tbuf[26];
 	cdf_stream_t scn;
 	struct timespec ts;
 
@@ -1106,9 +1106,11 @@ cdf_dump_dir(const cdf_info_t *info, const cdf_header_t *h,
 		(void)fprintf(stderr, "Right child: %d\n", d->d_right_child);
 		(void)fprintf(stderr, "Flags: 0x%x\n", d->d_flags);
 		cdf_timestamp_to_timespec(&ts, d->d_created);
-		(void)fprintf(stderr, "Created %s", cdf_ctime(&ts.tv_sec));
+		(void)fprintf(stderr, "Created %s",
+		    cdf_ctime(&ts.tv_sec, tbuf));
 		cdf_timestamp_to_timespec(&ts, d->d_modified);
-		(void)fprintf(stderr, "Modified %s", cdf_ctime(&ts.tv_sec));
+		(void)fprintf(stderr, "Modified %s",
+		    cdf_ctime(&ts.tv_sec, tbuf));
 		(void)fprintf(stderr, "Stream %d\n", d->d_stream_first_sector);
 		(void)fprintf(stderr, "Size %d\n", d->d_size);
 		switch (d->d_type) {
@@ -1180,7 +1182,7 @@ cdf_dump_property_info(const cdf_property_info_t *info, size_t count)
 			} else {
 				cdf_timestamp_to_timespec(&ts, tp);
 				(void)fprintf(stderr, "timestamp %s",
-				    cdf_ctime(&ts.tv_sec));
+				    cdf_ctime(&ts.tv_sec, buf));
 			}
 			break;
 		case CDF_CLIPBOARD:
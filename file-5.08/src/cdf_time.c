@@ -165,16 +165,24 @@ cdf_timespec_to_timestamp(cdf_timestamp_t *t, const struct timespec *ts)
 	return 0;
 }
 
+/*
+ * buf must hold at least 26 bytes
+ */
 char *
-cdf_ctime(const time_t *sec)
+cdf_ctime(const time_t *sec, char *buf)
 {
-	static char ctbuf[26];
+#ifdef WIN32
+	/* The MS C runtime keeps the ctime() buffer per thread */
 	char *ptr = ctime(sec);
+	if (ptr != NULL)
+		return strcpy(buf, ptr);
+#else
+	char *ptr = ctime_r(sec, buf);
 	if (ptr != NULL)
 		return ptr;
-	(void)snprintf(ctbuf, sizeof(ctbuf), "*Bad* 0x%16.16llx\n",
-	    (long long)*sec);
-	return ctbuf;
+#endif
+	(void)snprintf(buf, 26, "*Bad* 0x%16.16llx\n", (long long)*sec);
+	return buf;
 }
 
 
@@ -186,9 +194,10 @@ main(int argc, char *argv[])
 	static const cdf_timestamp_t tst = 0x01A5E403C2D59C00ULL;
 	static const char *ref = "Sat Apr 23 01:30:00 1977";
 	char *p, *q;
+	char buf[26];
 
 	cdf_timestamp_to_timespec(&ts, tst);
-	p = cdf_ctime(&ts.tv_sec);
+	p = cdf_ctime(&ts.tv_sec, buf);
 	if ((q = strchr(p, '\n')) != NULL)
 		*q = '\0';
 	if (strcmp(ref, p) != 0)
@@ -58,6 +58,18 @@ FILE_RCSID("@(#)$File: compress.c,v 1.66 2011/03/08 00:39:47 christos Exp $")
 #define BUILTIN_DECOMPRESS
 #include <zlib.h>
 #endif
+#if defined(HAVE_BZLIB_H) && defined(HAVE_LIBBZ2)
+#define BUILTIN_BZLIB
+#include <bzlib.h>
+#endif
+#if defined(HAVE_LZMA_H) && defined(HAVE_LIBLZMA)
+#define BUILTIN_XZLIB
+#include <lzma.h>
+#if LZMA_VERSION_MAJOR > 5 || \
+    (LZMA_VERSION_MAJOR == 5 && LZMA_VERSION_MINOR >= 4)
+#define BUILTIN_LZIP	/* lzma_lzip_decoder() is new in 5.4 */
+#endif
+#endif
 
 private const struct {
 	const char magic[8];
@@ -82,17 +94,37 @@ private const struct {
  	{ "LRZI",     4, { "lrzip", "-dqo-", NULL }, 1 },	/* LRZIP */
 };
 
+/* Entries of compr[] that are decoded in process */
+#define METH_COMPRESS	0
+#define METH_UNCOMPRESS	1
+#define METH_GZIP	2
+#define METH_ZIP	6
+#define METH_BZIP	7
+#define METH_LZIP	8
+#define METH_XZ		9
+
 #define NODATA ((size_t)~0)
 
 private ssize_t swrite(int, const void *, size_t);
-#if HAVE_FORK
 private size_t ncompr = sizeof(compr) / sizeof(compr[0]);
 private size_t uncompressbuf(struct magic_set *, int, size_t,
     const unsigned char *, unsigned char **, size_t);
+private size_t uncompresslzw(struct magic_set *, const unsigned char *,
+    unsigned char **, size_t);
 #ifdef BUILTIN_DECOMPRESS
-private size_t uncompressgzipped(struct magic_set *, const unsigned char *,
+private size_t uncompressgzipped(struct magic_set *, int,
+    const unsigned char *, unsigned char **, size_t);
+private size_t uncompresszip(struct magic_set *, int, const unsigned char *,
     unsigned char **, size_t);
 #endif
+#ifdef BUILTIN_BZLIB
+private size_t uncompressbzipped(struct magic_set *, int,
+    const unsigned char *, unsigned char **, size_t);
+#endif
+#ifdef BUILTIN_XZLIB
+private size_t uncompressxz(struct magic_set *, int, size_t,
+    const unsigned char *, unsigned char **, size_t);
+#endif
 
 protected int
 file_zmagic(struct magic_set *ms, int fd, const char *name,
@@ -139,7 +171,7 @@ error:
 	ms->flags |= MAGIC_COMPRESS;
 	return rv;
 }
-#endif
+
 /*
  * `safe' write for sockets and pipes.
  */
@@ -302,7 +334,171 @@ file_pipe2file(struct magic_set *ms, int fd, const void *startbuf,
 	}
 	return fd;
 }
-#if HAVE_FORK
+#if defined(BUILTIN_DECOMPRESS) || defined(BUILTIN_BZLIB) || \
+    defined(BUILTIN_XZLIB)
+#define ZBUFSIZ	8192
+
+/*
+ * The decoders start on the caller's buffer and, for a seekable file, then
+ * carry on reading it.  This lets formats that need a whole block before
+ * producing anything (bzip2) still fill HOWMANY bytes.
+ */
+private int
+zinput(int fd, size_t n)
+{
+	if (fd == -1 || lseek(fd, (off_t)n, SEEK_SET) == (off_t)-1)
+		return -1;
+	return fd;
+}
+
+private size_t
+zfill(int fd, void *buf, size_t len)
+{
+	ssize_t r;
+
+	if (fd == -1 || (r = sread(fd, buf, len, 0)) <= 0)
+		return 0;
+	return (size_t)r;
+}
+#endif
+
+/*
+ * compress(1) LZW, following the classic decompress(): codes are read in
+ * groups of n_bits bytes and the rest of a group is skipped whenever the
+ * code size changes or the table is cleared.
+ */
+#define LZW_INIT_BITS	9
+#define LZW_MAX_BITS	16
+#define LZW_CLEAR	256
+#define LZW_FIRST	257
+
+struct lzw {
+	const unsigned char *in;	/* codes, after the 3 byte header */
+	size_t len;
+	size_t grp, grplen;		/* current group, in bytes */
+	size_t bit, nbit;		/* next code and limit, in bits */
+	uint32_t n_bits, maxbits, maxcode, maxmaxcode, free_ent;
+	int clear;
+};
+
+private int32_t
+lzw_getcode(struct lzw *z)
+{
+	const unsigned char *p;
+	uint32_t v, b;
+
+	if (z->clear || z->bit >= z->nbit || z->free_ent > z->maxcode) {
+		if (z->free_ent > z->maxcode) {
+			z->n_bits++;
+			z->maxcode = z->n_bits == z->maxbits ? z->maxmaxcode :
+			    (1U << z->n_bits) - 1;
+		}
+		if (z->clear) {
+			z->n_bits = LZW_INIT_BITS;
+			z->maxcode = (1U << z->n_bits) - 1;
+			z->clear = 0;
+		}
+		z->grp += z->grplen;
+		if (z->grp >= z->len)
+			return -1;
+		z->grplen = MIN(z->n_bits, z->len - z->grp);
+		if ((z->grplen << 3) < z->n_bits)
+			return -1;
+		z->bit = 0;
+		z->nbit = (z->grplen << 3) - (z->n_bits - 1);
+	}
+
+	p = z->in + z->grp + (z->bit >> 3);
+	b = 8 - (uint32_t)(z->bit & 7);
+	v = *p++ >> (8 - b);
+	for (; b < z->n_bits; b += 8)
+		v |= (uint32_t)*p++ << b;
+	z->bit += z->n_bits;
+	return (int32_t)(v & ((1U << z->n_bits) - 1));
+}
+
+private size_t
+uncompresslzw(struct magic_set *ms, const unsigned char *old,
+    unsigned char **newch, size_t n)
+{
+	struct lzw z;
+	uint16_t *prefix;
+	unsigned char *suffix, *stack, *sp, finchar;
+	int32_t code, oldcode, incode;
+	int block_mode;
+	size_t nout = 0, len;
+
+	if (n < 3 || (old[2] & 0x1f) > LZW_MAX_BITS)
+		return NODATA;
+
+	len = (sizeof(*prefix) + 2) << LZW_MAX_BITS;
+	if ((prefix = CAST(uint16_t *, malloc(len))) == NULL) {
+		file_oomem(ms, len);
+		return NODATA;
+	}
+	suffix = CAST(unsigned char *, (void *)(prefix + (1 << LZW_MAX_BITS)));
+	stack = suffix + (1 << LZW_MAX_BITS);
+
+	if ((*newch = CAST(unsigned char *, malloc(HOWMANY + 1))) == NULL) {
+		free(prefix);
+		file_oomem(ms, HOWMANY + 1);
+		return NODATA;
+	}
+
+	(void)memset(&z, 0, sizeof(z));
+	z.in = old + 3;
+	z.len = n - 3;
+	z.maxbits = old[2] & 0x1f;
+	z.maxmaxcode = 1U << z.maxbits;
+	z.n_bits = LZW_INIT_BITS;
+	z.maxcode = (1U << z.n_bits) - 1;
+	block_mode = old[2] & 0x80;
+	z.free_ent = block_mode ? LZW_FIRST : 256;
+
+	if ((oldcode = lzw_getcode(&z)) == -1 || oldcode > 255)
+		goto out;
+	(*newch)[nout++] = finchar = (unsigned char)oldcode;
+
+	while (nout < HOWMANY && (code = lzw_getcode(&z)) != -1) {
+		if (code == LZW_CLEAR && block_mode) {
+			z.clear = 1;
+			z.free_ent = LZW_FIRST - 1;
+			if ((code = lzw_getcode(&z)) == -1 || code > 255)
+				break;
+		}
+		incode = code;
+		sp = stack;
+		/* KwKwK: the code being defined right now */
+		if ((uint32_t)code >= z.free_ent) {
+			if ((uint32_t)code > z.free_ent)
+				break;		/* damaged data */
+			*sp++ = finchar;
+			code = oldcode;
+		}
+		while (code >= 256) {
+			if (sp == stack + (1 << LZW_MAX_BITS) - 1)
+				goto out;
+			*sp++ = suffix[code];
+			code = prefix[code];
+		}
+		*sp++ = finchar = (unsigned char)code;
+		while (sp > stack && nout < HOWMANY)
+			(*newch)[nout++] = *--sp;
+
+		if (z.free_ent < z.maxmaxcode) {
+			prefix[z.free_ent] = (uint16_t)oldcode;
+			suffix[z.free_ent] = finchar;
+			z.free_ent++;
+		}
+		oldcode = incode;
+	}
+out:
+	free(prefix);
+	/* let's keep the nul-terminate tradition */
+	(*newch)[nout] = '\0';
+	return nout;
+}
+
 #ifdef BUILTIN_DECOMPRESS
 
 #define FHCRC		(1 << 1)
@@ -310,15 +506,72 @@ file_pipe2file(struct magic_set *ms, int fd, const void *startbuf,
 #define FNAME		(1 << 3)
 #define FCOMMENT	(1 << 4)
 
+/*
+ * Inflate a raw deflate stream, as found in gzip and zip files.
+ */
 private size_t
-uncompressgzipped(struct magic_set *ms, const unsigned char *old,
+uncompresszlib(struct magic_set *ms, int fd, const unsigned char *old,
     unsigned char **newch, size_t n)
 {
-	unsigned char flg = old[3];
-	size_t data_start = 10;
+	unsigned char buf[ZBUFSIZ];
 	z_stream z;
+	size_t len;
 	int rc;
 
+	if ((*newch = CAST(unsigned char *, malloc(HOWMANY + 1))) == NULL) {
+		file_oomem(ms, HOWMANY + 1);
+		return NODATA;
+	}
+	
+	/* XXX: const castaway, via strchr */
+	z.next_in = (Bytef *)strchr((const char *)old, old[0]);
+	z.avail_in = CAST(uint32_t, n);
+	z.next_out = *newch;
+	z.avail_out = HOWMANY;
+	z.zalloc = Z_NULL;
+	z.zfree = Z_NULL;
+	z.opaque = Z_NULL;
+
+	/* LINTED bug in header macro */
+	rc = inflateInit2(&z, -15);
+	if (rc != Z_OK) {
+		file_error(ms, 0, "zlib: %s", z.msg);
+		free(*newch);
+		*newch = NULL;
+		return NODATA;
+	}
+
+	/*
+	 * Like gzip -d, a damaged stream still yields what came before
+	 * the damage.
+	 */
+	while (z.avail_out > 0) {
+		if (z.avail_in == 0) {
+			if ((len = zfill(fd, buf, sizeof(buf))) == 0)
+				break;
+			z.next_in = buf;
+			z.avail_in = CAST(uint32_t, len);
+		}
+		if (inflate(&z, Z_SYNC_FLUSH) != Z_OK)
+			break;
+	}
+
+	n = HOWMANY - z.avail_out;
+	(void)inflateEnd(&z);
+	
+	/* let's keep the nul-terminate tradition */
+	(*newch)[n] = '\0';
+
+	return n;
+}
+
+private size_t
+uncompressgzipped(struct magic_set *ms, int fd, const unsigned char *old,
+    unsigned char **newch, size_t n)
+{
+	unsigned char flg = old[3];
+	size_t data_start = 10;
+
 	if (flg & FEXTRA) {
 		if (data_start+1 >= n)
 			return 0;
@@ -339,39 +592,142 @@ uncompressgzipped(struct magic_set *ms, const unsigned char *old,
 
 	if (data_start >= n)
 		return 0;
-	if ((*newch = CAST(unsigned char *, malloc(HOWMANY + 1))) == NULL) {
+	return uncompresszlib(ms, fd, old + data_start, newch,
+	    n - data_start);
+}
+
+/*
+ * Only the first member is looked at, as gzip -d does.
+ */
+private size_t
+uncompresszip(struct magic_set *ms, int fd, const unsigned char *old,
+    unsigned char **newch, size_t n)
+{
+	size_t data_start;
+	uint32_t flg, method, len;
+
+	if (n < 30)
+		return 0;
+	flg = old[6] | (old[7] << 8);
+	method = old[8] | (old[9] << 8);
+	data_start = 30 + (old[26] | (old[27] << 8)) +
+	    (old[28] | (old[29] << 8));
+	if (data_start >= n || (flg & 1))	/* encrypted */
 		return 0;
-	}
-	
-	/* XXX: const castaway, via strchr */
-	z.next_in = (Bytef *)strchr((const char *)old + data_start,
-	    old[data_start]);
-	z.avail_in = CAST(uint32_t, (n - data_start));
-	z.next_out = *newch;
-	z.avail_out = HOWMANY;
-	z.zalloc = Z_NULL;
-	z.zfree = Z_NULL;
-	z.opaque = Z_NULL;
 
-	/* LINTED bug in header macro */
-	rc = inflateInit2(&z, -15);
-	if (rc != Z_OK) {
-		file_error(ms, 0, "zlib: %s", z.msg);
+	switch (method) {
+	case 0:		/* stored */
+		len = old[22] | (old[23] << 8) | (old[24] << 16) |
+		    ((uint32_t)old[25] << 24);
+		len = MIN(len, MIN(n - data_start, HOWMANY));
+		if ((*newch = CAST(unsigned char *, malloc(len + 1))) == NULL) {
+			file_oomem(ms, len + 1);
+			return NODATA;
+		}
+		(void)memcpy(*newch, old + data_start, len);
+		(*newch)[len] = '\0';
+		return len;
+	case 8:		/* deflated */
+		return uncompresszlib(ms, fd, old + data_start, newch,
+		    n - data_start);
+	default:
 		return 0;
 	}
+}
+#endif
 
-	rc = inflate(&z, Z_SYNC_FLUSH);
-	if (rc != Z_OK && rc != Z_STREAM_END) {
-		file_error(ms, 0, "zlib: %s", z.msg);
-		return 0;
+#ifdef BUILTIN_BZLIB
+private size_t
+uncompressbzipped(struct magic_set *ms, int fd, const unsigned char *old,
+    unsigned char **newch, size_t n)
+{
+	char buf[ZBUFSIZ];
+	bz_stream bz;
+	size_t len;
+	int rc;
+
+	if ((*newch = CAST(unsigned char *, malloc(HOWMANY + 1))) == NULL) {
+		file_oomem(ms, HOWMANY + 1);
+		return NODATA;
 	}
 
-	n = (size_t)z.total_out;
-	(void)inflateEnd(&z);
-	
-	/* let's keep the nul-terminate tradition */
+	(void)memset(&bz, 0, sizeof(bz));
+	if ((rc = BZ2_bzDecompressInit(&bz, 0, 0)) != BZ_OK) {
+		file_error(ms, 0, "bzlib: error %d", rc);
+		free(*newch);
+		*newch = NULL;
+		return NODATA;
+	}
+	/* const castaway; the input is not written to */
+	bz.next_in = (char *)(intptr_t)old;
+	bz.avail_in = CAST(unsigned int, n);
+	bz.next_out = (char *)*newch;
+	bz.avail_out = HOWMANY;
+
+	while (bz.avail_out > 0) {
+		if (bz.avail_in == 0) {
+			if ((len = zfill(fd, buf, sizeof(buf))) == 0)
+				break;
+			bz.next_in = buf;
+			bz.avail_in = CAST(unsigned int, len);
+		}
+		if (BZ2_bzDecompress(&bz) != BZ_OK)
+			break;
+	}
+
+	n = HOWMANY - bz.avail_out;
+	(void)BZ2_bzDecompressEnd(&bz);
 	(*newch)[n] = '\0';
+	return n;
+}
+#endif
+
+#ifdef BUILTIN_XZLIB
+private size_t
+uncompressxz(struct magic_set *ms, int fd, size_t method,
+    const unsigned char *old, unsigned char **newch, size_t n)
+{
+	unsigned char buf[ZBUFSIZ];
+	lzma_stream xz = LZMA_STREAM_INIT;
+	size_t len;
+	lzma_ret rc;
+
+	if ((*newch = CAST(unsigned char *, malloc(HOWMANY + 1))) == NULL) {
+		file_oomem(ms, HOWMANY + 1);
+		return NODATA;
+	}
+
+#ifdef BUILTIN_LZIP
+	if (method == METH_LZIP)
+		rc = lzma_lzip_decoder(&xz, UINT64_MAX, LZMA_CONCATENATED);
+	else
+#endif
+		rc = lzma_stream_decoder(&xz, UINT64_MAX, LZMA_CONCATENATED);
+	if (rc != LZMA_OK) {
+		file_error(ms, 0, "lzma: error %d", (int)rc);
+		free(*newch);
+		*newch = NULL;
+		return NODATA;
+	}
+	xz.next_in = old;
+	xz.avail_in = n;
+	xz.next_out = *newch;
+	xz.avail_out = HOWMANY;
+
+	while (xz.avail_out > 0) {
+		if (xz.avail_in == 0) {
+			if ((len = zfill(fd, buf, sizeof(buf))) == 0)
+				break;
+			xz.next_in = buf;
+			xz.avail_in = len;
+		}
+		if (lzma_code(&xz, LZMA_RUN) != LZMA_OK)
+			break;
+	}
 
+	n = HOWMANY - xz.avail_out;
+	lzma_end(&xz);
+	(*newch)[n] = '\0';
 	return n;
 }
 #endif
@@ -380,14 +736,37 @@ private size_t
 uncompressbuf(struct magic_set *ms, int fd, size_t method,
     const unsigned char *old, unsigned char **newch, size_t n)
 {
+#if HAVE_FORK
 	int fdin[2], fdout[2];
 	ssize_t r;
+#endif
 
+	switch (method) {
+	case METH_COMPRESS:
+	case METH_UNCOMPRESS:
+		return uncompresslzw(ms, old, newch, n);
 #ifdef BUILTIN_DECOMPRESS
-        /* FIXME: This doesn't cope with bzip2 */
-	if (method == 2)
-		return uncompressgzipped(ms, old, newch, n);
+	case METH_GZIP:
+		return uncompressgzipped(ms, zinput(fd, n), old, newch, n);
+	case METH_ZIP:
+		return uncompresszip(ms, zinput(fd, n), old, newch, n);
 #endif
+#ifdef BUILTIN_BZLIB
+	case METH_BZIP:
+		return uncompressbzipped(ms, zinput(fd, n), old, newch, n);
+#endif
+#ifdef BUILTIN_XZLIB
+#ifdef BUILTIN_LZIP
+	case METH_LZIP:
+#endif
+	case METH_XZ:
+		return uncompressxz(ms, zinput(fd, n), method, old, newch, n);
+#endif
+	default:
+		break;
+	}
+
+#if HAVE_FORK
 	(void)fflush(stdout);
 	(void)fflush(stderr);
 
@@ -501,5 +880,8 @@ err:
 	    
 		return n;
 	}
-}
+#else
+	(void)&fd;
+	return NODATA;
 #endif
+}
@@ -42,15 +42,21 @@ FILE_RCSID("@(#)$File: encoding.c,v 1.5 2010/07/21 16:47:17 christos Exp $")
 #include <string.h>
 #include <memory.h>
 #include <stdlib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
+/* Classes of text_chars[] seen in a buffer; plain ASCII has no bit */
+#define TC_I	1	/* ISO-8859 */
+#define TC_X	2	/* non-ISO extended ASCII */
+#define TC_F	4	/* never appears in text */
 
-private int looks_ascii(const unsigned char *, size_t, unichar *, size_t *);
+private int text_class(const unsigned char *, size_t);
+private int ebcdic_class(const unsigned char *, size_t, size_t *);
+private void widen(const unsigned char *, size_t, int, unichar *, size_t *);
 private int looks_utf8_with_BOM(const unsigned char *, size_t, unichar *,
     size_t *);
 private int looks_ucs16(const unsigned char *, size_t, unichar *, size_t *);
-private int looks_latin1(const unsigned char *, size_t, unichar *, size_t *);
-private int looks_extended(const unsigned char *, size_t, unichar *, size_t *);
-private void from_ebcdic(const unsigned char *, size_t, unsigned char *);
 
 #ifdef DEBUG_ENCODING
 #define DPRINTF(a) printf a
@@ -60,43 +66,48 @@ private void from_ebcdic(const unsigned char *, size_t, unsigned char *);
 
 /*
  * Try to determine whether text is in some character code we can
- * identify.  Each of these tests, if it succeeds, will leave
- * the text converted into one-unichar-per-character Unicode in
- * ubuf, and the number of characters converted in ulen.
+ * identify.  The byte classes are collected in a single sweep over
+ * buf, and the candidate codes are decided from them in order.  If
+ * ubuf is not NULL, the text is also converted into
+ * one-unichar-per-character Unicode, in scratch space, with the number
+ * of characters converted in ulen; for binary data that is the prefix
+ * that still reads as EBCDIC text.  Callers that only want the verdict
+ * pass NULL and skip the conversion.
  */
 protected int
 file_encoding(struct magic_set *ms, const unsigned char *buf, size_t nbytes, unichar **ubuf, size_t *ulen, const char **code, const char **code_mime, const char **type)
 {
-	size_t mlen;
-	int rv = 1, ucs_type;
-	unsigned char *nbuf = NULL;
-
-	mlen = (nbytes + 1) * sizeof(nbuf[0]);
-	if ((nbuf = CAST(unsigned char *, calloc((size_t)1, mlen))) == NULL) {
-		file_oomem(ms, mlen);
-		goto done;
-	}
-	mlen = (nbytes + 1) * sizeof((*ubuf)[0]);
-	if ((*ubuf = CAST(unichar *, calloc((size_t)1, mlen))) == NULL) {
-		file_oomem(ms, mlen);
-		goto done;
+	size_t mlen, n = nbytes;
+	int rv = 1, ucs_type, decoded = 0, ebcdic = 0, cls;
+	unichar *u = NULL;
+
+	if (ubuf != NULL) {
+		*ulen = 0;
+		mlen = (nbytes + 1) * sizeof((*ubuf)[0]);
+		if ((u = *ubuf = CAST(unichar *,
+		    file_arena_alloc(ms, mlen))) == NULL)
+			ubuf = NULL;
 	}
 
 	*type = "text";
-	if (looks_ascii(buf, nbytes, *ubuf, ulen)) {
-		DPRINTF(("ascii %" SIZE_T_FORMAT "u\n", *ulen));
+	cls = text_class(buf, nbytes);
+	if (cls == 0) {
+		DPRINTF(("ascii\n"));
 		*code = "ASCII";
 		*code_mime = "us-ascii";
-	} else if (looks_utf8_with_BOM(buf, nbytes, *ubuf, ulen) > 0) {
-		DPRINTF(("utf8/bom %" SIZE_T_FORMAT "u\n", *ulen));
+	} else if ((cls & TC_F) == 0 &&
+	    looks_utf8_with_BOM(buf, nbytes, u, ulen) > 0) {
+		DPRINTF(("utf8/bom\n"));
 		*code = "UTF-8 Unicode (with BOM)";
 		*code_mime = "utf-8";
-	} else if (file_looks_utf8(buf, nbytes, *ubuf, ulen) > 1) {
-		DPRINTF(("utf8 %" SIZE_T_FORMAT "u\n", *ulen));
-		*code = "UTF-8 Unicode (with BOM)";
+		decoded = 1;
+	} else if ((cls & TC_F) == 0 &&
+	    file_looks_utf8(buf, nbytes, u, ulen) > 1) {
+		DPRINTF(("utf8\n"));
 		*code = "UTF-8 Unicode";
 		*code_mime = "utf-8";
-	} else if ((ucs_type = looks_ucs16(buf, nbytes, *ubuf, ulen)) != 0) {
+		decoded = 1;
+	} else if ((ucs_type = looks_ucs16(buf, nbytes, u, ulen)) != 0) {
 		if (ucs_type == 1) {
 			*code = "Little-endian UTF-16 Unicode";
 			*code_mime = "utf-16le";
@@ -104,25 +115,26 @@ file_encoding(struct magic_set *ms, const unsigned char *buf, size_t nbytes, uni
 			*code = "Big-endian UTF-16 Unicode";
 			*code_mime = "utf-16be";
 		}
-		DPRINTF(("ucs16 %" SIZE_T_FORMAT "u\n", *ulen));
-	} else if (looks_latin1(buf, nbytes, *ubuf, ulen)) {
-		DPRINTF(("latin1 %" SIZE_T_FORMAT "u\n", *ulen));
+		DPRINTF(("ucs16\n"));
+		decoded = 1;
+	} else if ((cls & (TC_F|TC_X)) == 0) {
+		DPRINTF(("latin1\n"));
 		*code = "ISO-8859";
 		*code_mime = "iso-8859-1";
-	} else if (looks_extended(buf, nbytes, *ubuf, ulen)) {
-		DPRINTF(("extended %" SIZE_T_FORMAT "u\n", *ulen));
+	} else if ((cls & TC_F) == 0) {
+		DPRINTF(("extended\n"));
 		*code = "Non-ISO extended-ASCII";
 		*code_mime = "unknown-8bit";
 	} else {
-		from_ebcdic(buf, nbytes, nbuf);
+		ebcdic = 1;
+		cls = ebcdic_class(buf, nbytes, &n);
 
-		if (looks_ascii(nbuf, nbytes, *ubuf, ulen)) {
-			DPRINTF(("ebcdic %" SIZE_T_FORMAT "u\n", *ulen));
+		if (cls == 0) {
+			DPRINTF(("ebcdic\n"));
 			*code = "EBCDIC";
 			*code_mime = "ebcdic";
-		} else if (looks_latin1(nbuf, nbytes, *ubuf, ulen)) {
-			DPRINTF(("ebcdic/international %" SIZE_T_FORMAT "u\n",
-			    *ulen));
+		} else if ((cls & (TC_F|TC_X)) == 0) {
+			DPRINTF(("ebcdic/international\n"));
 			*code = "International EBCDIC";
 			*code_mime = "ebcdic";
 		} else { /* Doesn't look like text at all */
@@ -132,9 +144,9 @@ file_encoding(struct magic_set *ms, const unsigned char *buf, size_t nbytes, uni
 		}
 	}
 
- done:
-	if (nbuf)
-		free(nbuf);
+	if (ubuf != NULL && !decoded)
+		widen(buf, n, ebcdic, u, ulen);
+	DPRINTF(("%" SIZE_T_FORMAT "u characters\n", ubuf ? *ulen : 0));
 
 	return rv;
 }
@@ -218,63 +230,67 @@ private char text_chars[256] = {
 	I, I, I, I, I, I, I, I, I, I, I, I, I, I, I, I   /* 0xfX */
 };
 
-private int
-looks_ascii(const unsigned char *buf, size_t nbytes, unichar *ubuf,
-    size_t *ulen)
-{
-	size_t i;
-
-	*ulen = 0;
-
-	for (i = 0; i < nbytes; i++) {
-		int t = text_chars[buf[i]];
-
-		if (t != T)
-			return 0;
-
-		ubuf[(*ulen)++] = buf[i];
-	}
-
-	return 1;
-}
+private const int tc_bits[] = { TC_F, 0, TC_I, TC_X };	/* by class */
 
+/*
+ * Return the TC_* classes of the characters in buf, in one sweep.  We
+ * stop at the first F: after that only UCS-16 and EBCDIC can match,
+ * and neither of them goes by the classes.
+ */
 private int
-looks_latin1(const unsigned char *buf, size_t nbytes, unichar *ubuf, size_t *ulen)
+text_class(const unsigned char *buf, size_t nbytes)
 {
-	size_t i;
-
-	*ulen = 0;
-
-	for (i = 0; i < nbytes; i++) {
-		int t = text_chars[buf[i]];
-
-		if (t != T && t != I)
-			return 0;
-
-		ubuf[(*ulen)++] = buf[i];
+	size_t i = 0;
+	int cls = 0;
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i sp = _mm_set1_epi8(0x20), del = _mm_set1_epi8(0x7f);
+	const __m128i a0 = _mm_set1_epi8((char)0xa0);
+	const __m128i nel = _mm_set1_epi8((char)0x85);
+	__m128i v, hi, ok, lo;
+	int ctl, h, x;
+
+	for (; i + 16 <= nbytes; i += 16) {
+		v = _mm_loadu_si128(CAST(const __m128i *,
+		    (const void *)(buf + i)));
+		/* as signed bytes, 0x80 and up are negative */
+		hi = _mm_cmplt_epi8(v, zero);
+		ctl = _mm_movemask_epi8(_mm_or_si128(
+		    _mm_andnot_si128(hi, _mm_cmplt_epi8(v, sp)),
+		    _mm_cmpeq_epi8(v, del)));
+		if (ctl) {
+			/* BEL BS HT LF FF CR ESC, as in text_chars[] */
+			ok = _mm_or_si128(
+			    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(7)),
+			    _mm_cmpeq_epi8(v, _mm_set1_epi8(8))),
+			    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(9)),
+			    _mm_cmpeq_epi8(v, _mm_set1_epi8(10))));
+			ok = _mm_or_si128(ok,
+			    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(12)),
+			    _mm_cmpeq_epi8(v, _mm_set1_epi8(13))));
+			ok = _mm_or_si128(ok,
+			    _mm_cmpeq_epi8(v, _mm_set1_epi8(27)));
+			if (ctl & ~_mm_movemask_epi8(ok))
+				return cls | TC_F;
+		}
+		h = _mm_movemask_epi8(hi);
+		if (h) {
+			/* 0x80 ... 0x9f are X but for NEL, the rest I */
+			lo = _mm_and_si128(hi, _mm_cmplt_epi8(v, a0));
+			x = _mm_movemask_epi8(lo);
+			if (x & ~_mm_movemask_epi8(_mm_cmpeq_epi8(v, nel)))
+				cls |= TC_X;
+			if (h & ~x)
+				cls |= TC_I;
+		}
 	}
-
-	return 1;
-}
-
-private int
-looks_extended(const unsigned char *buf, size_t nbytes, unichar *ubuf,
-    size_t *ulen)
-{
-	size_t i;
-
-	*ulen = 0;
-
-	for (i = 0; i < nbytes; i++) {
-		int t = text_chars[buf[i]];
-
-		if (t != T && t != I && t != X)
-			return 0;
-
-		ubuf[(*ulen)++] = buf[i];
+#endif
+	for (; i < nbytes; i++) {
+		cls |= tc_bits[(int)text_chars[buf[i]]];
+		if (cls & TC_F)
+			break;
 	}
-
-	return 1;
+	return cls;
 }
 
 /*
@@ -295,11 +311,31 @@ file_looks_utf8(const unsigned char *buf, size_t nbytes, unichar *ubuf, size_t *
 	int n;
 	unichar c;
 	int gotone = 0, ctrl = 0;
+#ifdef __SSE2__
+	size_t run, nrun;
+#endif
 
 	if (ubuf)
 		*ulen = 0;
 
 	for (i = 0; i < nbytes; i++) {
+#ifdef __SSE2__
+		/* Take runs of plain ASCII a block at a time */
+		for (run = i; run + 16 <= nbytes; run += 16)
+			if (_mm_movemask_epi8(_mm_loadu_si128(CAST(const __m128i *,
+			    (const void *)(buf + run)))) != 0)
+				break;
+		if (run > i) {
+			if (text_class(buf + i, run - i) & TC_F)
+				ctrl = 1;
+			if (ubuf) {
+				widen(buf + i, run - i, 0, ubuf + *ulen, &nrun);
+				*ulen += nrun;
+			}
+			if ((i = run) >= nbytes)
+				break;
+		}
+#endif
 		if ((buf[i] & 0x80) == 0) {	   /* 0xxxxxxx is plain ASCII */
 			/*
 			 * Even if the whole file is valid UTF-8 sequences,
@@ -375,6 +411,7 @@ looks_ucs16(const unsigned char *buf, size_t nbytes, unichar *ubuf,
 {
 	int bigend;
 	size_t i;
+	unichar c;
 
 	if (nbytes < 2)
 		return 0;
@@ -386,20 +423,23 @@ looks_ucs16(const unsigned char *buf, size_t nbytes, unichar *ubuf,
 	else
 		return 0;
 
-	*ulen = 0;
+	if (ubuf)
+		*ulen = 0;
 
 	for (i = 2; i + 1 < nbytes; i += 2) {
 		/* XXX fix to properly handle chars > 65536 */
 
 		if (bigend)
-			ubuf[(*ulen)++] = buf[i + 1] + 256 * buf[i];
+			c = buf[i + 1] + 256 * buf[i];
 		else
-			ubuf[(*ulen)++] = buf[i] + 256 * buf[i + 1];
+			c = buf[i] + 256 * buf[i + 1];
 
-		if (ubuf[*ulen - 1] == 0xfffe)
+		if (ubuf)
+			ubuf[(*ulen)++] = c;
+
+		if (c == 0xfffe)
 			return 0;
-		if (ubuf[*ulen - 1] < 128 &&
-		    text_chars[(size_t)ubuf[*ulen - 1]] != T)
+		if (c < 128 && text_chars[(size_t)c] != T)
 			return 0;
 	}
 
@@ -488,14 +528,39 @@ private unsigned char ebcdic_1047_to_8859[] = {
 #endif
 
 /*
- * Copy buf[0 ... nbytes-1] into out[], translating EBCDIC to ASCII.
+ * Copy buf into ubuf one character per byte, from EBCDIC if asked.
  */
 private void
-from_ebcdic(const unsigned char *buf, size_t nbytes, unsigned char *out)
+widen(const unsigned char *buf, size_t nbytes, int ebcdic, unichar *ubuf,
+    size_t *ulen)
+{
+	size_t i;
+
+	if (ebcdic) {
+		for (i = 0; i < nbytes; i++)
+			ubuf[i] = ebcdic_to_ascii[buf[i]];
+	} else {
+		for (i = 0; i < nbytes; i++)
+			ubuf[i] = buf[i];
+	}
+	*ulen = nbytes;
+}
+
+/*
+ * Like text_class(), for buf read as EBCDIC; stop at the first byte
+ * that is neither ASCII nor ISO-8859 text, with *np the bytes before it.
+ */
+private int
+ebcdic_class(const unsigned char *buf, size_t nbytes, size_t *np)
 {
 	size_t i;
+	int cls = 0;
 
 	for (i = 0; i < nbytes; i++) {
-		out[i] = ebcdic_to_ascii[buf[i]];
+		cls |= tc_bits[(int)text_chars[ebcdic_to_ascii[buf[i]]]];
+		if (cls & (TC_F|TC_X))
+			break;
 	}
+	*np = i;
+	return cls;
 }
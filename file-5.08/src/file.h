@@ -113,14 +113,25 @@
 #ifndef HOWMANY
 # define HOWMANY (256 * 1024)	/* how much of the file to look at */
 #endif
+#define READER_BLOCK 4096	/* magic_reader() reads in these units */
+#define READER_NBLOCK 8		/* blocks it keeps */
+#define READER_MAXWIN (64 * 1024)	/* most it reads for one test */
+#define MEMO_KEYLEN 16		/* leading bytes a memo bucket is picked by */
+#define MEMO_MAXDATA 4096	/* most bytes a memo entry compares */
+#define MEMO_MAXTRACK (64 * 1024)	/* most bytes noted while matching */
+#define MEMO_SHAPES 16		/* memo shapes tried for one buffer */
+#define MEMO_GAP 16		/* bytes between reads a memo range spans */
 #define MAXMAGIS 8192		/* max entries in any one magic file
 				   or directory */
 #define MAXDESC	64		/* max leng of text description/MIME type */
 #define MAXstring 64		/* max leng of "string" types */
 
 #define MAGICNO		0xF11E041C
-#define VERSIONNO	8
-#define FILE_MAGICSIZE	232
+#define VERSIONNO	10
+#define OLD_VERSIONNO	8	/* still read: each entry with its text */
+#define OLD_MAGICSIZE	(FILE_MAGICSIZE + 2 * MAXDESC + 8)
+#define FILE_MAGICSIZE	96
+#define FILE_DESCSIZE	16
 
 #define	FILE_LOAD	0
 #define FILE_CHECK	1
@@ -278,14 +289,25 @@ struct magic {
 #define str_flags _u._s._flags
 	/* Words 9-16 */
 	union VALUETYPE value;	/* either number or string */
-	/* Words 17-32 */
-	char desc[MAXDESC];	/* description */
-	/* Words 33-48 */
-	char mimetype[MAXDESC]; /* MIME type */
-	/* Words 49-50 */
-	char apple[8];
 };
 
+/*
+ * The text of an entry, kept apart from struct magic so that the
+ * matcher only walks the fields it needs to evaluate a test.  The
+ * array runs parallel to mlist->magic and is only read once a test
+ * has matched.  The strings are in the string pool of the list, each
+ * distinct one once; their offsets count from the record itself, so
+ * that the records work as they are where a compiled file is mapped.
+ */
+struct magic_desc {
+	uint32_t desc;		/* description */
+	uint32_t mimetype;	/* MIME type */
+	uint32_t apple;		/* Apple creator and type, up to 8 bytes */
+	uint32_t file;		/* base name of the magic file */
+};
+
+#define DESC_STR(d, f)	(CAST(const char *, (const void *)(d)) + (d)->f)
+
 #define BIT(A)   (1 << (A))
 #define STRING_COMPACT_WHITESPACE		BIT(0)
 #define STRING_COMPACT_OPTIONAL_WHITESPACE	BIT(1)
@@ -321,14 +343,213 @@ struct magic {
 #define STRING_DEFAULT_RANGE		100
 
 
+/*
+ * A compiled magic file, which is also how a loaded list is laid out in
+ * memory: this header, then the sections it lists, each at an offset
+ * from the start that is a multiple of 8.  Everything is in the byte
+ * order of the host that compiled the file, so that one mapped on a
+ * host with the same byte order is used as it is, read-only, and its
+ * pages are shared by every process using it.  A section that a list
+ * does not have has size 0; only compiled files have the indexes.
+ */
+#define MAGIC_SECT_MAGIC	0	/* struct magic, by entry */
+#define MAGIC_SECT_DESC		1	/* struct magic_desc, by entry;
+					 * right after the entries */
+#define MAGIC_SECT_STRS		2	/* NUL terminated strings */
+#define MAGIC_SECT_IKEY		3	/* magic_index key */
+#define MAGIC_SECT_IOFF		4	/* magic_index off */
+#define MAGIC_SECT_IALWAYS	5	/* magic_index always */
+#define MAGIC_SECT_SLIT		6	/* magic_search lit */
+#define MAGIC_SECT_SLITLEN	7	/* magic_search litlen */
+#define MAGIC_SECT_SCLASS	8	/* magic_search class */
+#define MAGIC_SECT_SDELTA	9	/* magic_search delta */
+#define MAGIC_SECT_SOUT		10	/* magic_search out */
+#define MAGIC_SECT_SOUTS	11	/* magic_search outs */
+#define MAGIC_SECT_SFOLD	12	/* tolower() of each byte, as the
+					 * automaton was built with it */
+#define MAGIC_NSECT		13
+
+struct magic_sect {
+	uint32_t offset;
+	uint32_t size;			/* in bytes */
+};
+
+struct magic_hdr {
+	uint32_t magic;			/* MAGICNO */
+	uint32_t version;		/* VERSIONNO */
+	uint32_t nmagic;
+	uint32_t magicsize;		/* sizeof(struct magic) */
+	uint32_t nsect;			/* MAGIC_NSECT */
+	uint32_t nclass;		/* magic_search nclass */
+	uint32_t reach;			/* magic_search reach */
+	uint32_t unused;
+	struct magic_sect sect[MAGIC_NSECT];
+};
+
 /* list of magic entries */
 struct mlist {
 	struct magic *magic;		/* array of magic entries */
+	struct magic_desc *desc;	/* their descriptions, by entry */
 	uint32_t nmagic;			/* number of entries in array */
 	int mapped;  /* allocation type: 0 => apprentice_file
 		      *                  1 => apprentice_map + malloc
 		      *                  2 => apprentice_map + mmap */
+	struct magic_hdr *image;	/* where magic and desc are */
+	size_t isize;			/* bytes in image */
 	struct mlist *next, *prev;
+	struct magic_regex **regex;	/* compiled FILE_REGEX patterns,
+					 * by entry; NULL if not loaded */
+	struct magic_index *index;	/* top-level dispatch; NULL if not
+					 * loaded */
+	struct magic_search *search;	/* FILE_SEARCH and FILE_REGEX
+					 * literals; NULL if not loaded */
+	size_t reach;			/* bytes that tests at fixed offsets
+					 * look at, from the start */
+	char *name;			/* magic file loaded */
+	uint32_t first;			/* entries in the lists before */
+};
+
+/*
+ * Atomic reference counting for data shared between handles that may
+ * be used from different threads.
+ */
+#if defined(__GNUC__) && __GNUC_PREREQ__(4, 1)
+#define file_atomic_inc(p)	__sync_add_and_fetch((p), 1)
+#define file_atomic_dec(p)	__sync_sub_and_fetch((p), 1)
+#define file_atomic_trylock(p)	(__sync_lock_test_and_set((p), 1) == 0)
+#define file_atomic_unlock(p)	__sync_lock_release(p)
+#elif defined(_MSC_VER)
+#include <intrin.h>
+#define file_atomic_inc(p)	_InterlockedIncrement(p)
+#define file_atomic_dec(p)	_InterlockedDecrement(p)
+#define file_atomic_trylock(p)	(_InterlockedExchange((p), 1) == 0)
+#define file_atomic_unlock(p)	(void)_InterlockedExchange((p), 0)
+#else
+/* No atomics known; handles sharing a database must not cross threads */
+#define file_atomic_inc(p)	(++*(p))
+#define file_atomic_dec(p)	(--*(p))
+#define file_atomic_trylock(p)	(*(p) == 0 && (*(p) = 1))
+#define file_atomic_unlock(p)	(*(p) = 0)
+#endif
+
+/*
+ * Take a lock that is only held for a few instructions; a thread that
+ * finds it taken gives up the processor, as the holder may have been
+ * preempted
+ */
+#define file_atomic_lock(p) \
+	do { while (!file_atomic_trylock(p)) file_yield(); } while (0)
+
+/*
+ * A compiled regex, shared by everyone in the process who uses the same
+ * pattern and flags; see file_regcomp(). Matching may update the
+ * compiled pattern, so a thread takes a copy off the spare list for
+ * each match and puts it back after. One that finds the list empty
+ * compiles another copy, which stays, so there end up as many copies
+ * as threads have matched the pattern at once.
+ */
+struct magic_regex_copy {
+	regex_t rx;
+	struct magic_regex_copy *next;
+};
+
+struct magic_regex {
+	struct magic_regex_copy *spare;	/* copies not in use */
+	volatile long lock;		/* of spare */
+	long refs;			/* users; under the cache lock */
+	size_t hash;			/* its cache hash chain */
+	struct magic_regex *next;	/* in that chain */
+	struct magic_regex *newer, *older;	/* if unused, in the order
+						   they were released */
+	int cflags;
+	char pat[1];			/* the pattern, allocated with it */
+};
+
+/*
+ * Dispatch index over the top-level entries of a list. An entry that
+ * compares a constant at a fixed offset is keyed on that offset and the
+ * leading bytes it needs there; match() only tries such an entry when
+ * those bytes are in the buffer. All other entries are always tried.
+ */
+struct magic_ikey {
+	uint32_t offset;
+	uint32_t magindex;
+	uint8_t len;			/* number of bytes in val */
+	uint8_t val[4];			/* bytes required at offset */
+};
+
+struct magic_ioff {
+	uint32_t offset;
+	uint32_t key, nkey;		/* keys at offset, by val[0] */
+};
+
+struct magic_index {
+	uint32_t nwords;		/* size of an entry bitmap */
+	uint32_t *always;		/* bitmap of unindexed entries */
+	struct magic_ioff *off;		/* offsets in ascending order */
+	uint32_t noff;
+	struct magic_ikey *key;
+	uint32_t nkey;
+	int mapped;			/* arrays are in the list's image */
+};
+
+/*
+ * Aho-Corasick automaton over the leading literals of the FILE_SEARCH
+ * entries of a list, folded to lower case (and cut at the first blank
+ * for the whitespace flags) so that every real match of an entry starts
+ * with an occurrence of its literal. One pass over the buffer finds the
+ * first occurrence of each literal; a search then fails at once if its
+ * literal is not there, or starts at the occurrence.
+ *
+ * FILE_REGEX entries add the literal that every match of their pattern
+ * contains, when it has one. This is only a prefilter: the pass rules
+ * out the regexes whose literal is missing from the region, and
+ * regexec() still runs, one entry at a time, for all the others and
+ * for those without a literal.
+ */
+#define SEARCH_MAXLIT	8		/* longest literal kept */
+#define SEARCH_NOLIT	0xffffffff
+
+struct magic_search {
+	uint32_t *lit;			/* literal of each entry or NOLIT;
+					 * a regex match contains it */
+	uint32_t nlit;
+	uint8_t *litlen;
+	uint16_t class[256];		/* input byte to symbol class */
+	uint32_t nclass;
+	uint32_t nstate;
+	uint32_t *delta;		/* nstate x nclass transitions */
+	uint32_t *out;			/* first literal ending at a state */
+	uint32_t *outs;			/* literals by state, from out[] */
+	size_t reach;			/* most bytes a search looks at,
+					 * unless it has no range */
+	int mapped;			/* arrays are in the list's image */
+};
+
+#define FILE_REGEX_CFLAGS(m)	(REG_EXTENDED|REG_NEWLINE| \
+    (((m)->str_flags & STRING_IGNORE_CASE) ? REG_ICASE : 0))
+
+/*
+ * A loaded magic database. It is not modified after loading, so one
+ * database can back any number of handles; each holds a reference.
+ */
+struct magic_db {
+	struct mlist *mlist;		/* list of magic files */
+	volatile long refs;		/* references from handles and users */
+	struct magic_memo *memo;	/* soft magic results; NULL if off */
+	struct magic_prof *prof;	/* totals of the profiled handles */
+	uint32_t nprof;
+	volatile long profbusy;
+};
+
+/*
+ * What an entry cost under MAGIC_PROFILE, by entry number across all
+ * the lists of a database (mlist->first + magindex)
+ */
+struct magic_prof {
+	uint64_t tests;			/* times it was tried */
+	uint64_t hits;			/* times it matched */
+	uint64_t cycles;		/* in mget() and magiccheck() */
 };
 
 #ifdef __cplusplus
@@ -347,15 +568,32 @@ struct level_info {
 	int last_cond;	/* used for error checking by parse() */
 #endif
 };
+/*
+ * Whether a handle finds the MIME type and encoding while describing the
+ * buffer; with the MIME or Apple flags set they are the output instead
+ */
+#define MIME_FIELDS(ms)	(((ms)->flags & \
+    (MAGIC_MIME_FIELDS|MAGIC_MIME|MAGIC_APPLE)) == MAGIC_MIME_FIELDS)
+
+struct magic_match;
+
+/* Same as MAGIC_NSTAGES and MAGIC_STATS_BUCKETS */
+#define FILE_NSTAGES		9
+#define FILE_STATS_BUCKETS	32
+
 struct magic_set {
-	struct mlist *mlist;
+	struct magic_db *db;		/* shared, read-only */
 	struct cont {
 		size_t len;
 		struct level_info *li;
 	} c;
 	struct out {
-		char *buf;		/* Accumulation buffer */
+		char *buf;		/* Accumulation buffer, NULL if empty */
+		size_t blen;		/* length of the text in buf */
+		char *bmem;		/* memory for buf, kept across calls */
+		size_t bsize;		/* allocated size of bmem */
 		char *pbuf;		/* Printable buffer */
+		size_t psize;		/* allocated size of pbuf */
 	} o;
 	uint32_t offset;
 	int error;
@@ -376,13 +614,138 @@ struct magic_set {
 	/* FIXME: Make the string dynamically allocated so that e.g.
 	   strings matched in files can be longer than MAXstring */
 	union VALUETYPE ms_value;	/* either number or string */
+
+	/* candidate entries for match(), from the dispatch index */
+	struct {
+		uint32_t *bits;
+		size_t len;		/* allocated words */
+		int busy;		/* in use by an outer match() */
+	} cand;
+
+	/* first occurrences of the search literals, see magic_search */
+	struct {
+		const struct magic_search *sr;	/* automaton used */
+		const unsigned char *s, *e;	/* region scanned */
+		uint32_t *first;	/* offset from s or SEARCH_NOLIT */
+		size_t len;		/* allocated entries */
+	} lit;
+
+	/* grow-only scratch memory, kept from call to call; see funcs.c */
+	struct arena {
+		struct arena_chunk {
+			char *base;
+			size_t size;
+		} *chunk;
+		size_t nchunk;		/* allocated chunks */
+		size_t cur;		/* chunk being carved */
+		size_t used;		/* bytes handed out from it */
+	} scratch;
+
+	/* the rest of the file, for magic_reader(); see funcs.c */
+	struct reader {
+		ssize_t (*read)(void *, void *, size_t, unsigned long long);
+		void *cookie;
+		uint64_t size;			/* size of the file */
+		const unsigned char *buf;	/* buffer offsets refer to */
+		uint64_t base;			/* file offset of buf[0] */
+		struct reader_block {
+			unsigned char *data;
+			uint64_t off;		/* file offset of data[0] */
+			size_t len;		/* bytes read into data */
+			size_t size;		/* allocated size of data */
+			unsigned long used;	/* clock at last use */
+		} blk[READER_NBLOCK];
+		unsigned long clock;
+	} rd;
+
+	/* magic_buffer_batch() state; see file_softmagic_screen() */
+	struct {
+		const void *buf;	/* buffer being classified */
+		size_t len;
+		const uint32_t *cur;	/* its entries that passed */
+		uint32_t *bits;		/* those of all the buffers */
+		size_t words;		/* words per buffer, 0 if none */
+		size_t size;		/* allocated words */
+		char *res;		/* the results, NUL terminated, each
+					 * followed by its MIME type and
+					 * encoding for MAGIC_MIME_FIELDS */
+		size_t rlen, rsize;
+		size_t *roff;		/* where each result is in res */
+		size_t nroff;		/* allocated entries */
+		size_t nmime;		/* buffers in the last call, if
+					 * their MIME fields were kept */
+	} batch;
+
+	/* what file_softmagic() looked at, for the memo; see softmagic.c */
+	struct {
+		const unsigned char *buf;	/* buffer matched, NULL if none */
+		size_t nbytes;
+		size_t size;		/* bytes readable from buf[0] on */
+		struct memo_read {
+			size_t off;	/* offset from buf */
+			size_t len;
+			size_t at;	/* where its bytes are in data */
+		} *read;
+		size_t nread, rsize;
+		unsigned char *data;	/* the bytes read */
+		size_t dlen, dsize;
+		unsigned char *shapes;	/* memo shapes copied to look up */
+		size_t slen, ssize;
+		size_t ceiling;		/* most size can be and still
+					 * miss what was past the end */
+		int exact;		/* size and nbytes must be the same */
+		int bad;		/* cannot be memoized */
+	} memo;
+
+	/* what the stages of file_buffer() cost; see magic_getstats() */
+	struct {
+		uint64_t buffers;
+		struct stage_stats {
+			uint64_t runs, decided, cycles;
+			uint64_t hist[FILE_STATS_BUCKETS];
+		} stage[FILE_NSTAGES];
+	} stats;
+
+	/* MAGIC_MIME_FIELDS: found along with the description */
+	struct {
+		char type[MAXDESC];	/* MIME type, "" until found */
+		const char *encoding;	/* MIME encoding, NULL until found */
+		struct out save;	/* output memory used while looking
+					 * for the type on its own */
+	} mime;
+
+	/* MAGIC_PROFILE counts not yet added to the database's */
+	struct {
+		struct magic_prof *cnt;	/* NULL until first needed */
+		uint32_t n;
+	} prof;
+
+	/* magic_buffer_matches() state; see softmagic.c */
+	struct {
+		int on;			/* noting matches, not describing */
+		int stage;		/* that named the buffer, or -1 */
+		unsigned int base;	/* level of the entries reached
+					 * through the indirect entry at
+					 * ind */
+		size_t ind;		/* SIZE_MAX unless mget() is
+					 * about to follow an indirect */
+		size_t off;		/* of the part being matched */
+		struct magic_match *match;
+		size_t n, size;
+	} res;
+};
+
+/* Position in the scratch arena to release back to */
+struct arena_mark {
+	size_t cur;
+	size_t used;
 };
 
 /* Type for Unicode characters */
 typedef unsigned long unichar;
 
 struct stat;
-protected const char *file_fmttime(uint32_t, int);
+protected const char *file_fmttime(char *, size_t, uint32_t, int);
 protected int file_buffer(struct magic_set *, int, const char *, const void *,
     size_t);
 protected int file_fsmagic(struct magic_set *, const char *, struct stat *);
@@ -390,6 +753,12 @@ protected int file_pipe2file(struct magic_set *, int, const void *, size_t);
 protected int file_vprintf(struct magic_set *, const char *, va_list);
 protected size_t file_printedlen(const struct magic_set *);
 protected int file_replace(struct magic_set *, const char *, const char *);
+protected struct magic_regex *file_regcomp(struct magic_set *, const char *,
+    int);
+protected int file_regexec(struct magic_regex *, const char *, size_t,
+    regmatch_t *, int);
+protected void file_regfree(struct magic_regex *);
+protected void file_setmime(struct magic_set *, const char *, const char *);
 protected int file_printf(struct magic_set *, const char *, ...)
     __attribute__((__format__(__printf__, 2, 3)));
 protected int file_reset(struct magic_set *);
@@ -397,10 +766,8 @@ protected int file_tryelf(struct magic_set *, int, const unsigned char *,
     size_t);
 protected int file_trycdf(struct magic_set *, int, const unsigned char *,
     size_t);
-#if HAVE_FORK
 protected int file_zmagic(struct magic_set *, int, const char *,
     const unsigned char *, size_t);
-#endif
 protected int file_ascmagic(struct magic_set *, const unsigned char *, size_t);
 protected int file_ascmagic_with_encoding(struct magic_set *,
     const unsigned char *, size_t, unichar *, size_t, const char *,
@@ -410,10 +777,19 @@ protected int file_encoding(struct magic_set *, const unsigned char *, size_t,
 protected int file_is_tar(struct magic_set *, const unsigned char *, size_t);
 protected int file_softmagic(struct magic_set *, const unsigned char *, size_t,
     int);
+protected int file_softmagic_screen(struct magic_set *, const void *const *,
+    const size_t *, size_t);
+protected struct magic_memo *file_memo_new(size_t);
+protected void file_memo_free(struct magic_memo *);
+protected void file_prof_flush(struct magic_set *);
+protected int file_prof_report(struct magic_set *, size_t);
+protected uint64_t file_clock(void);
 protected struct mlist *file_apprentice(struct magic_set *, const char *, int);
+protected size_t file_magic_strength(const struct magic *, const char *);
 protected uint64_t file_signextend(struct magic_set *, struct magic *,
     uint64_t);
-protected void file_delmagic(struct magic *, int type, size_t entries);
+protected void file_delmagic(struct magic_hdr *, int type, size_t size);
+protected void file_delcompiled(struct mlist *);
 protected void file_badread(struct magic_set *);
 protected void file_badseek(struct magic_set *);
 protected void file_oomem(struct magic_set *, size_t);
@@ -423,12 +799,21 @@ protected void file_magerror(struct magic_set *, const char *, ...)
     __attribute__((__format__(__printf__, 2, 3)));
 protected void file_magwarn(struct magic_set *, const char *, ...)
     __attribute__((__format__(__printf__, 2, 3)));
-protected void file_mdump(struct magic *);
+protected void file_mdump(struct magic *, const char *);
 protected void file_showstr(FILE *, const char *, size_t);
 protected size_t file_mbswidth(const char *);
 protected const char *file_getbuffer(struct magic_set *);
 protected ssize_t sread(int, void *, size_t, int);
 protected int file_check_mem(struct magic_set *, unsigned int);
+protected void *file_arena_alloc(struct magic_set *, size_t);
+protected void file_arena_mark(struct magic_set *, struct arena_mark *);
+protected void file_arena_release(struct magic_set *,
+    const struct arena_mark *);
+protected void file_arena_free(struct magic_set *);
+protected const unsigned char *file_reader_get(struct magic_set *, uint64_t,
+    size_t, size_t *);
+protected void file_reader_free(struct magic_set *);
+protected void file_yield(void);
 protected int file_looks_utf8(const unsigned char *, size_t, unichar *,
     size_t *);
 protected size_t file_pstring_length_size(const struct magic *);
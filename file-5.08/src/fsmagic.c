@@ -353,6 +353,7 @@ file_fsmagic(struct magic_set *ms, const char *fn, struct stat *sb)
 	 * when we read the file.)
 	 */
 	if ((ms->flags & MAGIC_DEVICES) == 0 && sb->st_size == 0) {
+		file_setmime(ms, "inode/x-empty", "binary");
 		if (mime) {
 			if (handle_mime(ms, mime, "x-empty") == -1)
 				return -1;
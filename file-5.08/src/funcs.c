@@ -24,6 +24,10 @@
  * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
  * SUCH DAMAGE.
  */
+#ifdef WIN32
+#include <windows.h>
+#endif
+
 #include "file.h"
 
 #ifndef	lint
@@ -44,39 +48,114 @@ FILE_RCSID("@(#)$File: funcs.c,v 1.57 2011/05/11 01:02:41 christos Exp $")
 #if defined(HAVE_LIMITS_H)
 #include <limits.h>
 #endif
+#if defined(HAVE_UNISTD_H)
+#include <unistd.h>
+#endif
+#if defined(_POSIX_PRIORITY_SCHEDULING) && _POSIX_PRIORITY_SCHEDULING > 0
+#include <sched.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
 
 #ifndef SIZE_MAX
 #define SIZE_MAX	((size_t)~0)
 #endif
 
+#ifndef va_copy
+#ifdef __va_copy
+#define va_copy(a, b)	__va_copy(a, b)
+#else
+#define va_copy(a, b)	(void)memcpy(&(a), &(b), sizeof(va_list))
+#endif
+#endif
+
+/*
+ * Make room for len more bytes of output, plus the NUL.
+ */
+private int
+out_reserve(struct magic_set *ms, size_t len)
+{
+	size_t size;
+	char *buf;
+
+	if (ms->o.buf == NULL)
+		ms->o.blen = 0;
+	if (len < ms->o.bsize - ms->o.blen)
+		return 0;
+	if (len >= SIZE_MAX / 2 - ms->o.blen) {
+		errno = ENOMEM;
+		return -1;
+	}
+	for (size = ms->o.bsize ? ms->o.bsize : 128;
+	    size <= ms->o.blen + len; size *= 2)
+		continue;
+	if ((buf = CAST(char *, realloc(ms->o.bmem, size))) == NULL)
+		return -1;
+	ms->o.bmem = buf;
+	ms->o.bsize = size;
+	if (ms->o.buf != NULL)
+		ms->o.buf = buf;
+	return 0;
+}
+
 /*
- * Like printf, only we append to a buffer.
+ * Like printf, only we append to a buffer.  The text is formatted
+ * straight into the free space at the end, which is grown and the
+ * formatting redone if it did not fit.
  */
 protected int
 file_vprintf(struct magic_set *ms, const char *fmt, va_list ap)
 {
 	int len;
-	char *buf, *newstr;
-
-	len = vasprintf(&buf, fmt, ap);
-	if (len < 0)
-		goto out;
+	size_t avail;
+	va_list aq;
 
-	if (ms->o.buf != NULL) {
-		len = asprintf(&newstr, "%s%s", ms->o.buf, buf);
-		free(buf);
+	if (ms->o.buf == NULL)
+		ms->o.blen = 0;
+	for (;;) {
+		avail = ms->o.bsize - ms->o.blen;
+		va_copy(aq, ap);
+		len = vsnprintf(avail ? ms->o.bmem + ms->o.blen : NULL, avail,
+		    fmt, aq);
+		va_end(aq);
 		if (len < 0)
 			goto out;
-		free(ms->o.buf);
-		buf = newstr;
+		if ((size_t)len < avail)
+			break;
+		if (out_reserve(ms, (size_t)len) == -1)
+			goto out;
 	}
-	ms->o.buf = buf;
+	/* Text after a NUL in the new piece is not part of the string */
+	ms->o.buf = ms->o.bmem;
+	ms->o.blen += strlen(ms->o.buf + ms->o.blen);
 	return 0;
 out:
+	if (ms->o.buf != NULL)
+		ms->o.buf[ms->o.blen] = '\0';
 	file_error(ms, errno, "vasprintf failed");
 	return -1;
 }
 
+/*
+ * Note the MIME type and encoding of the buffer for MAGIC_MIME_FIELDS,
+ * each unless NULL or found before
+ */
+protected void
+file_setmime(struct magic_set *ms, const char *type, const char *encoding)
+{
+	if (!MIME_FIELDS(ms))
+		return;
+	if (type != NULL && ms->mime.type[0] == '\0')
+		(void)strlcpy(ms->mime.type, type, sizeof(ms->mime.type));
+	if (encoding != NULL && ms->mime.encoding == NULL)
+		ms->mime.encoding = encoding;
+}
+
 protected int
 file_printf(struct magic_set *ms, const char *fmt, ...)
 {
@@ -101,7 +180,6 @@ file_error_core(struct magic_set *ms, int error, const char *f, va_list va,
 	if (ms->event_flags & EVENT_HAD_ERR)
 		return;
 	if (lineno != 0) {
-		free(ms->o.buf);
 		ms->o.buf = NULL;
 		file_printf(ms, "line %" SIZE_T_FORMAT "u: ", lineno);
 	}
@@ -155,6 +233,107 @@ file_badread(struct magic_set *ms)
 }
 
 #ifndef COMPILE_ONLY
+/*
+ * Count a run of a stage of file_buffer() that started at t0
+ */
+private void
+stage_done(struct magic_set *ms, int stage, uint64_t t0, int decided)
+{
+	struct stage_stats *st = &ms->stats.stage[stage];
+	uint64_t t = file_clock() - t0;
+	size_t b;
+
+	for (b = 0; b < FILE_STATS_BUCKETS - 1 && (t >> (b + 1)) != 0; b++)
+		continue;
+	st->runs++;
+	if (decided)
+		st->decided++;
+	st->cycles += t;
+	st->hist[b]++;
+
+	/* The ELF stage only adds to what soft magic found */
+	if (decided && stage != MAGIC_STAGE_ELF && ms->res.stage == -1)
+		ms->res.stage = stage;
+}
+
+/*
+ * The text stages of file_buffer(): text properties and tokens, then
+ * the same for text in other encodings
+ */
+private int
+try_text(struct magic_set *ms, const unsigned char *ubuf, size_t nb,
+    int looks_text, const char **code, const char **code_mime,
+    const char **type)
+{
+	unichar *u8buf = NULL;
+	size_t ulen;
+	uint64_t t0;
+	int m;
+
+	t0 = file_clock();
+	m = file_ascmagic(ms, ubuf, nb);
+	stage_done(ms, MAGIC_STAGE_TEXT, t0, m > 0);
+	if (m != 0) {
+		if ((ms->flags & MAGIC_DEBUG) != 0)
+			(void)fprintf(stderr, "ascmagic %d\n", m);
+		return m;
+	}
+
+	/* try to discover text encoding */
+	if ((ms->flags & MAGIC_NO_CHECK_ENCODING) != 0)
+		return 0;
+	t0 = file_clock();
+	/* only now are the characters themselves needed */
+	if (looks_text == 0)
+		(void)file_encoding(ms, ubuf, nb, &u8buf, &ulen, code,
+		    code_mime, type);
+	if (u8buf != NULL)
+		m = file_ascmagic_with_encoding(ms, ubuf, nb, u8buf, ulen,
+		    *code, *type);
+	stage_done(ms, MAGIC_STAGE_TEXT_ENCODING, t0, m > 0);
+	if (m != 0 && (ms->flags & MAGIC_DEBUG) != 0)
+		(void)fprintf(stderr, "ascmagic/enc %d\n", m);
+	return m;
+}
+
+/*
+ * For MAGIC_MIME_FIELDS, once soft magic has described the buffer with
+ * an entry that gives no MIME type: MAGIC_MIME_TYPE would have gone on
+ * to the text stages, so run them for the type alone, into output of
+ * their own
+ */
+private int
+mime_text(struct magic_set *ms, const unsigned char *ubuf, size_t nb,
+    int looks_text, const char *code, const char *code_mime, const char *type)
+{
+	struct out o = ms->o;
+	int flags = ms->flags, m = 0;
+
+	ms->o = ms->mime.save;
+	ms->o.buf = NULL;
+	ms->flags = (flags & ~(MAGIC_MIME_FIELDS|MAGIC_MIME_ENCODING)) |
+	    MAGIC_MIME_TYPE;
+	if ((ms->flags & MAGIC_NO_CHECK_TEXT) == 0)
+		m = try_text(ms, ubuf, nb, looks_text, &code, &code_mime,
+		    &type);
+	if (m == 0 && file_printf(ms, "application/octet-stream") == -1)
+		m = -1;
+	ms->flags = flags;
+	ms->mime.save = ms->o;
+	ms->o = o;
+
+	if (m == -1) {
+		/* The message is in the other output */
+		ms->o.buf = NULL;
+		(void)file_printf(ms, "%s", ms->mime.save.buf ?
+		    ms->mime.save.buf : "");
+		return -1;
+	}
+	if (ms->mime.save.buf != NULL)
+		file_setmime(ms, ms->mime.save.buf, NULL);
+	return 0;
+}
+
 protected int
 file_buffer(struct magic_set *ms, int fd, const char *inname __attribute__ ((unused)),
     const void *buf, size_t nb)
@@ -162,31 +341,35 @@ file_buffer(struct magic_set *ms, int fd, const char *inname __attribute__ ((unu
 	int m = 0, rv = 0, looks_text = 0;
 	int mime = ms->flags & MAGIC_MIME;
 	const unsigned char *ubuf = CAST(const unsigned char *, buf);
-	unichar *u8buf = NULL;
-	size_t ulen;
 	const char *code = NULL;
 	const char *code_mime = "binary";
 	const char *type = NULL;
+	struct arena_mark mark;
+	uint64_t t0;
 
-
-
+	ms->stats.buffers++;
 	if (nb == 0) {
 		if ((!mime || (mime & MAGIC_MIME_TYPE)) &&
 		    file_printf(ms, mime ? "application/x-empty" :
 		    "empty") == -1)
 			return -1;
+		file_setmime(ms, "application/x-empty", code_mime);
 		return 1;
 	} else if (nb == 1) {
 		if ((!mime || (mime & MAGIC_MIME_TYPE)) &&
 		    file_printf(ms, mime ? "application/octet-stream" :
 		    "very short file (no magic)") == -1)
 			return -1;
+		file_setmime(ms, "application/octet-stream", code_mime);
 		return 1;
 	}
 
+	file_arena_mark(ms, &mark);
 	if ((ms->flags & MAGIC_NO_CHECK_ENCODING) == 0) {
-		looks_text = file_encoding(ms, ubuf, nb, &u8buf, &ulen,
+		t0 = file_clock();
+		looks_text = file_encoding(ms, ubuf, nb, NULL, NULL,
 		    &code, &code_mime, &type);
+		stage_done(ms, MAGIC_STAGE_ENCODING, t0, 0);
 	}
 
 #ifdef __EMX__
@@ -201,36 +384,56 @@ file_buffer(struct magic_set *ms, int fd, const char *inname __attribute__ ((unu
 		}
 	}
 #endif
-#if HAVE_FORK
 	/* try compression stuff */
-	if ((ms->flags & MAGIC_NO_CHECK_COMPRESS) == 0)
-		if ((m = file_zmagic(ms, fd, inname, ubuf, nb)) != 0) {
+	if ((ms->flags & MAGIC_NO_CHECK_COMPRESS) == 0) {
+		t0 = file_clock();
+		m = file_zmagic(ms, fd, inname, ubuf, nb);
+		stage_done(ms, MAGIC_STAGE_COMPRESS, t0, m > 0);
+		if (m != 0) {
 			if ((ms->flags & MAGIC_DEBUG) != 0)
 				(void)fprintf(stderr, "zmagic %d\n", m);
 			goto done;
 		}
-#endif
+	}
 	/* Check if we have a tar file */
-	if ((ms->flags & MAGIC_NO_CHECK_TAR) == 0)
-		if ((m = file_is_tar(ms, ubuf, nb)) != 0) {
+	if ((ms->flags & MAGIC_NO_CHECK_TAR) == 0) {
+		t0 = file_clock();
+		m = file_is_tar(ms, ubuf, nb);
+		stage_done(ms, MAGIC_STAGE_TAR, t0, m > 0);
+		if (m != 0) {
 			if ((ms->flags & MAGIC_DEBUG) != 0)
 				(void)fprintf(stderr, "tar %d\n", m);
 			goto done;
 		}
+	}
 
 	/* Check if we have a CDF file */
-	if ((ms->flags & MAGIC_NO_CHECK_CDF) == 0)
-		if ((m = file_trycdf(ms, fd, ubuf, nb)) != 0) {
+	if ((ms->flags & MAGIC_NO_CHECK_CDF) == 0) {
+		t0 = file_clock();
+		m = file_trycdf(ms, fd, ubuf, nb);
+		stage_done(ms, MAGIC_STAGE_CDF, t0, m > 0);
+		if (m != 0) {
 			if ((ms->flags & MAGIC_DEBUG) != 0)
 				(void)fprintf(stderr, "cdf %d\n", m);
 			goto done;
 		}
+	}
 
 	/* try soft magic tests */
-	if ((ms->flags & MAGIC_NO_CHECK_SOFT) == 0)
-		if ((m = file_softmagic(ms, ubuf, nb, BINTEST)) != 0) {
+	if ((ms->flags & MAGIC_NO_CHECK_SOFT) == 0) {
+		t0 = file_clock();
+		m = file_softmagic(ms, ubuf, nb, BINTEST);
+		stage_done(ms, MAGIC_STAGE_SOFT, t0, m > 0);
+		if (m != 0) {
 			if ((ms->flags & MAGIC_DEBUG) != 0)
 				(void)fprintf(stderr, "softmagic %d\n", m);
+			if (m > 0 && MIME_FIELDS(ms) &&
+			    ms->mime.type[0] == '\0' &&
+			    mime_text(ms, ubuf, nb, looks_text, code,
+			    code_mime, type) == -1) {
+				rv = -1;
+				goto done;
+			}
 #ifdef BUILTIN_ELF
 			if ((ms->flags & MAGIC_NO_CHECK_ELF) == 0 && m == 1 &&
 			    nb > 5 && fd != -1) {
@@ -243,7 +446,10 @@ file_buffer(struct magic_set *ms, int fd, const char *inname __attribute__ ((unu
 				 * ELF headers that cannot easily * be
 				 * extracted with rules in the magic file.
 				 */
-				if ((m = file_tryelf(ms, fd, ubuf, nb)) != 0)
+				t0 = file_clock();
+				m = file_tryelf(ms, fd, ubuf, nb);
+				stage_done(ms, MAGIC_STAGE_ELF, t0, m > 0);
+				if (m != 0)
 					if ((ms->flags & MAGIC_DEBUG) != 0)
 						(void)fprintf(stderr,
 						    "elf %d\n", m);
@@ -251,36 +457,27 @@ file_buffer(struct magic_set *ms, int fd, const char *inname __attribute__ ((unu
 #endif
 			goto done;
 		}
+	}
 
 	/* try text properties (and possibly text tokens) */
-	if ((ms->flags & MAGIC_NO_CHECK_TEXT) == 0) {
-
-		if ((m = file_ascmagic(ms, ubuf, nb)) != 0) {
-			if ((ms->flags & MAGIC_DEBUG) != 0)
-				(void)fprintf(stderr, "ascmagic %d\n", m);
+	if ((ms->flags & MAGIC_NO_CHECK_TEXT) == 0)
+		if ((m = try_text(ms, ubuf, nb, looks_text, &code, &code_mime,
+		    &type)) != 0)
 			goto done;
-		}
-
-		/* try to discover text encoding */
-		if ((ms->flags & MAGIC_NO_CHECK_ENCODING) == 0) {
-			if (looks_text == 0)
-				if ((m = file_ascmagic_with_encoding( ms, ubuf,
-				    nb, u8buf, ulen, code, type)) != 0) {
-					if ((ms->flags & MAGIC_DEBUG) != 0)
-						(void)fprintf(stderr,
-						    "ascmagic/enc %d\n", m);
-					goto done;
-				}
-		}
-	}
 
 	/* give up */
+	stage_done(ms, MAGIC_STAGE_DATA, file_clock(), 1);
 	m = 1;
 	if ((!mime || (mime & MAGIC_MIME_TYPE)) &&
 	    file_printf(ms, mime ? "application/octet-stream" : "data") == -1) {
 	    rv = -1;
 	}
  done:
+	/*
+	 * For stages that give no MIME type of their own; a compressed
+	 * file has already been given those of what it holds
+	 */
+	file_setmime(ms, "application/octet-stream", code_mime);
 	if ((ms->flags & MAGIC_MIME_ENCODING) != 0) {
 		if (ms->flags & MAGIC_MIME_TYPE)
 			if (file_printf(ms, "; charset=") == -1)
@@ -288,8 +485,7 @@ file_buffer(struct magic_set *ms, int fd, const char *inname __attribute__ ((unu
 		if (file_printf(ms, "%s", code_mime) == -1)
 			rv = -1;
 	}
-	if (u8buf)
-		free(u8buf);
+	file_arena_release(ms, &mark);
 	if (rv)
 		return rv;
 
@@ -300,18 +496,15 @@ file_buffer(struct magic_set *ms, int fd, const char *inname __attribute__ ((unu
 protected int
 file_reset(struct magic_set *ms)
 {
-	if (ms->mlist == NULL) {
+	if (ms->db == NULL) {
 		file_error(ms, 0, "no magic files loaded");
 		return -1;
 	}
-	if (ms->o.buf) {
-		free(ms->o.buf);
-		ms->o.buf = NULL;
-	}
-	if (ms->o.pbuf) {
-		free(ms->o.pbuf);
-		ms->o.pbuf = NULL;
-	}
+	ms->o.buf = NULL;
+	ms->mime.type[0] = '\0';
+	ms->mime.encoding = NULL;
+	/* Their memory and the scratch chunks are kept for the next call */
+	file_arena_release(ms, NULL);
 	ms->event_flags &= ~EVENT_HAD_ERR;
 	ms->error = -1;
 	return 0;
@@ -341,17 +534,21 @@ file_getbuffer(struct magic_set *ms)
 		return NULL;
 
 	/* * 4 is for octal representation, + 1 is for NUL */
-	len = strlen(ms->o.buf);
+	len = ms->o.blen;
 	if (len > (SIZE_MAX - 1) / 4) {
 		file_oomem(ms, len);
 		return NULL;
 	}
 	psize = len * 4 + 1;
-	if ((pbuf = CAST(char *, realloc(ms->o.pbuf, psize))) == NULL) {
-		file_oomem(ms, psize);
-		return NULL;
+	if (psize > ms->o.psize) {
+		pbuf = CAST(char *, realloc(ms->o.pbuf, psize));
+		if (pbuf == NULL) {
+			file_oomem(ms, psize);
+			return NULL;
+		}
+		ms->o.pbuf = pbuf;
+		ms->o.psize = psize;
 	}
-	ms->o.pbuf = pbuf;
 
 #if defined(HAVE_WCHAR_H) && defined(HAVE_MBRTOWC) && defined(HAVE_WCWIDTH)
 	{
@@ -426,35 +623,421 @@ file_check_mem(struct magic_set *ms, unsigned int level)
 	return 0;
 }
 
+/*
+ * Scratch memory for one magic_file() or magic_buffer() call.  Blocks
+ * are carved out of chunks that stay with the handle, so once the
+ * chunks have grown to fit the working set, classifying a file does
+ * not go to the heap.  Users take a mark first and release back to it
+ * when done, in stack order; file_reset() releases everything.
+ */
+#define ARENA_ALIGN	16
+#define ARENA_MIN	(64 * 1024)
+
+protected void *
+file_arena_alloc(struct magic_set *ms, size_t len)
+{
+	struct arena *a = &ms->scratch;
+	struct arena_chunk *c;
+	size_t next, size;
+	void *p;
+
+	if (len > SIZE_MAX - ARENA_ALIGN) {
+		file_oomem(ms, len);
+		return NULL;
+	}
+	len = (len + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+	if (a->nchunk == 0 || len > a->chunk[a->cur].size - a->used) {
+		/* Move on to the next chunk; nothing in it is live */
+		next = a->nchunk == 0 ? 0 : a->cur + 1;
+		if (next == a->nchunk) {
+			size = (a->nchunk + 1) * sizeof(*a->chunk);
+			if ((c = CAST(struct arena_chunk *,
+			    realloc(a->chunk, size))) == NULL) {
+				file_oomem(ms, size);
+				return NULL;
+			}
+			a->chunk = c;
+			a->chunk[a->nchunk].base = NULL;
+			a->chunk[a->nchunk].size = 0;
+			a->nchunk++;
+		}
+		c = &a->chunk[next];
+		if (c->size < len) {
+			size = len < ARENA_MIN ? ARENA_MIN : len;
+			free(c->base);
+			if ((c->base = CAST(char *, malloc(size))) == NULL) {
+				c->size = 0;
+				file_oomem(ms, size);
+				return NULL;
+			}
+			c->size = size;
+		}
+		a->cur = next;
+		a->used = 0;
+	}
+	p = a->chunk[a->cur].base + a->used;
+	a->used += len;
+	return p;
+}
+
+protected void
+file_arena_mark(struct magic_set *ms, struct arena_mark *m)
+{
+	m->cur = ms->scratch.cur;
+	m->used = ms->scratch.used;
+}
+
+protected void
+file_arena_release(struct magic_set *ms, const struct arena_mark *m)
+{
+	ms->scratch.cur = m ? m->cur : 0;
+	ms->scratch.used = m ? m->used : 0;
+}
+
+protected void
+file_arena_free(struct magic_set *ms)
+{
+	size_t i;
+
+	for (i = 0; i < ms->scratch.nchunk; i++)
+		free(ms->scratch.chunk[i].base);
+	free(ms->scratch.chunk);
+	ms->scratch.chunk = NULL;
+	ms->scratch.nchunk = ms->scratch.cur = ms->scratch.used = 0;
+}
+
+/*
+ * Bytes of the file beyond the buffer, for magic_reader().  Returns a
+ * pointer to the byte at file offset off and sets *avail to how many
+ * follow it: at least len, unless the file ends first or len is over
+ * READER_MAXWIN.  Reads are rounded out to READER_BLOCK and kept in a
+ * few blocks, the least recently used one being refilled next, so the
+ * pointer is only good until the next call.  Returns NULL if off is
+ * past the end of the file or cannot be read; callers then go on as
+ * if the file ended with the buffer.
+ */
+protected const unsigned char *
+file_reader_get(struct magic_set *ms, uint64_t off, size_t len, size_t *avail)
+{
+	struct reader *rd = &ms->rd;
+	struct reader_block *b, *lru;
+	unsigned char *data;
+	uint64_t start, end;
+	size_t i, got;
+	ssize_t n;
+
+	if (rd->read == NULL || off >= rd->size)
+		return NULL;
+	if (len > READER_MAXWIN)
+		len = READER_MAXWIN;
+	if (len > rd->size - off)
+		len = (size_t)(rd->size - off);
+
+	lru = &rd->blk[0];
+	for (i = 0; i < READER_NBLOCK; i++) {
+		b = &rd->blk[i];
+		if (off >= b->off && off - b->off < b->len &&
+		    len <= b->len - (size_t)(off - b->off)) {
+			b->used = ++rd->clock;
+			*avail = b->len - (size_t)(off - b->off);
+			return b->data + (size_t)(off - b->off);
+		}
+		if (b->used < lru->used)
+			lru = b;
+	}
+
+	start = off - off % READER_BLOCK;
+	end = off + len;
+	if (end % READER_BLOCK != 0)
+		end += READER_BLOCK - end % READER_BLOCK;
+	if (end > rd->size)
+		end = rd->size;
+
+	b = lru;
+	b->len = 0;
+	/* at most READER_MAXWIN plus a block on either side */
+	if (b->size < (size_t)(end - start)) {
+		if ((data = CAST(unsigned char *,
+		    realloc(b->data, (size_t)(end - start)))) == NULL)
+			return NULL;
+		b->data = data;
+		b->size = (size_t)(end - start);
+	}
+	/* a cached literal scan may have been over the old contents */
+	ms->lit.sr = NULL;
+
+	for (got = 0; got < end - start; got += (size_t)n)
+		if ((n = (*rd->read)(rd->cookie, b->data + got,
+		    (size_t)(end - start) - got, start + got)) <= 0)
+			break;
+	b->off = start;
+	b->len = got;
+	b->used = ++rd->clock;
+	if (off - start >= got)
+		return NULL;
+	*avail = got - (size_t)(off - start);
+	return b->data + (size_t)(off - start);
+}
+
+protected void
+file_reader_free(struct magic_set *ms)
+{
+	size_t i;
+
+	for (i = 0; i < READER_NBLOCK; i++)
+		free(ms->rd.blk[i].data);
+}
+
 protected size_t
 file_printedlen(const struct magic_set *ms)
 {
-	return ms->o.buf == NULL ? 0 : strlen(ms->o.buf);
+	return ms->o.buf == NULL ? 0 : ms->o.blen;
+}
+
+/*
+ * Let another thread run, for one waiting on a lock
+ */
+protected void
+file_yield(void)
+{
+#if defined(WIN32)
+	(void)SwitchToThread();
+#elif defined(_POSIX_PRIORITY_SCHEDULING) && _POSIX_PRIORITY_SCHEDULING > 0
+	(void)sched_yield();
+#endif
+}
+
+/*
+ * The compiled regex cache, hashed on pattern and flags. An entry is
+ * kept while in use and, once released, until RXCACHE_IDLE other
+ * unused ones were released after it, so that patterns used on every
+ * call are compiled once. Entries are matched outside the lock.
+ */
+#define RXCACHE_HASH	64
+#define RXCACHE_IDLE	16
+
+private struct magic_regex *rxcache[RXCACHE_HASH];
+private volatile long rxcache_lock;
+private size_t rxcache_idle;
+private struct magic_regex *rxcache_newest, *rxcache_oldest;	/* unused */
+
+private size_t
+rxcache_hash(const char *pat, int cflags)
+{
+	uint32_t h = CAST(uint32_t, cflags);
+
+	while (*pat)
+		h = h * 31 + CAST(unsigned char, *pat++);
+	return h % RXCACHE_HASH;
+}
+
+/* Take a reference to a cached entry; the caller holds the lock */
+private struct magic_regex *
+rxcache_find(size_t h, const char *pat, int cflags)
+{
+	struct magic_regex *mrx;
+
+	for (mrx = rxcache[h]; mrx != NULL; mrx = mrx->next)
+		if (mrx->cflags == cflags && strcmp(mrx->pat, pat) == 0) {
+			if (mrx->refs++ == 0) {
+				if (mrx->newer != NULL)
+					mrx->newer->older = mrx->older;
+				else
+					rxcache_newest = mrx->older;
+				if (mrx->older != NULL)
+					mrx->older->newer = mrx->newer;
+				else
+					rxcache_oldest = mrx->newer;
+				rxcache_idle--;
+			}
+			break;
+		}
+	return mrx;
+}
+
+private void
+rxcache_free(struct magic_regex *mrx)
+{
+	struct magic_regex_copy *c, *next;
+
+	for (c = mrx->spare; c != NULL; c = next) {
+		next = c->next;
+		regfree(&c->rx);
+		free(c);
+	}
+	free(mrx);
+}
+
+/*
+ * Get the compiled regex for a pattern and regcomp() flags from the
+ * cache, compiling it if it is not there; release it with
+ * file_regfree(). Returns NULL if it does not compile, with the error
+ * set on ms unless that is NULL.
+ */
+protected struct magic_regex *
+file_regcomp(struct magic_set *ms, const char *pat, int cflags)
+{
+	struct magic_regex *mrx, *cmrx;
+	struct magic_regex_copy *c;
+	size_t h = rxcache_hash(pat, cflags), len = strlen(pat);
+	int rc;
+
+	file_atomic_lock(&rxcache_lock);
+	mrx = rxcache_find(h, pat, cflags);
+	file_atomic_unlock(&rxcache_lock);
+	if (mrx != NULL)
+		return mrx;
+
+	if ((mrx = CAST(struct magic_regex *, malloc(sizeof(*mrx) + len)))
+	    == NULL || (c = CAST(struct magic_regex_copy *,
+	    malloc(sizeof(*c)))) == NULL) {
+		free(mrx);
+		if (ms != NULL)
+			file_oomem(ms, sizeof(*mrx) + len);
+		return NULL;
+	}
+	if ((rc = regcomp(&c->rx, pat, cflags)) != 0) {
+		if (ms != NULL) {
+			char errmsg[512];
+			(void)regerror(rc, &c->rx, errmsg, sizeof(errmsg));
+			file_magerror(ms, "regex error %d, (%s)", rc, errmsg);
+		}
+		free(c);
+		free(mrx);
+		return NULL;
+	}
+	c->next = NULL;
+	(void)memcpy(mrx->pat, pat, len + 1);
+	mrx->cflags = cflags;
+	mrx->spare = c;
+	mrx->lock = 0;
+	mrx->refs = 1;
+	mrx->hash = h;
+	mrx->newer = mrx->older = NULL;
+
+	/* Another thread may have compiled it meanwhile */
+	file_atomic_lock(&rxcache_lock);
+	if ((cmrx = rxcache_find(h, pat, cflags)) == NULL) {
+		mrx->next = rxcache[h];
+		rxcache[h] = mrx;
+	}
+	file_atomic_unlock(&rxcache_lock);
+	if (cmrx == NULL)
+		return mrx;
+	rxcache_free(mrx);
+	return cmrx;
 }
 
+/*
+ * Match with a copy of a cached regex that no other thread is using;
+ * returns what regexec() does.
+ */
 protected int
-file_replace(struct magic_set *ms, const char *pat, const char *rep)
+file_regexec(struct magic_regex *mrx, const char *s, size_t nmatch,
+    regmatch_t *pmatch, int eflags)
 {
-	regex_t rx;
+	struct magic_regex_copy *c;
 	int rc;
 
-	rc = regcomp(&rx, pat, REG_EXTENDED);
-	if (rc) {
-		char errmsg[512];
-		(void)regerror(rc, &rx, errmsg, sizeof(errmsg));
-		file_magerror(ms, "regex error %d, (%s)", rc, errmsg);
+	file_atomic_lock(&mrx->lock);
+	if ((c = mrx->spare) != NULL)
+		mrx->spare = c->next;
+	file_atomic_unlock(&mrx->lock);
+	if (c == NULL) {
+		if ((c = CAST(struct magic_regex_copy *, malloc(sizeof(*c))))
+		    == NULL)
+			return REG_ESPACE;
+		if ((rc = regcomp(&c->rx, mrx->pat, mrx->cflags)) != 0) {
+			free(c);
+			return rc;
+		}
+	}
+	rc = regexec(&c->rx, s, nmatch, pmatch, eflags);
+	file_atomic_lock(&mrx->lock);
+	c->next = mrx->spare;
+	mrx->spare = c;
+	file_atomic_unlock(&mrx->lock);
+	return rc;
+}
+
+protected void
+file_regfree(struct magic_regex *mrx)
+{
+	struct magic_regex **mp, *old = NULL;
+
+	file_atomic_lock(&rxcache_lock);
+	if (--mrx->refs == 0) {
+		mrx->newer = NULL;
+		mrx->older = rxcache_newest;
+		if (rxcache_newest != NULL)
+			rxcache_newest->newer = mrx;
+		else
+			rxcache_oldest = mrx;
+		rxcache_newest = mrx;
+		if (++rxcache_idle > RXCACHE_IDLE) {
+			/* Too many unused: drop the one released longest ago */
+			old = rxcache_oldest;
+			rxcache_oldest = old->newer;
+			rxcache_oldest->older = NULL;
+			for (mp = &rxcache[old->hash]; *mp != old;
+			    mp = &(*mp)->next)
+				continue;
+			*mp = old->next;
+			rxcache_idle--;
+		}
+	}
+	file_atomic_unlock(&rxcache_lock);
+	if (old != NULL)
+		rxcache_free(old);
+}
+
+protected int
+file_replace(struct magic_set *ms, const char *pat, const char *rep)
+{
+	struct magic_regex *mrx;
+	regmatch_t rm;
+	int nm = 0;
+	size_t so, eo, rlen = strlen(rep);
+
+	if ((mrx = file_regcomp(ms, pat, REG_EXTENDED)) == NULL)
 		return -1;
-	} else {
-		regmatch_t rm;
-		int nm = 0;
-		while (regexec(&rx, ms->o.buf, 1, &rm, 0) == 0) {
-			ms->o.buf[rm.rm_so] = '\0';
-			if (file_printf(ms, "%s%s", rep,
-			    rm.rm_eo != 0 ? ms->o.buf + rm.rm_eo : "") == -1)
-				return -1;
-			nm++;
+	while (file_regexec(mrx, ms->o.buf, 1, &rm, 0) == 0) {
+		/* Splice rep over the match, in place */
+		so = (size_t)rm.rm_so;
+		eo = (size_t)rm.rm_eo;
+		if (rlen > eo - so &&
+		    out_reserve(ms, rlen - (eo - so)) == -1) {
+			file_regfree(mrx);
+			file_oomem(ms, ms->o.blen + rlen);
+			return -1;
 		}
-		regfree(&rx);
-		return nm;
+		(void)memmove(ms->o.buf + so + rlen, ms->o.buf + eo,
+		    ms->o.blen - eo + 1);
+		(void)memcpy(ms->o.buf + so, rep, rlen);
+		ms->o.blen += rlen - (eo - so);
+		nm++;
 	}
+	file_regfree(mrx);
+	return nm;
+}
+
+/*
+ * A clock for the profiling counters that is cheap to read: processor
+ * cycles where there is a counter for them, otherwise nanoseconds
+ */
+protected uint64_t
+file_clock(void)
+{
+#if defined(_MSC_VER) || \
+    (defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__)))
+	return __rdtsc();
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#else
+	return 0;
+#endif
 }
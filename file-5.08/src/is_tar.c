@@ -79,6 +79,7 @@ file_is_tar(struct magic_set *ms, const unsigned char *buf, size_t nbytes)
 	if (file_printf(ms, "%s", mime ? "application/x-tar" :
 	    tartype[tar - 1]) == -1)
 		return -1;
+	file_setmime(ms, "application/x-tar", NULL);
 	return 1;
 }
 
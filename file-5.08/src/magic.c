@@ -72,6 +72,7 @@ FILE_RCSID("@(#)$File: magic.c,v 1.74 2011/05/26 01:27:59 christos Exp $")
 #endif
 
 private void free_mlist(struct mlist *);
+private struct magic_db *new_db(struct magic_set *, struct mlist *);
 private void close_and_restore(const struct magic_set *, const char *, int,
     const struct stat *);
 private int unreadable_info(struct magic_set *, mode_t, const char *);
@@ -230,7 +231,8 @@ magic_open(int flags)
 
 	ms->event_flags = 0;
 	ms->error = -1;
-	ms->mlist = NULL;
+	ms->res.ind = SIZE_MAX;
+	ms->db = NULL;
 	ms->file = "unknown";
 	ms->line = 0;
 	return ms;
@@ -249,14 +251,146 @@ free_mlist(struct mlist *mlist)
 
 	for (ml = mlist->next; ml != mlist;) {
 		struct mlist *next = ml->next;
-		struct magic *mg = ml->magic;
-		file_delmagic(mg, ml->mapped, ml->nmagic);
+		file_delcompiled(ml);
+		file_delmagic(ml->image, ml->mapped, ml->isize);
+		free(ml->name);
 		free(ml);
 		ml = next;
 	}
 	free(ml);
 }
 
+private struct magic_db *
+new_db(struct magic_set *ms, struct mlist *mlist)
+{
+	struct magic_db *db;
+
+	if ((db = CAST(struct magic_db *, malloc(sizeof(*db)))) == NULL) {
+		file_oomem(ms, sizeof(*db));
+		free_mlist(mlist);
+		return NULL;
+	}
+	db->mlist = mlist;
+	db->refs = 1;
+	db->memo = NULL;
+	db->prof = NULL;
+	db->nprof = 0;
+	db->profbusy = 0;
+	return db;
+}
+
+/*
+ * Drop a reference to a database; the last one frees it
+ */
+public void
+magic_db_close(struct magic_db *db)
+{
+	if (db == NULL)
+		return;
+	if (file_atomic_dec(&db->refs) == 0) {
+		free_mlist(db->mlist);
+		file_memo_free(db->memo);
+		free(db->prof);
+		free(db);
+	}
+}
+
+/*
+ * Load a database that is not tied to any handle
+ */
+public struct magic_db *
+magic_db_load(const char *magicfile, int flags)
+{
+	struct magic_set *ms;
+	struct magic_db *db;
+
+	if ((ms = magic_open(flags)) == NULL)
+		return NULL;
+	if (magic_load(ms, magicfile) == -1) {
+		errno = ms->error > 0 ? ms->error : EINVAL;
+		magic_close(ms);
+		return NULL;
+	}
+	db = magic_getdb(ms);
+	magic_close(ms);
+	return db;
+}
+
+/*
+ * Return a new reference to the database loaded in a handle
+ */
+public struct magic_db *
+magic_getdb(struct magic_set *ms)
+{
+	if (ms->db == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+	(void)file_atomic_inc(&ms->db->refs);
+	return ms->db;
+}
+
+/*
+ * Return how many bytes from the start of a file the tests of a
+ * database can look at, leaving out the ones whose offsets come from
+ * the file itself
+ */
+public size_t
+magic_db_reach(struct magic_db *db)
+{
+	struct mlist *ml;
+	size_t reach = 0;
+
+	if (db == NULL)
+		return 0;
+	for (ml = db->mlist->next; ml != db->mlist; ml = ml->next)
+		reach = MAX(reach, ml->reach);
+	return reach;
+}
+
+/*
+ * Keep the soft magic results of up to entries buffers for the handles
+ * on a database, or stop with 0. Not to be called while they are in use.
+ */
+public int
+magic_db_memo(struct magic_db *db, size_t entries)
+{
+	struct magic_memo *mm = NULL;
+
+	if (db == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (entries != 0 && (mm = file_memo_new(entries)) == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	file_memo_free(db->memo);
+	db->memo = mm;
+	return 0;
+}
+
+/*
+ * Create a handle for a shared database. The handle holds only the
+ * per-call state, so it is cheap to create and handles on the same
+ * database can be used concurrently from different threads.
+ */
+public struct magic_set *
+magic_ctx_open(struct magic_db *db, int flags)
+{
+	struct magic_set *ms;
+
+	if (db == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if ((ms = magic_open(flags)) == NULL)
+		return NULL;
+	(void)file_atomic_inc(&db->refs);
+	ms->db = db;
+	return ms;
+}
+
 private int
 unreadable_info(struct magic_set *ms, mode_t md, const char *file)
 {
@@ -278,10 +412,25 @@ unreadable_info(struct magic_set *ms, mode_t md, const char *file)
 public void
 magic_close(struct magic_set *ms)
 {
-	free_mlist(ms->mlist);
+	file_prof_flush(ms);
+	free(ms->prof.cnt);
+	magic_db_close(ms->db);
 	free(ms->o.pbuf);
-	free(ms->o.buf);
+	free(ms->o.bmem);
+	free(ms->mime.save.pbuf);
+	free(ms->mime.save.bmem);
 	free(ms->c.li);
+	free(ms->cand.bits);
+	free(ms->lit.first);
+	file_arena_free(ms);
+	file_reader_free(ms);
+	free(ms->batch.bits);
+	free(ms->batch.res);
+	free(ms->batch.roff);
+	free(ms->memo.read);
+	free(ms->memo.data);
+	free(ms->memo.shapes);
+	free(ms->res.match);
 	free(ms);
 }
 
@@ -291,13 +440,29 @@ magic_close(struct magic_set *ms)
 public int
 magic_load(struct magic_set *ms, const char *magicfile)
 {
+	struct magic_db *db;
 	struct mlist *ml = file_apprentice(ms, magicfile, FILE_LOAD);
-	if (ml) {
-		free_mlist(ms->mlist);
-		ms->mlist = ml;
-		return 0;
+	if (ml == NULL || (db = new_db(ms, ml)) == NULL)
+		return -1;
+	file_prof_flush(ms);
+	free(ms->prof.cnt);
+	ms->prof.cnt = NULL;
+	magic_db_close(ms->db);
+	ms->db = db;
+	return 0;
+}
+
+/*
+ * Create a new handle that shares the loaded magic of an existing one
+ */
+public struct magic_set *
+magic_clone(struct magic_set *ms)
+{
+	if (ms->db == NULL) {
+		errno = EINVAL;
+		return NULL;
 	}
-	return -1;
+	return magic_ctx_open(ms->db, ms->flags);
 }
 
 public int
@@ -391,11 +556,11 @@ file_or_fd(struct magic_set *ms, const char *inname, int fd)
 	 * some overlapping space for matches near EOF
 	 */
 #define SLOP (1 + sizeof(union VALUETYPE))
-	if ((buf = CAST(unsigned char *, malloc(HOWMANY + SLOP))) == NULL)
-		return NULL;
-
 	if (file_reset(ms) == -1)
-		goto done;
+		return NULL;
+	if ((buf = CAST(unsigned char *,
+	    file_arena_alloc(ms, HOWMANY + SLOP))) == NULL)
+		return NULL;
 
 	switch (file_fsmagic(ms, inname, &sb)) {
 	case -1:		/* error */
@@ -467,7 +632,6 @@ file_or_fd(struct magic_set *ms, const char *inname, int fd)
 		goto done;
 	rv = 0;
 done:
-	free(buf);
 	close_and_restore(ms, inname, fd, &sb);
 	return rv == 0 ? file_getbuffer(ms) : NULL;
 }
@@ -487,6 +651,196 @@ magic_buffer(struct magic_set *ms, const void *buf, size_t nb)
 	}
 	return file_getbuffer(ms);
 }
+
+/*
+ * Classify a buffer as magic_buffer() does, but instead of describing
+ * it note the entries that matched, in res; they are good until the
+ * next call with ms
+ */
+public int
+magic_buffer_matches(struct magic_set *ms, const void *buf, size_t nb,
+    struct magic_result *res)
+{
+	int rv;
+
+	if (res == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (file_reset(ms) == -1)
+		return -1;
+	ms->res.on = 1;
+	ms->res.stage = -1;
+	ms->res.base = 0;
+	ms->res.off = 0;
+	ms->res.n = 0;
+	rv = file_buffer(ms, -1, NULL, buf, nb);
+	ms->res.on = 0;
+	ms->res.ind = SIZE_MAX;
+	if (rv == -1)
+		return -1;
+	res->stage = ms->res.stage;
+	res->nmatch = ms->res.n;
+	res->match = ms->res.match;
+	return 0;
+}
+
+/*
+ * Look up an entry of the database by the number magic_buffer_matches()
+ * gives it
+ */
+public int
+magic_getentry(struct magic_set *ms, unsigned int entry,
+    struct magic_entry_info *info)
+{
+	struct mlist *ml;
+	uint32_t magindex, top;
+
+	if (ms->db == NULL || info == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (ml = ms->db->mlist->next; ml != ms->db->mlist; ml = ml->next)
+		if (entry - ml->first < ml->nmagic)
+			break;
+	if (ml == ms->db->mlist) {
+		errno = EINVAL;
+		return -1;
+	}
+	magindex = entry - ml->first;
+	for (top = magindex; top > 0 && ml->magic[top].cont_level != 0; top--)
+		continue;
+	info->desc = DESC_STR(&ml->desc[magindex], desc);
+	info->mime = DESC_STR(&ml->desc[magindex], mimetype);
+	info->file = DESC_STR(&ml->desc[magindex], file);
+	if (*info->file == '\0' && ml->name != NULL)
+		info->file = ml->name;
+	info->line = ml->magic[magindex].lineno;
+	info->level = ml->magic[magindex].cont_level;
+	info->top = ml->first + top;
+	return 0;
+}
+
+/*
+ * Classify n buffers in one call.  The top-level tests are screened on
+ * all the buffers first, see file_softmagic_screen(); each buffer then
+ * goes through the usual checks, trying only the entries that passed.
+ * results[i] is the description of bufs[i], or NULL if that failed;
+ * they are good until the next call with ms.  Returns the number of
+ * NULL results.
+ */
+public int
+magic_buffer_batch(struct magic_set *ms, const void *const *bufs,
+    const size_t *lens, size_t n, const char **results)
+{
+	const char *r, *type = "", *encoding = "";
+	size_t i, len, tlen = 0, elen = 0, *roff;
+	char *res;
+	int failed = 0;
+
+	for (i = 0; i < n; i++)
+		results[i] = NULL;
+	ms->batch.nmime = 0;
+	if (file_reset(ms) == -1)
+		return CAST(int, n);
+	if (ms->batch.nroff < n) {
+		if ((roff = CAST(size_t *, realloc(ms->batch.roff,
+		    n * sizeof(*roff)))) == NULL) {
+			file_oomem(ms, n * sizeof(*roff));
+			return CAST(int, n);
+		}
+		ms->batch.roff = roff;
+		ms->batch.nroff = n;
+	}
+	if (file_softmagic_screen(ms, bufs, lens, n) == -1)
+		ms->batch.words = 0;
+
+	ms->batch.rlen = 0;
+	for (i = 0; i < n; i++) {
+		ms->batch.roff[i] = SIZE_MAX;
+		if (ms->batch.words != 0) {
+			ms->batch.buf = bufs[i];
+			ms->batch.len = lens[i];
+			ms->batch.cur = ms->batch.bits + i * ms->batch.words;
+		}
+		if (file_reset(ms) == -1 ||
+		    file_buffer(ms, -1, NULL, bufs[i], lens[i]) == -1 ||
+		    (r = file_getbuffer(ms)) == NULL) {
+			failed++;
+			continue;
+		}
+		len = strlen(r) + 1;
+		if (MIME_FIELDS(ms)) {
+			(void)magic_getmime(ms, &type, &encoding);
+			tlen = strlen(type) + 1;
+			elen = strlen(encoding) + 1;
+			len += tlen + elen;
+		}
+		if (ms->batch.rsize - ms->batch.rlen < len) {
+			size_t size = MAX(2 * ms->batch.rsize,
+			    ms->batch.rlen + len);
+			if ((res = CAST(char *, realloc(ms->batch.res,
+			    size))) == NULL) {
+				file_oomem(ms, size);
+				failed++;
+				continue;
+			}
+			ms->batch.res = res;
+			ms->batch.rsize = size;
+		}
+		res = ms->batch.res + ms->batch.rlen;
+		(void)memcpy(res, r, len - tlen - elen);
+		if (MIME_FIELDS(ms)) {
+			res += len - tlen - elen;
+			(void)memcpy(res, type, tlen);
+			(void)memcpy(res + tlen, encoding, elen);
+		}
+		ms->batch.roff[i] = ms->batch.rlen;
+		ms->batch.rlen += len;
+	}
+	ms->batch.buf = NULL;
+	if (MIME_FIELDS(ms))
+		ms->batch.nmime = n;
+
+	for (i = 0; i < n; i++)
+		if (ms->batch.roff[i] != SIZE_MAX)
+			results[i] = ms->batch.res + ms->batch.roff[i];
+	return failed;
+}
+
+/*
+ * Like magic_buffer(), for the first nb bytes of a file of size bytes.
+ * Tests that look further into the file get the bytes they need from
+ * rd(cookie, buf, len, offset), which returns how many it read into
+ * buf, or 0 or -1 at the end of the file or on error.
+ */
+public const char *
+magic_reader(struct magic_set *ms, const void *buf, size_t nb,
+    unsigned long long size, magic_read_t rd, void *cookie)
+{
+	const char *rv;
+	size_t i;
+
+	if (rd == NULL || size < nb)
+		return magic_buffer(ms, buf, nb);
+	if (file_reset(ms) == -1)
+		return NULL;
+
+	ms->rd.read = rd;
+	ms->rd.cookie = cookie;
+	ms->rd.size = size;
+	ms->rd.buf = CAST(const unsigned char *, buf);
+	ms->rd.base = 0;
+	for (i = 0; i < READER_NBLOCK; i++)
+		ms->rd.blk[i].len = ms->rd.blk[i].used = 0;
+	ms->rd.clock = 0;
+
+	rv = file_buffer(ms, -1, NULL, buf, nb) == -1 ? NULL :
+	    file_getbuffer(ms);
+	ms->rd.read = NULL;
+	ms->rd.buf = NULL;
+	return rv;
+}
 #endif
 
 public const char *
@@ -495,6 +849,93 @@ magic_error(struct magic_set *ms)
 	return (ms->event_flags & EVENT_HAD_ERR) ? ms->o.buf : NULL;
 }
 
+/*
+ * Report what the entries of the database cost the handles on it that
+ * had MAGIC_PROFILE set, the most expensive first, in at most max lines
+ * (all with 0). Counts of other handles are only in once they are closed.
+ */
+public const char *
+magic_profile(struct magic_set *ms, size_t max)
+{
+	if (ms->db == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (file_prof_report(ms, max) == -1)
+		return NULL;
+	return ms->o.buf != NULL ? ms->o.buf : "";
+}
+
+#if MAGIC_NSTAGES != FILE_NSTAGES || MAGIC_STATS_BUCKETS != FILE_STATS_BUCKETS
+#error "struct magic_stats does not match the counters of the handle"
+#endif
+
+/*
+ * Copy out what the stages of the classification of buffers have cost
+ * the handle so far
+ */
+public int
+magic_getstats(struct magic_set *ms, struct magic_stats *st)
+{
+	size_t i, j;
+
+	if (st == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	st->buffers = ms->stats.buffers;
+	for (i = 0; i < MAGIC_NSTAGES; i++) {
+		st->stage[i].runs = ms->stats.stage[i].runs;
+		st->stage[i].decided = ms->stats.stage[i].decided;
+		st->stage[i].cycles = ms->stats.stage[i].cycles;
+		for (j = 0; j < MAGIC_STATS_BUCKETS; j++)
+			st->stage[i].hist[j] = ms->stats.stage[i].hist[j];
+	}
+	return 0;
+}
+
+/*
+ * With MAGIC_MIME_FIELDS, hand back the MIME type and encoding found
+ * for the last buffer along with its description
+ */
+public int
+magic_getmime(struct magic_set *ms, const char **type, const char **encoding)
+{
+	if ((ms->flags & MAGIC_MIME_FIELDS) == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (type != NULL)
+		*type = ms->mime.type;
+	if (encoding != NULL)
+		*encoding = ms->mime.encoding != NULL ? ms->mime.encoding : "";
+	return 0;
+}
+
+/*
+ * The same for buffer i of the last magic_buffer_batch() call
+ */
+public int
+magic_getmime_batch(struct magic_set *ms, size_t i, const char **type,
+    const char **encoding)
+{
+	const char *r;
+
+	if (i >= ms->batch.nmime ||
+	    ms->batch.roff[i] == SIZE_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	r = ms->batch.res + ms->batch.roff[i];
+	r += strlen(r) + 1;
+	if (type != NULL)
+		*type = r;
+	r += strlen(r) + 1;
+	if (encoding != NULL)
+		*encoding = r;
+	return 0;
+}
+
 public int
 magic_errno(struct magic_set *ms)
 {
@@ -43,6 +43,9 @@
 #define	MAGIC_MIME_ENCODING	0x000400 /* Return the MIME encoding */
 #define MAGIC_MIME		(MAGIC_MIME_TYPE|MAGIC_MIME_ENCODING)
 #define	MAGIC_APPLE		0x000800 /* Return the Apple creator and type */
+#define	MAGIC_PROFILE		0x400000 /* Count the cost of each entry */
+#define	MAGIC_MIME_FIELDS	0x800000 /* Also find the MIME type and
+					    encoding, see magic_getmime() */
 
 #define	MAGIC_NO_CHECK_COMPRESS	0x001000 /* Don't check for compressed files */
 #define	MAGIC_NO_CHECK_TAR	0x002000 /* Don't check for tar files */
@@ -64,6 +67,60 @@
 #define	MAGIC_NO_CHECK_FORTRAN	0x000000 /* Don't check ascii/fortran */
 #define	MAGIC_NO_CHECK_TROFF	0x000000 /* Don't check ascii/troff */
 
+/* Stages a buffer goes through, in order, for magic_getstats() */
+#define	MAGIC_STAGE_ENCODING	0 /* Guess the text encoding */
+#define	MAGIC_STAGE_COMPRESS	1 /* Compressed files */
+#define	MAGIC_STAGE_TAR		2 /* Tar files */
+#define	MAGIC_STAGE_CDF		3 /* Composite document files */
+#define	MAGIC_STAGE_SOFT	4 /* Magic entries */
+#define	MAGIC_STAGE_ELF		5 /* ELF details */
+#define	MAGIC_STAGE_TEXT	6 /* Text files */
+#define	MAGIC_STAGE_TEXT_ENCODING 7 /* Text in a non-ASCII encoding */
+#define	MAGIC_STAGE_DATA	8 /* None of the above matched */
+#define	MAGIC_NSTAGES		9
+
+#define	MAGIC_STATS_BUCKETS	32
+
+struct magic_stats {
+	unsigned long long buffers;	/* buffers looked at */
+	struct magic_stage_stats {
+		unsigned long long runs;	/* buffers it looked at */
+		unsigned long long decided;	/* of them, ones it named */
+		unsigned long long cycles;	/* time spent in it */
+		/* runs that took 2^i to 2^(i+1) - 1 cycles, the last
+		   bucket also those that took longer */
+		unsigned long long hist[MAGIC_STATS_BUCKETS];
+	} stage[MAGIC_NSTAGES];
+};
+
+/* An entry that matched, for magic_buffer_matches() */
+struct magic_match {
+	unsigned int entry;		/* number in the database */
+	unsigned int level;		/* 0 for a top-level entry, else
+					   that of its continuation */
+	unsigned int strength;		/* that orders top-level entries,
+					   0 for continuations */
+	unsigned long long offset;	/* where it looked or, for search
+					   and regex, what it found */
+};
+
+struct magic_result {
+	int stage;			/* MAGIC_STAGE_* that named the
+					   buffer, -1 if it was too short */
+	size_t nmatch;
+	const struct magic_match *match;	/* in the order they matched */
+};
+
+/* An entry of the database, for magic_getentry() */
+struct magic_entry_info {
+	const char *desc;		/* description, unformatted */
+	const char *mime;		/* MIME type, "" if none */
+	const char *file;		/* magic file the entry is in */
+	unsigned int line;		/* its line there */
+	unsigned int level;		/* continuation level */
+	unsigned int top;		/* its top-level entry */
+};
+
 
 #ifdef __cplusplus
 extern "C" {
@@ -71,14 +128,35 @@ extern "C" {
 
 typedef struct magic_set *magic_t;
 magic_t magic_open(int);
+magic_t magic_clone(magic_t);
 void magic_close(magic_t);
 
+typedef struct magic_db *magic_db_t;
+typedef struct magic_set *magic_ctx_t;
+magic_db_t magic_db_load(const char *, int);
+magic_db_t magic_getdb(magic_t);
+void magic_db_close(magic_db_t);
+size_t magic_db_reach(magic_db_t);
+int magic_db_memo(magic_db_t, size_t);
+magic_ctx_t magic_ctx_open(magic_db_t, int);
+
 const char *magic_getpath(const char *, int);
 const char *magic_file(magic_t, const char *);
 const char *magic_descriptor(magic_t, int);
 const char *magic_buffer(magic_t, const void *, size_t);
+int magic_buffer_batch(magic_t, const void *const *, const size_t *, size_t,
+    const char **);
+int magic_buffer_matches(magic_t, const void *, size_t, struct magic_result *);
+int magic_getentry(magic_t, unsigned int, struct magic_entry_info *);
+typedef ssize_t (*magic_read_t)(void *, void *, size_t, unsigned long long);
+const char *magic_reader(magic_t, const void *, size_t, unsigned long long,
+    magic_read_t, void *);
 
 const char *magic_error(magic_t);
+const char *magic_profile(magic_t, size_t);
+int magic_getstats(magic_t, struct magic_stats *);
+int magic_getmime(magic_t, const char **, const char **);
+int magic_getmime_batch(magic_t, size_t, const char **, const char **);
 int magic_setflags(magic_t, int);
 
 int magic_load(magic_t, const char *);
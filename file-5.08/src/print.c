@@ -47,9 +47,10 @@ FILE_RCSID("@(#)$File: print.c,v 1.69 2010/07/21 16:47:18 christos Exp $")
 
 #ifndef COMPILE_ONLY
 protected void
-file_mdump(struct magic *m)
+file_mdump(struct magic *m, const char *desc)
 {
 	private const char optyp[] = { FILE_OPS };
+	char tbuf[26];
 
 	(void) fprintf(stderr, "[%u", m->lineno);
 	(void) fprintf(stderr, ">>>>>>>> %u" + 8 - (m->cont_level & 7),
@@ -136,26 +137,30 @@ file_mdump(struct magic *m)
 		case FILE_BEDATE:
 		case FILE_MEDATE:
 			(void)fprintf(stderr, "%s,",
-			    file_fmttime(m->value.l, 1));
+			    file_fmttime(tbuf, sizeof(tbuf),
+			    m->value.l, 1));
 			break;
 		case FILE_LDATE:
 		case FILE_LELDATE:
 		case FILE_BELDATE:
 		case FILE_MELDATE:
 			(void)fprintf(stderr, "%s,",
-			    file_fmttime(m->value.l, 0));
+			    file_fmttime(tbuf, sizeof(tbuf),
+			    m->value.l, 0));
 			break;
 		case FILE_QDATE:
 		case FILE_LEQDATE:
 		case FILE_BEQDATE:
 			(void)fprintf(stderr, "%s,",
-			    file_fmttime((uint32_t)m->value.q, 1));
+			    file_fmttime(tbuf, sizeof(tbuf),
+			    (uint32_t)m->value.q, 1));
 			break;
 		case FILE_QLDATE:
 		case FILE_LEQLDATE:
 		case FILE_BEQLDATE:
 			(void)fprintf(stderr, "%s,",
-			    file_fmttime((uint32_t)m->value.q, 0));
+			    file_fmttime(tbuf, sizeof(tbuf),
+			    (uint32_t)m->value.q, 0));
 			break;
 		case FILE_FLOAT:
 		case FILE_BEFLOAT:
@@ -175,7 +180,7 @@ file_mdump(struct magic *m)
 			break;
 		}
 	}
-	(void) fprintf(stderr, ",\"%s\"]\n", m->desc);
+	(void) fprintf(stderr, ",\"%s\"]\n", desc);
 }
 #endif
 
@@ -199,14 +204,27 @@ file_magwarn(struct magic_set *ms, const char *f, ...)
 }
 
 protected const char *
-file_fmttime(uint32_t v, int local)
+file_fmttime(char *buf, size_t bsize, uint32_t v, int local)
 {
 	char *pp;
 	time_t t = (time_t)v;
 	struct tm *tm;
+#ifndef WIN32
+	struct tm tmb;
+#endif
+
+	if (bsize < 26)
+		goto out;
 
 	if (local) {
+#ifdef WIN32
+		/* The MS C runtime keeps the ctime() buffer per thread */
 		pp = ctime(&t);
+		if (pp != NULL)
+			pp = strcpy(buf, pp);
+#else
+		pp = ctime_r(&t, buf);
+#endif
 	} else {
 #ifndef HAVE_DAYLIGHT
 		private int daylight = 0;
@@ -216,7 +234,11 @@ file_fmttime(uint32_t v, int local)
 		if (now == (time_t)0) {
 			struct tm *tm1;
 			(void)time(&now);
+#ifdef WIN32
 			tm1 = localtime(&now);
+#else
+			tm1 = localtime_r(&now, &tmb);
+#endif
 			if (tm1 == NULL)
 				goto out;
 			daylight = tm1->tm_isdst;
@@ -225,10 +247,19 @@ file_fmttime(uint32_t v, int local)
 #endif /* HAVE_DAYLIGHT */
 		if (daylight)
 			t += 3600;
+#ifdef WIN32
 		tm = gmtime(&t);
 		if (tm == NULL)
 			goto out;
 		pp = asctime(tm);
+		if (pp != NULL)
+			pp = strcpy(buf, pp);
+#else
+		tm = gmtime_r(&t, &tmb);
+		if (tm == NULL)
+			goto out;
+		pp = asctime_r(tm, buf);
+#endif
 	}
 
 	if (pp == NULL)
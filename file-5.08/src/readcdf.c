@@ -92,14 +92,14 @@ cdf_file_property_info(struct magic_set *ms, const cdf_property_info_t *info,
                                 if (j == sizeof(vbuf))
                                         --j;
                                 vbuf[j] = '\0';
-                                if (NOTMIME(ms)) {
-                                        if (vbuf[0]) {
-                                                if (file_printf(ms, ", %s: %s",
-                                                    buf, vbuf) == -1)
-                                                        return -1;
-                                        }
-                                } else if (info[i].pi_id ==
-                                        CDF_PROPERTY_NAME_OF_APPLICATION) {
+                                if (NOTMIME(ms) && vbuf[0]) {
+                                        if (file_printf(ms, ", %s: %s",
+                                            buf, vbuf) == -1)
+                                                return -1;
+                                }
+                                if ((!NOTMIME(ms) || MIME_FIELDS(ms)) &&
+                                    info[i].pi_id ==
+                                    CDF_PROPERTY_NAME_OF_APPLICATION) {
                                         if (strstr(vbuf, "Word"))
                                                 str = "msword";
                                         else if (strstr(vbuf, "Excel"))
@@ -123,9 +123,9 @@ cdf_file_property_info(struct magic_set *ms, const cdf_property_info_t *info,
                                             ", %s: %s", buf, tbuf) == -1)
                                                 return -1;
                                 } else {
-                                        char *c, *ec;
+                                        char *c, *ec, tbuf[26];
                                         cdf_timestamp_to_timespec(&ts, tp);
-                                        c = cdf_ctime(&ts.tv_sec);
+                                        c = cdf_ctime(&ts.tv_sec, tbuf);
                                         if ((ec = strchr(c, '\n')) != NULL)
                                                 *ec = '\0';
 
@@ -144,6 +144,9 @@ cdf_file_property_info(struct magic_set *ms, const cdf_property_info_t *info,
         if (!NOTMIME(ms)) {
                 if (file_printf(ms, "application/%s", str) == -1)
                         return -1;
+        } else if (MIME_FIELDS(ms)) {
+                (void)snprintf(buf, sizeof(buf), "application/%s", str);
+                file_setmime(ms, buf, NULL);
         }
         return 1;
 }
@@ -41,20 +41,124 @@ FILE_RCSID("@(#)$File: softmagic.c,v 1.145 2011/05/13 22:15:40 christos Exp $")
 #include <stdlib.h>
 #include <time.h>
 
+#ifndef SIZE_MAX
+#define SIZE_MAX	((size_t)~0)
+#endif
 
-private int match(struct magic_set *, struct magic *, uint32_t,
+/*
+ * Memo of soft magic results. What matching a buffer read is kept as a
+ * shape, the byte ranges in order, and an entry for the shape with the
+ * contents of the ranges and what was printed; another buffer that has
+ * the same bytes in those ranges gets the same result. Offsets that
+ * were past the end constrain the size instead: a buffer must end
+ * before them too, or, when a test went up to the end, end at the same
+ * place. The shapes are found by a hash of the leading bytes, and the
+ * entries of a shape by a hash of the buffer's bytes in its ranges.
+ * The least recently used entry makes way for a new one, and a thread
+ * that finds the memo busy matches without it.  Lookups copy the shapes
+ * out and collect the buffer's bytes with the memo free, since that may
+ * read the file.
+ */
+struct memo_range {
+	size_t off, len;
+};
+
+struct memo_shape {
+	struct memo_shape *next;	/* with the same leading bytes */
+	uint32_t lead;			/* hash of mode and leading bytes */
+	int flags, mode;
+	size_t refs;			/* entries of this shape */
+	size_t len;			/* bytes in the ranges */
+	size_t nrange;
+	struct memo_range range[1];	/* more allocated */
+};
+
+/* Bytes a shape of n ranges takes */
+#define MEMO_SHAPESIZE(n) \
+    (sizeof(struct memo_shape) + (n) * sizeof(struct memo_range))
+
+/* Whether shapes a and b have the same ranges for the same buffers */
+#define MEMO_SAMESHAPE(a, b) ((a)->lead == (b)->lead && \
+    (a)->flags == (b)->flags && (a)->mode == (b)->mode && \
+    (a)->nrange == (b)->nrange && memcmp((a)->range, (b)->range, \
+    (a)->nrange * sizeof((a)->range[0])) == 0)
+
+/* A shape tried for a buffer, as copied out of the memo */
+struct memo_cand {
+	size_t sh;			/* where it is in ms->memo.shapes */
+	size_t at;			/* where the buffer's bytes in its
+					   ranges are in ms->memo.data */
+	uint32_t hash;			/* of those bytes */
+	int ok;				/* whether they were all there */
+};
+
+struct memo_entry {
+	struct memo_entry *next;		/* in its bucket */
+	struct memo_entry *newer, *older;	/* in order of use */
+	struct memo_shape *shape;
+	uint32_t hash;			/* of the bytes in the ranges */
+	int exact;
+	size_t nbytes, size;
+	size_t ceiling, end;		/* limits on size */
+	unsigned char *data;		/* contents of the ranges */
+	char *out;			/* what the match printed */
+	size_t outlen;
+	char *mime;			/* MIME type it recorded */
+	int printed;
+	int rv;
+};
+
+struct magic_memo {
+	volatile long busy;
+	struct memo_shape **lead;	/* shapes by leading bytes */
+	struct memo_entry **bucket;	/* entries by contents */
+	size_t mask;			/* buckets - 1 */
+	size_t count, max;
+	struct memo_entry *newest, *oldest;
+};
+
+private int softmagic(struct magic_set *, const unsigned char *, size_t, int);
+private int memo_softmagic(struct magic_set *, const unsigned char *, size_t,
+    int);
+private struct magic_prof *prof_counts(struct magic_set *);
+private void prof_count(struct magic_prof *, uint32_t, uint64_t, int);
+private void mtrack(struct magic_set *, const unsigned char *, size_t,
     const unsigned char *, size_t, int);
+private void mtrackget(struct magic_set *, const struct magic *, int,
+    const unsigned char *, const unsigned char *, size_t, uint32_t,
+    uint32_t);
+private int match(struct magic_set *, struct mlist *, const uint32_t *,
+    const unsigned char *, size_t, int);
+private void index_bits(struct magic_set *, const struct magic_index *,
+    const unsigned char *, size_t, uint32_t *);
+private const uint32_t *candidates(struct magic_set *, struct mlist *,
+    const unsigned char *, size_t);
+private uint32_t next_entry(const uint32_t *, uint32_t, uint32_t);
 private int mget(struct magic_set *, const unsigned char *,
-    struct magic *, size_t, unsigned int);
-private int magiccheck(struct magic_set *, struct magic *);
-private int32_t mprint(struct magic_set *, struct magic *);
+    struct magic *, const struct magic_desc *, size_t, unsigned int);
+private int magiccheck(struct magic_set *, struct mlist *, uint32_t);
+private int search_scan(struct magic_set *, const struct magic_search *,
+    size_t);
+private size_t search_start(struct magic_set *, const struct magic_search *,
+    const struct magic *, uint32_t);
+private int regex_absent(struct magic_set *, const struct magic_search *,
+    uint32_t);
+private int32_t mprint(struct magic_set *, struct magic *,
+    const struct magic_desc *);
 private int32_t moffset(struct magic_set *, struct magic *);
 private void mdebug(uint32_t, const char *, size_t);
 private int mcopy(struct magic_set *, union VALUETYPE *, int, int,
     const unsigned char *, uint32_t, size_t, size_t);
+private size_t mneed(const struct magic *, int);
+private int mindirect(struct magic_set *, const unsigned char *,
+    const unsigned char *, size_t, uint32_t, int);
+private uint32_t mwindow(struct magic_set *, const unsigned char **, size_t *,
+    uint32_t, size_t);
 private int mconvert(struct magic_set *, struct magic *);
 private int print_sep(struct magic_set *, int);
-private int handle_annotation(struct magic_set *, struct magic *);
+private int handle_annotation(struct magic_set *, const struct magic_desc *);
+private int res_add(struct magic_set *, struct mlist *, uint32_t,
+    unsigned int);
 private void cvt_8(union VALUETYPE *, const struct magic *);
 private void cvt_16(union VALUETYPE *, const struct magic *);
 private void cvt_32(union VALUETYPE *, const struct magic *);
@@ -68,15 +172,1005 @@ private void cvt_64(union VALUETYPE *, const struct magic *);
 protected int
 file_softmagic(struct magic_set *ms, const unsigned char *buf, size_t nbytes, int mode)
 {
-	struct mlist *ml;
+	if ((ms->flags & MAGIC_PROFILE) != 0 && prof_counts(ms) == NULL)
+		return -1;
+	if (ms->db->memo != NULL && ms->memo.buf == NULL && buf != NULL &&
+	    !ms->res.on &&
+	    (ms->flags & (MAGIC_DEBUG|MAGIC_CHECK|MAGIC_PROFILE)) == 0)
+		return memo_softmagic(ms, buf, nbytes, mode);
+	return softmagic(ms, buf, nbytes, mode);
+}
+
+private int
+softmagic(struct magic_set *ms, const unsigned char *buf, size_t nbytes,
+    int mode)
+{
+	struct mlist *mlist = ms->db->mlist, *ml;
+	const uint32_t *cand;
 	int rv;
-	for (ml = ms->mlist->next; ml != ms->mlist; ml = ml->next)
-		if ((rv = match(ms, ml->magic, ml->nmagic, buf, nbytes, mode)) != 0)
+
+	/* A nested call looks at part of the same buffer */
+	if (!ms->cand.busy)
+		ms->lit.sr = NULL;
+
+	for (ml = mlist->next; ml != mlist; ml = ml->next) {
+		cand = candidates(ms, ml, buf, nbytes);
+		rv = match(ms, ml, cand, buf, nbytes, mode);
+		if (cand != NULL)
+			ms->cand.busy = 0;
+		if (rv != 0)
+			return rv;
+	}
+
+	return 0;
+}
+
+/*
+ * The MAGIC_PROFILE counters of a handle, one for every entry of the
+ * database, allocated the first time they are needed
+ */
+private struct magic_prof *
+prof_counts(struct magic_set *ms)
+{
+	struct mlist *mlist = ms->db->mlist;
+	uint32_t n;
+
+	if (ms->prof.cnt != NULL)
+		return ms->prof.cnt;
+	n = mlist->prev == mlist ? 0 :
+	    mlist->prev->first + mlist->prev->nmagic;
+	if ((ms->prof.cnt = CAST(struct magic_prof *,
+	    calloc(n ? n : 1, sizeof(*ms->prof.cnt)))) == NULL) {
+		file_oomem(ms, n * sizeof(*ms->prof.cnt));
+		return NULL;
+	}
+	ms->prof.n = n;
+	return ms->prof.cnt;
+}
+
+/*
+ * Count a test of an entry that started at t0; the time of an entry
+ * includes that of the tests of indirect and used entries it ran.
+ */
+private void
+prof_count(struct magic_prof *prof, uint32_t magindex, uint64_t t0, int hit)
+{
+	if (prof == NULL)
+		return;
+	prof[magindex].tests++;
+	if (hit)
+		prof[magindex].hits++;
+	prof[magindex].cycles += file_clock() - t0;
+}
+
+/*
+ * Add the counts of the handle to the totals of its database
+ */
+protected void
+file_prof_flush(struct magic_set *ms)
+{
+	struct magic_db *db = ms->db;
+	uint32_t i;
+
+	if (ms->prof.cnt == NULL || db == NULL)
+		return;
+	file_atomic_lock(&db->profbusy);
+	if (db->prof == NULL && (db->prof = CAST(struct magic_prof *,
+	    calloc(ms->prof.n ? ms->prof.n : 1, sizeof(*db->prof)))) != NULL)
+		db->nprof = ms->prof.n;
+	if (db->prof != NULL)
+		for (i = 0; i < db->nprof; i++) {
+			db->prof[i].tests += ms->prof.cnt[i].tests;
+			db->prof[i].hits += ms->prof.cnt[i].hits;
+			db->prof[i].cycles += ms->prof.cnt[i].cycles;
+		}
+	file_atomic_unlock(&db->profbusy);
+	(void)memset(ms->prof.cnt, 0, ms->prof.n * sizeof(*ms->prof.cnt));
+}
+
+struct prof_line {
+	struct magic_prof p;
+	uint32_t entry;
+};
+
+private int
+prof_cmp(const void *a, const void *b)
+{
+	const struct prof_line *x = CAST(const struct prof_line *, a);
+	const struct prof_line *y = CAST(const struct prof_line *, b);
+
+	if (x->p.cycles != y->p.cycles)
+		return x->p.cycles < y->p.cycles ? 1 : -1;
+	return x->entry < y->entry ? -1 : x->entry > y->entry;
+}
+
+/*
+ * Print the totals of the database, the entries that took the most time
+ * first, at most max of them unless max is 0. An entry is named by its
+ * magic file and line, and by its description or, if it has none, that
+ * of the top-level entry it continues.
+ */
+protected int
+file_prof_report(struct magic_set *ms, size_t max)
+{
+	static const char levels[] = ">>>>>>>>>>";
+	struct magic_db *db = ms->db;
+	struct mlist *ml;
+	struct prof_line *line;
+	const struct magic *m;
+	const char *name, *desc, *p;
+	size_t n = 0, i;
+	uint32_t magindex, top;
+
+	file_prof_flush(ms);
+	if (file_reset(ms) == -1)
+		return -1;
+
+	file_atomic_lock(&db->profbusy);
+	line = CAST(struct prof_line *, malloc((db->nprof ? db->nprof : 1) *
+	    sizeof(*line)));
+	if (line != NULL)
+		for (i = 0; i < db->nprof; i++)
+			if (db->prof[i].tests != 0) {
+				line[n].p = db->prof[i];
+				line[n++].entry = CAST(uint32_t, i);
+			}
+	file_atomic_unlock(&db->profbusy);
+	if (line == NULL) {
+		file_oomem(ms, db->nprof * sizeof(*line));
+		return -1;
+	}
+
+	qsort(line, n, sizeof(*line), prof_cmp);
+	if (max == 0 || max > n)
+		max = n;
+
+	if (file_printf(ms, "%12s %10s %10s  %s\n", "cycles", "tests", "hits",
+	    "entry") == -1)
+		goto out;
+	for (i = 0; i < max; i++) {
+		for (ml = db->mlist->next; ml != db->mlist; ml = ml->next)
+			if (line[i].entry - ml->first < ml->nmagic)
+				break;
+		if (ml == db->mlist)
+			continue;
+		magindex = line[i].entry - ml->first;
+		m = &ml->magic[magindex];
+		for (top = magindex; top > 0 && ml->magic[top].cont_level != 0;
+		    top--)
+			continue;
+		desc = DESC_STR(&ml->desc[magindex], desc);
+		if (*desc == '\0')
+			desc = DESC_STR(&ml->desc[top], desc);
+		/* the fragment of Magdir the entry is in, else the list */
+		name = DESC_STR(&ml->desc[magindex], file);
+		if (*name == '\0') {
+			name = ml->name;
+			if ((p = strrchr(name, '/')) != NULL)
+				name = p + 1;
+#ifdef WIN32
+			if ((p = strrchr(name, '\\')) != NULL)
+				name = p + 1;
+#endif
+		}
+		if (file_printf(ms, "%12" INT64_T_FORMAT "u %10" INT64_T_FORMAT
+		    "u %10" INT64_T_FORMAT "u  %s:%u %.*s%s\n",
+		    (unsigned long long)line[i].p.cycles,
+		    (unsigned long long)line[i].p.tests,
+		    (unsigned long long)line[i].p.hits, name, m->lineno,
+		    (int)(m->cont_level < sizeof(levels) - 1 ?
+		    m->cont_level : sizeof(levels) - 1), levels,
+		    desc) == -1)
+			goto out;
+	}
+	free(line);
+	return 0;
+out:
+	free(line);
+	return -1;
+}
+
+#define MEMO_FNV(h, c)	(((h) ^ (c)) * 16777619U)
+
+/*
+ * FNV-1a hash of the mode and the leading bytes, which pick the shapes
+ * to try
+ */
+private uint32_t
+memo_lead(const unsigned char *buf, size_t nbytes, int mode)
+{
+	uint32_t h = 2166136261U;
+	size_t i;
+
+	h = MEMO_FNV(h, CAST(uint32_t, mode));
+	for (i = 0; i < nbytes && i < MEMO_KEYLEN; i++)
+		h = MEMO_FNV(h, buf[i]);
+	return h;
+}
+
+/*
+ * Hash of the bytes in the ranges of a shape, FNV-1a on 64-bit words
+ */
+private uint32_t
+memo_hash(const unsigned char *data, size_t len)
+{
+	uint64_t h = 14695981039346656037ULL, w;
+	size_t i;
+
+	for (i = 0; i + sizeof(w) <= len; i += sizeof(w)) {
+		(void)memcpy(&w, data + i, sizeof(w));
+		h = (h ^ w) * 1099511628211ULL;
+		h ^= h >> 29;
+	}
+	for (; i < len; i++)
+		h = (h ^ data[i]) * 1099511628211ULL;
+	return CAST(uint32_t, h ^ (h >> 32));
+}
+
+protected struct magic_memo *
+file_memo_new(size_t max)
+{
+	struct magic_memo *mm;
+	size_t n;
+
+	for (n = 1; n < max; n *= 2)
+		continue;
+	if ((mm = CAST(struct magic_memo *, calloc(1, sizeof(*mm)))) == NULL)
+		return NULL;
+	if ((mm->lead = CAST(struct memo_shape **,
+	    calloc(n, sizeof(*mm->lead)))) == NULL ||
+	    (mm->bucket = CAST(struct memo_entry **,
+	    calloc(n, sizeof(*mm->bucket)))) == NULL) {
+		free(mm->lead);
+		free(mm);
+		return NULL;
+	}
+	mm->mask = n - 1;
+	mm->max = max;
+	return mm;
+}
+
+protected void
+file_memo_free(struct magic_memo *mm)
+{
+	struct memo_shape *sh, *next;
+	struct memo_entry *e, *older;
+	size_t i;
+
+	if (mm == NULL)
+		return;
+	for (e = mm->newest; e != NULL; e = older) {
+		older = e->older;
+		free(e);
+	}
+	for (i = 0; i <= mm->mask; i++)
+		for (sh = mm->lead[i]; sh != NULL; sh = next) {
+			next = sh->next;
+			free(sh);
+		}
+	free(mm->lead);
+	free(mm->bucket);
+	free(mm);
+}
+
+/*
+ * Take e out of its bucket and the order of use, and its shape out of
+ * the memo with the last entry of it
+ */
+private void
+memo_unlink(struct magic_memo *mm, struct memo_entry *e)
+{
+	struct memo_entry **pp;
+	struct memo_shape **sp;
+
+	for (pp = &mm->bucket[e->hash & mm->mask]; *pp != e; pp = &(*pp)->next)
+		continue;
+	*pp = e->next;
+	if (e->newer != NULL)
+		e->newer->older = e->older;
+	else
+		mm->newest = e->older;
+	if (e->older != NULL)
+		e->older->newer = e->newer;
+	else
+		mm->oldest = e->newer;
+	mm->count--;
+	if (--e->shape->refs == 0) {
+		for (sp = &mm->lead[e->shape->lead & mm->mask]; *sp != e->shape;
+		    sp = &(*sp)->next)
+			continue;
+		*sp = e->shape->next;
+		free(e->shape);
+	}
+}
+
+/*
+ * Put e first in its bucket and the order of use; its shape must be in
+ * the memo
+ */
+private void
+memo_link(struct magic_memo *mm, struct memo_entry *e)
+{
+	struct memo_entry **b = &mm->bucket[e->hash & mm->mask];
+
+	e->next = *b;
+	*b = e;
+	e->newer = NULL;
+	e->older = mm->newest;
+	if (mm->newest != NULL)
+		mm->newest->newer = e;
+	else
+		mm->oldest = e;
+	mm->newest = e;
+	mm->count++;
+	e->shape->refs++;
+}
+
+/*
+ * Make room in *p, of *size bytes, for len bytes more than the used
+ */
+private int
+memo_grow(unsigned char **p, size_t *size, size_t used, size_t len)
+{
+	unsigned char *d;
+	size_t n;
+
+	if (len <= *size - used)
+		return 0;
+	for (n = *size ? *size : 1024; n < used + len; n *= 2)
+		continue;
+	if ((d = CAST(unsigned char *, realloc(*p, n))) == NULL)
+		return -1;
+	*p = d;
+	*size = n;
+	return 0;
+}
+
+#define memo_reserve(ms, len) \
+    memo_grow(&(ms)->memo.data, &(ms)->memo.dsize, (ms)->memo.dlen, (len))
+
+/*
+ * Copy out the shapes to try for a buffer with the given leading bytes,
+ * so that its bytes in their ranges can be collected with the memo
+ * free.  Returns how many there are, 0 if the memo is busy.
+ */
+private size_t
+memo_copy(struct magic_set *ms, struct magic_memo *mm, uint32_t lead,
+    int mode, struct memo_cand *cand)
+{
+	const struct memo_shape *sh;
+	size_t i, n, len;
+
+	if (!file_atomic_trylock(&mm->busy))
+		return 0;
+	ms->memo.slen = 0;
+	for (i = n = 0, sh = mm->lead[lead & mm->mask];
+	    sh != NULL && i < MEMO_SHAPES; sh = sh->next, i++) {
+		if (sh->lead != lead || sh->flags != ms->flags ||
+		    sh->mode != mode)
+			continue;
+		len = MEMO_SHAPESIZE(sh->nrange);
+		if (memo_grow(&ms->memo.shapes, &ms->memo.ssize,
+		    ms->memo.slen, len) == -1)
+			break;
+		(void)memcpy(ms->memo.shapes + ms->memo.slen, sh, len);
+		cand[n++].sh = ms->memo.slen;
+		ms->memo.slen += len;
+	}
+	file_atomic_unlock(&mm->busy);
+	return n;
+}
+
+/*
+ * Append to ms->memo.data the bytes of the buffer in the ranges of a
+ * shape; those past the buffer are read through the reader. Returns -1
+ * if some are not there.
+ */
+private int
+memo_gather(struct magic_set *ms, const struct memo_shape *sh,
+    const unsigned char *buf, size_t nbytes, size_t size)
+{
+	const struct memo_range *r;
+	const unsigned char *p;
+	size_t avail;
+
+	if (memo_reserve(ms, sh->len) == -1)
+		return -1;
+	for (r = sh->range; r < sh->range + sh->nrange; r++) {
+		if (r->off + r->len <= nbytes)
+			p = buf + r->off;
+		else if (r->off + r->len > size || (p = file_reader_get(ms,
+		    ms->rd.base + r->off, r->len, &avail)) == NULL ||
+		    avail < r->len)
+			return -1;
+		(void)memcpy(ms->memo.data + ms->memo.dlen, p, r->len);
+		ms->memo.dlen += r->len;
+	}
+	return 0;
+}
+
+/* Whether read r can go in the range that ends at end */
+#define MEMO_JOIN(ms, end, r) ((r).off <= (end) || \
+    ((r).off - (end) <= MEMO_GAP && (r).off <= (ms)->memo.nbytes))
+
+private int
+memo_cmp(const void *a, const void *b)
+{
+	const struct memo_read *ra = CAST(const struct memo_read *, a);
+	const struct memo_read *rb = CAST(const struct memo_read *, b);
+
+	if (ra->off != rb->off)
+		return ra->off < rb->off ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Make an entry of what the match just done read and printed after
+ * outoff; was is whether there was output before it
+ */
+private void
+memo_store(struct magic_set *ms, uint32_t lead, int mode, int rv, int was,
+    size_t outoff, int hadmime)
+{
+	struct magic_memo *mm = ms->db->memo;
+	struct memo_read *rd = ms->memo.read;
+	struct memo_shape *sh, *s;
+	struct memo_range *r;
+	struct memo_entry *e;
+	unsigned char *d;
+	size_t i, j, nrange, len, rend, outlen, mimelen;
+
+	outlen = file_printedlen(ms) - outoff;
+	/* whether an empty string was printed cannot be told */
+	if (was && outlen == 0 && rv != 0)
+		return;
+	/* nor which MIME type the match would have recorded */
+	if (hadmime)
+		return;
+	mimelen = strlen(ms->mime.type);
+
+	/*
+	 * Merge the reads into ranges, taking in short gaps between them
+	 * from the buffer; comparing a few bytes more is cheaper than
+	 * another range
+	 */
+	qsort(rd, ms->memo.nread, sizeof(*rd), memo_cmp);
+	nrange = len = 0;
+	for (i = 0; i < ms->memo.nread; i = j) {
+		rend = rd[i].off + rd[i].len;
+		for (j = i + 1; j < ms->memo.nread && MEMO_JOIN(ms, rend, rd[j]);
+		    j++)
+			rend = MAX(rend, rd[j].off + rd[j].len);
+		nrange++;
+		len += rend - rd[i].off;
+	}
+	if (len > MEMO_MAXDATA)
+		return;
+
+	if ((sh = CAST(struct memo_shape *, malloc(MEMO_SHAPESIZE(nrange))))
+	    == NULL)
+		return;
+	if ((e = CAST(struct memo_entry *, malloc(sizeof(*e) + len +
+	    outlen + 1 + mimelen + 1))) == NULL) {
+		free(sh);
+		return;
+	}
+	e->data = RCAST(unsigned char *, e + 1);
+	e->out = RCAST(char *, e->data + len);
+	e->mime = e->out + outlen + 1;
+	e->end = 0;
+	for (i = 0, r = sh->range, d = e->data; i < ms->memo.nread;
+	    i = j, d += r->len, r++) {
+		r->off = rd[i].off;
+		rend = rd[i].off + rd[i].len;
+		(void)memcpy(d, ms->memo.data + rd[i].at, rd[i].len);
+		for (j = i + 1; j < ms->memo.nread && MEMO_JOIN(ms, rend, rd[j]);
+		    j++) {
+			if (rd[j].off > rend)
+				(void)memcpy(d + (rend - r->off),
+				    ms->memo.buf + rend, rd[j].off - rend);
+			(void)memcpy(d + (rd[j].off - r->off),
+			    ms->memo.data + rd[j].at, rd[j].len);
+			rend = MAX(rend, rd[j].off + rd[j].len);
+		}
+		r->len = rend - r->off;
+		e->end = rend;
+	}
+	sh->lead = lead;
+	sh->flags = ms->flags;
+	sh->mode = mode;
+	sh->refs = 0;
+	sh->len = len;
+	sh->nrange = nrange;
+	e->hash = memo_hash(e->data, len);
+	e->exact = ms->memo.exact;
+	e->nbytes = ms->memo.nbytes;
+	e->size = ms->memo.size;
+	e->ceiling = ms->memo.ceiling;
+	e->outlen = outlen;
+	if (outlen != 0)
+		(void)memcpy(e->out, ms->o.buf + outoff, outlen);
+	e->out[outlen] = '\0';
+	(void)memcpy(e->mime, ms->mime.type, mimelen + 1);
+	e->printed = outlen != 0 || (!was && ms->o.buf != NULL);
+	e->rv = rv;
+
+	if (!file_atomic_trylock(&mm->busy)) {
+		free(sh);
+		free(e);
+		return;
+	}
+	for (s = mm->lead[lead & mm->mask]; s != NULL; s = s->next)
+		if (MEMO_SAMESHAPE(s, sh))
+			break;
+	if (s == NULL) {
+		sh->next = mm->lead[lead & mm->mask];
+		mm->lead[lead & mm->mask] = sh;
+		s = sh;
+	} else
+		free(sh);
+	e->shape = s;
+	memo_link(mm, e);
+	if (mm->count > mm->max) {
+		e = mm->oldest;
+		memo_unlink(mm, e);
+		free(e);
+	}
+	file_atomic_unlock(&mm->busy);
+}
+
+/*
+ * Look in the memo for the result of matching the buffer, given its
+ * bytes in the ranges of the shapes copied out; the shapes may have
+ * gone since.  The caller holds the memo.  Returns the entry or NULL.
+ */
+private struct memo_entry *
+memo_find(struct magic_set *ms, struct magic_memo *mm, uint32_t lead,
+    const struct memo_cand *cand, size_t ncand, size_t nbytes, size_t size)
+{
+	const struct memo_shape *c;
+	struct memo_shape *sh, **sp;
+	struct memo_entry *e;
+	const unsigned char *d;
+	size_t i;
+
+	for (i = 0; i < ncand; i++) {
+		if (!cand[i].ok)
+			continue;
+		c = RCAST(const struct memo_shape *,
+		    ms->memo.shapes + cand[i].sh);
+		for (sp = &mm->lead[lead & mm->mask]; (sh = *sp) != NULL;
+		    sp = &sh->next)
+			if (MEMO_SAMESHAPE(sh, c))
+				break;
+		if (sh == NULL)
+			continue;
+		d = ms->memo.data + cand[i].at;
+		for (e = mm->bucket[cand[i].hash & mm->mask]; e != NULL;
+		    e = e->next)
+			if (e->shape == sh && e->hash == cand[i].hash &&
+			    (e->exact ? nbytes == e->nbytes && size == e->size :
+			    size <= e->ceiling && size >= e->end) &&
+			    memcmp(e->data, d, sh->len) == 0)
+				break;
+		if (e == NULL)
+			continue;
+		/* the shape goes first among those with its leading bytes */
+		*sp = sh->next;
+		sh->next = mm->lead[lead & mm->mask];
+		mm->lead[lead & mm->mask] = sh;
+		return e;
+	}
+	return NULL;
+}
+
+/*
+ * file_softmagic() through the memo: give the result kept for a buffer
+ * with the same bytes where the tests looked, or match and keep what
+ * the tests read
+ */
+private int
+memo_softmagic(struct magic_set *ms, const unsigned char *buf,
+    size_t nbytes, int mode)
+{
+	struct magic_memo *mm = ms->db->memo;
+	struct memo_cand cand[MEMO_SHAPES];
+	const struct memo_shape *sh;
+	struct memo_entry *e;
+	size_t i, ncand, size, outoff;
+	uint32_t lead;
+	int was, hadmime, rv;
+
+	/* clamped where size_t is 32 bits; no range reaches that far */
+	size = nbytes;
+	if (ms->rd.read != NULL && buf == ms->rd.buf &&
+	    ms->rd.size - ms->rd.base > nbytes)
+		size = ms->rd.size - ms->rd.base > SIZE_MAX ? SIZE_MAX :
+		    (size_t)(ms->rd.size - ms->rd.base);
+	lead = memo_lead(buf, nbytes, mode);
+
+	ncand = memo_copy(ms, mm, lead, mode, cand);
+	ms->memo.dlen = 0;
+	for (i = 0; i < ncand; i++) {
+		sh = RCAST(const struct memo_shape *,
+		    ms->memo.shapes + cand[i].sh);
+		cand[i].at = ms->memo.dlen;
+		cand[i].ok = memo_gather(ms, sh, buf, nbytes, size) == 0;
+		if (cand[i].ok)
+			cand[i].hash = memo_hash(ms->memo.data + cand[i].at,
+			    sh->len);
+		else
+			ms->memo.dlen = cand[i].at;
+	}
+
+	if (ncand != 0 && file_atomic_trylock(&mm->busy)) {
+		if ((e = memo_find(ms, mm, lead, cand, ncand, nbytes,
+		    size)) != NULL) {
+			/* keep it from being the next to go */
+			if (e != mm->newest) {
+				e->newer->older = e->older;
+				if (e->older != NULL)
+					e->older->newer = e->newer;
+				else
+					mm->oldest = e->newer;
+				e->newer = NULL;
+				e->older = mm->newest;
+				mm->newest->newer = e;
+				mm->newest = e;
+			}
+			rv = e->rv;
+			if (e->printed && file_printf(ms, "%s", e->out) == -1)
+				rv = -1;
+			if (e->mime[0])
+				file_setmime(ms, e->mime, NULL);
+			file_atomic_unlock(&mm->busy);
 			return rv;
+		}
+		file_atomic_unlock(&mm->busy);
+	}
+
+	ms->memo.buf = buf;
+	ms->memo.nbytes = nbytes;
+	ms->memo.size = size;
+	ms->memo.nread = 0;
+	ms->memo.dlen = 0;
+	ms->memo.ceiling = SIZE_MAX;
+	ms->memo.exact = 0;
+	ms->memo.bad = 0;
+	was = ms->o.buf != NULL;
+	outoff = file_printedlen(ms);
+	hadmime = ms->mime.type[0] != '\0';
+	rv = softmagic(ms, buf, nbytes, mode);
+	if (rv != -1 && !ms->memo.bad)
+		memo_store(ms, lead, mode, rv, was, outoff, hadmime);
+	ms->memo.buf = NULL;
+	return rv;
+}
+
+/*
+ * Note for the memo that a test looked at len bytes at offset off in
+ * s0, which are at data.  With toend set it looked as far as the data
+ * went, so the result also depends on where that is.
+ */
+private void
+mtrack(struct magic_set *ms, const unsigned char *s0, size_t off,
+    const unsigned char *data, size_t len, int toend)
+{
+	struct memo_read *r;
+	size_t n;
+
+	if (ms->memo.buf == NULL || ms->memo.bad)
+		return;
+	if (s0 < ms->memo.buf || s0 > ms->memo.buf + ms->memo.nbytes) {
+		/* not in terms of the buffer */
+		ms->memo.bad = 1;
+		return;
+	}
+	off += CAST(size_t, s0 - ms->memo.buf);
+	if (toend)
+		ms->memo.exact = 1;
+	if (off >= ms->memo.size) {
+		if (off == ms->memo.size)
+			ms->memo.exact = 1;
+		else if (off - 1 < ms->memo.ceiling)
+			ms->memo.ceiling = off - 1;
+		return;
+	}
+	if (len > ms->memo.size - off) {
+		len = ms->memo.size - off;
+		ms->memo.exact = 1;
+	}
+	/* the last read often covers this one */
+	if (ms->memo.nread > 0) {
+		r = &ms->memo.read[ms->memo.nread - 1];
+		if (off >= r->off && off + len <= r->off + r->len)
+			return;
+	}
+	if (len > MEMO_MAXTRACK - ms->memo.dlen) {
+		ms->memo.bad = 1;
+		return;
+	}
+
+	if (ms->memo.nread == ms->memo.rsize) {
+		n = ms->memo.rsize ? 2 * ms->memo.rsize : 64;
+		if ((r = CAST(struct memo_read *, realloc(ms->memo.read,
+		    n * sizeof(*r)))) == NULL) {
+			ms->memo.bad = 1;
+			return;
+		}
+		ms->memo.read = r;
+		ms->memo.rsize = n;
+	}
+	if (memo_reserve(ms, len) == -1) {
+		ms->memo.bad = 1;
+		return;
+	}
+	r = &ms->memo.read[ms->memo.nread++];
+	r->off = off;
+	r->len = len;
+	r->at = ms->memo.dlen;
+	(void)memcpy(ms->memo.data + ms->memo.dlen, data, len);
+	ms->memo.dlen += len;
+}
+
+/*
+ * Note for the memo what the test of entry m, as the given type,
+ * looked at at offset in s0; s and nbytes are what mcopy() was given,
+ * a window from the reader delta bytes into s0 when delta is not 0
+ */
+private void
+mtrackget(struct magic_set *ms, const struct magic *m, int type,
+    const unsigned char *s0, const unsigned char *s, size_t nbytes,
+    uint32_t offset, uint32_t delta)
+{
+	size_t len;
+
+	switch (type) {
+	case FILE_SEARCH:
+		len = CAST(size_t, m->str_range) +
+		    MIN(m->vallen, sizeof(m->value.s));
+		if (m->str_range != 0 && len <= mneed(m, type) &&
+		    (m->str_flags & (STRING_COMPACT_WHITESPACE|
+		    STRING_COMPACT_OPTIONAL_WHITESPACE)) == 0)
+			break;
+		/*FALLTHROUGH*/
+	case FILE_REGEX:
+		/* as far as the data goes; a window ends with a block */
+		if (delta != 0) {
+			ms->memo.bad = 1;
+			return;
+		}
+		mtrack(ms, s0, offset, s + offset,
+		    offset < nbytes ? nbytes - offset : 0, 1);
+		return;
+	case FILE_INDIRECT:
+		/* the nested tests note what they look at */
+		len = 0;
+		break;
+	case FILE_DEFAULT:
+		return;
+	default:
+		len = mneed(m, type);
+		break;
+	}
+	mtrack(ms, s0, offset, s + (offset - delta), len, 0);
+}
+
+/*
+ * Use the dispatch index of a list to mark in bits the top-level
+ * entries that can match the buffer
+ */
+private void
+index_bits(struct magic_set *ms, const struct magic_index *ix,
+    const unsigned char *s, size_t nbytes, uint32_t *bits)
+{
+	const struct magic_ioff *o;
+	const struct magic_ikey *k, *ek;
+	const unsigned char *b;
+	uint32_t off;
+	size_t n, lo, hi, mid;
+
+	(void)memcpy(bits, ix->always, ix->nwords * sizeof(*bits));
+
+	for (o = ix->off; o < ix->off + ix->noff; o++) {
+		b = s;
+		n = nbytes;
+		off = o->offset;
+		off -= mwindow(ms, &b, &n, off, sizeof(k->val));
+		if (off >= n) {
+			if (ms->memo.buf != NULL)
+				mtrack(ms, s, o->offset, NULL, 1, 0);
+			break;
+		}
+		/* find the keys for the byte at this offset */
+		lo = o->key;
+		hi = o->key + o->nkey;
+		while (lo < hi) {
+			mid = (lo + hi) / 2;
+			if (ix->key[mid].val[0] < b[off])
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		ek = ix->key + o->key + o->nkey;
+		for (k = ix->key + lo; k < ek && k->val[0] == b[off]; k++) {
+			if (n - off < k->len ||
+			    memcmp(b + off + 1, k->val + 1, k->len - 1))
+				continue;
+			bits[k->magindex / 32] |= 1U << (k->magindex % 32);
+		}
+		/* all that keys can look at, to keep to one shape */
+		if (ms->memo.buf != NULL)
+			mtrack(ms, s, o->offset, b + off, sizeof(k->val), 0);
+	}
+}
+
+/*
+ * Mark the top-level entries of a list that can match the buffer: those
+ * its dispatch index allows and, for a buffer of magic_buffer_batch(),
+ * that passed file_softmagic_screen().  Returns NULL when all entries
+ * must be tried: there is no index, the bitmap is taken by an outer
+ * match() (for FILE_INDIRECT), or debugging output should show every
+ * test.
+ */
+private const uint32_t *
+candidates(struct magic_set *ms, struct mlist *ml, const unsigned char *s,
+    size_t nbytes)
+{
+	const struct magic_index *ix = ml->index;
+	const uint32_t *screen;
+	uint32_t *bits;
+	struct mlist *l;
 
+	if (ix == NULL || s == NULL || ms->cand.busy ||
+	    (ms->flags & MAGIC_DEBUG) != 0)
+		return NULL;
+
+	if (ms->cand.len < ix->nwords) {
+		if ((bits = CAST(uint32_t *, realloc(ms->cand.bits,
+		    ix->nwords * sizeof(*bits)))) == NULL)
+			return NULL;
+		ms->cand.bits = bits;
+		ms->cand.len = ix->nwords;
+	}
+	bits = ms->cand.bits;
+	if (s == ms->batch.buf && nbytes == ms->batch.len &&
+	    ms->memo.buf == NULL) {
+		/* screened, starting from the same index bits */
+		screen = ms->batch.cur;
+		for (l = ms->db->mlist->next; l != ml; l = l->next)
+			if (l->index != NULL)
+				screen += l->index->nwords;
+		(void)memcpy(bits, screen, ix->nwords * sizeof(*bits));
+	} else
+		index_bits(ms, ix, s, nbytes, bits);
+	ms->cand.busy = 1;
+	return bits;
+}
+
+/*
+ * Try the top-level binary tests of the lists on n buffers for
+ * magic_buffer_batch(), each test on all the buffers before the next
+ * one, and keep for each buffer the entries that passed.  A buffer is
+ * done with once an entry that prints something passes, as match()
+ * would stop there.  Entries whose test has side effects or relies on
+ * a per-buffer cache are left for match() to try.  Returns -1 if the
+ * bitmaps could not be allocated; the buffers are then not screened.
+ */
+protected int
+file_softmagic_screen(struct magic_set *ms, const void *const *bufs,
+    const size_t *lens, size_t n)
+{
+	struct mlist *mlist = ms->db->mlist, *ml;
+	struct magic *m;
+	uint32_t *bits, *any, *b, magindex, bit;
+	unsigned char *done;
+	struct arena_mark mark;
+	size_t i, j, words, woff;
+	int rv;
+
+	ms->batch.words = 0;
+	if (n == 0 ||
+	    (ms->flags & (MAGIC_DEBUG|MAGIC_CONTINUE|MAGIC_PROFILE)) != 0)
+		return 0;
+	for (words = 0, ml = mlist->next; ml != mlist; ml = ml->next)
+		if (ml->index != NULL)
+			words += ml->index->nwords;
+	if (words == 0)
+		return 0;
+	if (ms->batch.size < n * words) {
+		if ((bits = CAST(uint32_t *, realloc(ms->batch.bits,
+		    n * words * sizeof(*bits)))) == NULL)
+			return -1;
+		ms->batch.bits = bits;
+		ms->batch.size = n * words;
+	}
+	file_arena_mark(ms, &mark);
+	if ((done = CAST(unsigned char *, file_arena_alloc(ms, n))) == NULL ||
+	    (any = CAST(uint32_t *, file_arena_alloc(ms,
+	    words * sizeof(*any)))) == NULL)
+		return -1;
+	(void)memset(done, 0, n);
+	bits = ms->batch.bits;
+
+	for (woff = 0, ml = mlist->next; ml != mlist; ml = ml->next) {
+		if (ml->index == NULL)
+			continue;
+		/* any: the entries that are candidates for some buffer */
+		(void)memset(any, 0, ml->index->nwords * sizeof(*any));
+		for (i = 0; i < n; i++) {
+			b = bits + i * words + woff;
+			index_bits(ms, ml->index,
+			    CAST(const unsigned char *, bufs[i]), lens[i], b);
+			for (j = 0; j < ml->index->nwords; j++)
+				any[j] |= b[j];
+		}
+
+		for (magindex = next_entry(any, 0, ml->nmagic);
+		    magindex < ml->nmagic;
+		    magindex = next_entry(any, magindex + 1, ml->nmagic)) {
+			m = &ml->magic[magindex];
+			if (m->cont_level != 0 || (m->flag & BINTEST) == 0 ||
+			    m->type == FILE_INDIRECT ||
+			    (m->type == FILE_SEARCH && ml->search != NULL &&
+			    ml->search->lit[magindex] != SEARCH_NOLIT))
+				continue;
+			bit = 1U << (magindex % 32);
+			for (i = 0; i < n; i++) {
+				b = bits + i * words + woff + magindex / 32;
+				if (done[i] || (*b & bit) == 0)
+					continue;
+				ms->offset = m->offset;
+				ms->line = m->lineno;
+				switch (mget(ms, CAST(const unsigned char *,
+				    bufs[i]), m, &ml->desc[magindex], lens[i],
+				    0)) {
+				case -1:
+					/* match() will report it */
+					continue;
+				case 0:
+					rv = m->reln == '!';
+					break;
+				default:
+					rv = magiccheck(ms, ml, magindex);
+					break;
+				}
+				if (rv == 0)
+					*b &= ~bit;
+				else if (rv == 1 &&
+				    *DESC_STR(&ml->desc[magindex], desc))
+					done[i] = 1;
+			}
+		}
+		woff += ml->index->nwords;
+	}
+	file_arena_release(ms, &mark);
+	ms->batch.words = words;
 	return 0;
 }
 
+/*
+ * Return the first candidate entry at or after i, or n if there is none
+ */
+private uint32_t
+next_entry(const uint32_t *bits, uint32_t i, uint32_t n)
+{
+	uint32_t w;
+
+	if (bits == NULL)
+		return i;
+	for (; i < n; i = (i | 31) + 1) {
+		if ((w = bits[i / 32] >> (i % 32)) == 0)
+			continue;
+		while ((w & 1) == 0) {
+			w >>= 1;
+			i++;
+		}
+		return i;
+	}
+	return n;
+}
+
 /*
  * Go through the whole list, stopping if you find a match.  Process all
  * the continuations of that match before returning.
@@ -105,23 +1199,36 @@ file_softmagic(struct magic_set *ms, const unsigned char *buf, size_t nbytes, in
  *	so that higher-level continuations are processed.
  */
 private int
-match(struct magic_set *ms, struct magic *magic, uint32_t nmagic,
+match(struct magic_set *ms, struct mlist *ml, const uint32_t *cand,
     const unsigned char *s, size_t nbytes, int mode)
 {
+	struct magic *magic = ml->magic;
+	struct magic_desc *desc = ml->desc;
+	uint32_t nmagic = ml->nmagic;
 	uint32_t magindex = 0;
 	unsigned int cont_level = 0;
 	int need_separator = 0;
 	int returnval = 0, e; /* if a match is found it is set to 1*/
 	int firstline = 1; /* a flag to print X\n  X\n- X */
 	int printed_something = 0;
-	int print = (ms->flags & (MAGIC_MIME|MAGIC_APPLE)) == 0;
+	int describe = (ms->flags & (MAGIC_MIME|MAGIC_APPLE)) == 0;
+	int print = describe && !ms->res.on;
+	struct magic_prof *prof = NULL;
+	uint64_t t0 = 0;
+	size_t nres = 0;
+	int hit;
+
+	if ((ms->flags & MAGIC_PROFILE) != 0 && ms->prof.cnt != NULL)
+		prof = ms->prof.cnt + ml->first;
 
 	if (file_check_mem(ms, cont_level) == -1)
 		return -1;
 
-	for (magindex = 0; magindex < nmagic; magindex++) {
+	for (magindex = next_entry(cand, 0, nmagic); magindex < nmagic;
+	    magindex = next_entry(cand, magindex + 1, nmagic)) {
 		int flush = 0;
 		struct magic *m = &magic[magindex];
+		struct magic_desc *d = &desc[magindex];
 
 		if ((m->flag & mode) != mode) {
 			/* Skip sub-tests */
@@ -134,8 +1241,19 @@ match(struct magic_set *ms, struct magic *magic, uint32_t nmagic,
 		ms->offset = m->offset;
 		ms->line = m->lineno;
 
+		if (ms->res.on) {
+			nres = ms->res.n;
+			if (m->type == FILE_INDIRECT) {
+				/* ahead of the entries it leads to */
+				if (res_add(ms, ml, magindex, cont_level) == -1)
+					return -1;
+				ms->res.ind = nres;
+			}
+		}
+		if (prof != NULL)
+			t0 = file_clock();
 		/* if main entry matches, print it... */
-		switch (mget(ms, s, m, nbytes, cont_level)) {
+		switch (mget(ms, s, m, d, nbytes, cont_level)) {
 		case -1:
 			return -1;
 		case 0:
@@ -145,7 +1263,7 @@ match(struct magic_set *ms, struct magic *magic, uint32_t nmagic,
 			if (m->type == FILE_INDIRECT)
 				returnval = 1;
 
-			switch (magiccheck(ms, m)) {
+			switch (magiccheck(ms, ml, magindex)) {
 			case -1:
 				return -1;
 			case 0:
@@ -157,6 +1275,9 @@ match(struct magic_set *ms, struct magic *magic, uint32_t nmagic,
 			}
 			break;
 		}
+		prof_count(prof, magindex, t0, !flush);
+		if (ms->res.on && flush)
+			ms->res.n = nres;
 		if (flush) {
 			/*
 			 * main entry didn't match,
@@ -168,13 +1289,16 @@ match(struct magic_set *ms, struct magic *magic, uint32_t nmagic,
 			continue;
 		}
 
-		if ((e = handle_annotation(ms, m)) != 0)
+		if (ms->res.on && m->type != FILE_INDIRECT &&
+		    res_add(ms, ml, magindex, cont_level) == -1)
+			return -1;
+		if ((e = handle_annotation(ms, d)) != 0)
 			return e;
 		/*
 		 * If we are going to print something, we'll need to print
 		 * a blank before we print something else.
 		 */
-		if (*m->desc) {
+		if (*DESC_STR(d, desc)) {
 			need_separator = 1;
 			printed_something = 1;
 			if (print_sep(ms, firstline) == -1)
@@ -182,7 +1306,7 @@ match(struct magic_set *ms, struct magic *magic, uint32_t nmagic,
 		}
 
 
-		if (print && mprint(ms, m) == -1)
+		if (print && mprint(ms, m, d) == -1)
 			return -1;
 
 		ms->c.li[cont_level].off = moffset(ms, m);
@@ -194,6 +1318,7 @@ match(struct magic_set *ms, struct magic *magic, uint32_t nmagic,
 		while (magic[magindex+1].cont_level != 0 &&
 		    ++magindex < nmagic) {
 			m = &magic[magindex];
+			d = &desc[magindex];
 			ms->line = m->lineno; /* for messages */
 
 			if (cont_level < m->cont_level)
@@ -218,12 +1343,26 @@ match(struct magic_set *ms, struct magic *magic, uint32_t nmagic,
 					continue;
 			}
 #endif
-			switch (mget(ms, s, m, nbytes, cont_level)) {
+			if (ms->res.on) {
+				nres = ms->res.n;
+				if (m->type == FILE_INDIRECT) {
+					if (res_add(ms, ml, magindex,
+					    cont_level) == -1)
+						return -1;
+					ms->res.ind = nres;
+				}
+			}
+			if (prof != NULL)
+				t0 = file_clock();
+			switch (mget(ms, s, m, d, nbytes, cont_level)) {
 			case -1:
 				return -1;
 			case 0:
-				if (m->reln != '!')
+				if (m->reln != '!') {
+					prof_count(prof, magindex, t0, 0);
+					ms->res.n = nres;
 					continue;
+				}
 				flush = 1;
 				break;
 			default:
@@ -233,13 +1372,15 @@ match(struct magic_set *ms, struct magic *magic, uint32_t nmagic,
 				break;
 			}
 
-			switch (flush ? 1 : magiccheck(ms, m)) {
-			case -1:
+			if ((hit = flush ? 1 : magiccheck(ms, ml, magindex)) == -1)
 				return -1;
+			prof_count(prof, magindex, t0, hit);
+			switch (hit) {
 			case 0:
 #ifdef ENABLE_CONDITIONALS
 				ms->c.li[cont_level].last_match = 0;
 #endif
+				ms->res.n = nres;
 				break;
 			default:
 #ifdef ENABLE_CONDITIONALS
@@ -251,13 +1392,16 @@ match(struct magic_set *ms, struct magic *magic, uint32_t nmagic,
 					ms->c.li[cont_level].got_match = 0;
 					break;
 				}
-				if ((e = handle_annotation(ms, m)) != 0)
+				if (ms->res.on && m->type != FILE_INDIRECT &&
+				    res_add(ms, ml, magindex, cont_level) == -1)
+					return -1;
+				if ((e = handle_annotation(ms, d)) != 0)
 					return e;
 				/*
 				 * If we are going to print something,
 				 * make sure that we have a separator first.
 				 */
-				if (*m->desc) {
+				if (*DESC_STR(d, desc)) {
 					if (!printed_something) {
 						printed_something = 1;
 						if (print_sep(ms, firstline)
@@ -274,18 +1418,18 @@ match(struct magic_set *ms, struct magic *magic, uint32_t nmagic,
 				/* space if previous printed */
 				if (need_separator
 				    && ((m->flag & NOSPACE) == 0)
-				    && *m->desc) {
+				    && *DESC_STR(d, desc)) {
 					if (print &&
 					    file_printf(ms, " ") == -1)
 						return -1;
 					need_separator = 0;
 				}
-				if (print && mprint(ms, m) == -1)
+				if (print && mprint(ms, m, d) == -1)
 					return -1;
 
 				ms->c.li[cont_level].off = moffset(ms, m);
 
-				if (*m->desc)
+				if (*DESC_STR(d, desc))
 					need_separator = 1;
 
 				/*
@@ -300,7 +1444,7 @@ match(struct magic_set *ms, struct magic *magic, uint32_t nmagic,
 		}
 		if (printed_something) {
 			firstline = 0;
-			if (print)
+			if (describe)
 				returnval = 1;
 		}
 		if ((ms->flags & MAGIC_CONTINUE) == 0 && printed_something) {
@@ -311,25 +1455,20 @@ match(struct magic_set *ms, struct magic *magic, uint32_t nmagic,
 }
 
 private int
-check_fmt(struct magic_set *ms, struct magic *m)
+check_fmt(struct magic_set *ms, const struct magic_desc *d)
 {
-	regex_t rx;
+	struct magic_regex *mrx;
 	int rc;
 
-	if (strchr(m->desc, '%') == NULL)
+	if (strchr(DESC_STR(d, desc), '%') == NULL)
 		return 0;
 
-	rc = regcomp(&rx, "%[-0-9\\.]*s", REG_EXTENDED|REG_NOSUB);
-	if (rc) {
-		char errmsg[512];
-		(void)regerror(rc, &rx, errmsg, sizeof(errmsg));
-		file_magerror(ms, "regex error %d, (%s)", rc, errmsg);
+	if ((mrx = file_regcomp(ms, "%[-0-9\\.]*s", REG_EXTENDED|REG_NOSUB))
+	    == NULL)
 		return -1;
-	} else {
-		rc = regexec(&rx, m->desc, 0, 0, 0);
-		regfree(&rx);
-		return !rc;
-	}
+	rc = file_regexec(mrx, DESC_STR(d, desc), 0, 0, 0);
+	file_regfree(mrx);
+	return !rc;
 }
 
 #ifndef HAVE_STRNDUP
@@ -352,7 +1491,7 @@ strndup(const char *str, size_t n)
 #endif /* HAVE_STRNDUP */
 
 private int32_t
-mprint(struct magic_set *ms, struct magic *m)
+mprint(struct magic_set *ms, struct magic *m, const struct magic_desc *d)
 {
 	uint64_t v;
 	float vf;
@@ -360,21 +1499,22 @@ mprint(struct magic_set *ms, struct magic *m)
 	int64_t t = 0;
  	char buf[128];
 	union VALUETYPE *p = &ms->ms_value;
+	const char *desc = DESC_STR(d, desc);
 
   	switch (m->type) {
   	case FILE_BYTE:
 		v = file_signextend(ms, m, (uint64_t)p->b);
-		switch (check_fmt(ms, m)) {
+		switch (check_fmt(ms, d)) {
 		case -1:
 			return -1;
 		case 1:
 			(void)snprintf(buf, sizeof(buf), "%c",
 			    (unsigned char)v);
-			if (file_printf(ms, m->desc, buf) == -1)
+			if (file_printf(ms, desc, buf) == -1)
 				return -1;
 			break;
 		default:
-			if (file_printf(ms, m->desc, (unsigned char) v) == -1)
+			if (file_printf(ms, desc, (unsigned char) v) == -1)
 				return -1;
 			break;
 		}
@@ -385,18 +1525,18 @@ mprint(struct magic_set *ms, struct magic *m)
   	case FILE_BESHORT:
   	case FILE_LESHORT:
 		v = file_signextend(ms, m, (uint64_t)p->h);
-		switch (check_fmt(ms, m)) {
+		switch (check_fmt(ms, d)) {
 		case -1:
 			return -1;
 		case 1:
 			(void)snprintf(buf, sizeof(buf), "%hu",
 			    (unsigned short)v);
-			if (file_printf(ms, m->desc, buf) == -1)
+			if (file_printf(ms, desc, buf) == -1)
 				return -1;
 			break;
 		default:
 			if (
-			    file_printf(ms, m->desc, (unsigned short) v) == -1)
+			    file_printf(ms, desc, (unsigned short) v) == -1)
 				return -1;
 			break;
 		}
@@ -408,16 +1548,16 @@ mprint(struct magic_set *ms, struct magic *m)
   	case FILE_LELONG:
   	case FILE_MELONG:
 		v = file_signextend(ms, m, (uint64_t)p->l);
-		switch (check_fmt(ms, m)) {
+		switch (check_fmt(ms, d)) {
 		case -1:
 			return -1;
 		case 1:
 			(void)snprintf(buf, sizeof(buf), "%u", (uint32_t)v);
-			if (file_printf(ms, m->desc, buf) == -1)
+			if (file_printf(ms, desc, buf) == -1)
 				return -1;
 			break;
 		default:
-			if (file_printf(ms, m->desc, (uint32_t) v) == -1)
+			if (file_printf(ms, desc, (uint32_t) v) == -1)
 				return -1;
 			break;
 		}
@@ -428,7 +1568,7 @@ mprint(struct magic_set *ms, struct magic *m)
   	case FILE_BEQUAD:
   	case FILE_LEQUAD:
 		v = file_signextend(ms, m, p->q);
-		if (file_printf(ms, m->desc, (uint64_t) v) == -1)
+		if (file_printf(ms, desc, (uint64_t) v) == -1)
 			return -1;
 		t = ms->offset + sizeof(int64_t);
   		break;
@@ -438,14 +1578,14 @@ mprint(struct magic_set *ms, struct magic *m)
   	case FILE_BESTRING16:
   	case FILE_LESTRING16:
 		if (m->reln == '=' || m->reln == '!') {
-			if (file_printf(ms, m->desc, m->value.s) == -1)
+			if (file_printf(ms, desc, m->value.s) == -1)
 				return -1;
 			t = ms->offset + m->vallen;
 		}
 		else {
 			if (*m->value.s == '\0')
 				p->s[strcspn(p->s, "\n")] = '\0';
-			if (file_printf(ms, m->desc, p->s) == -1)
+			if (file_printf(ms, desc, p->s) == -1)
 				return -1;
 			t = ms->offset + strlen(p->s);
 			if (m->type == FILE_PSTRING)
@@ -457,7 +1597,8 @@ mprint(struct magic_set *ms, struct magic *m)
 	case FILE_BEDATE:
 	case FILE_LEDATE:
 	case FILE_MEDATE:
-		if (file_printf(ms, m->desc, file_fmttime(p->l, 1)) == -1)
+		if (file_printf(ms, desc,
+		    file_fmttime(buf, sizeof(buf), p->l, 1)) == -1)
 			return -1;
 		t = ms->offset + sizeof(time_t);
 		break;
@@ -466,7 +1607,8 @@ mprint(struct magic_set *ms, struct magic *m)
 	case FILE_BELDATE:
 	case FILE_LELDATE:
 	case FILE_MELDATE:
-		if (file_printf(ms, m->desc, file_fmttime(p->l, 0)) == -1)
+		if (file_printf(ms, desc,
+		    file_fmttime(buf, sizeof(buf), p->l, 0)) == -1)
 			return -1;
 		t = ms->offset + sizeof(time_t);
 		break;
@@ -474,8 +1616,8 @@ mprint(struct magic_set *ms, struct magic *m)
 	case FILE_QDATE:
 	case FILE_BEQDATE:
 	case FILE_LEQDATE:
-		if (file_printf(ms, m->desc, file_fmttime((uint32_t)p->q,
-		    1)) == -1)
+		if (file_printf(ms, desc, file_fmttime(buf, sizeof(buf),
+		    (uint32_t)p->q, 1)) == -1)
 			return -1;
 		t = ms->offset + sizeof(uint64_t);
 		break;
@@ -483,8 +1625,8 @@ mprint(struct magic_set *ms, struct magic *m)
 	case FILE_QLDATE:
 	case FILE_BEQLDATE:
 	case FILE_LEQLDATE:
-		if (file_printf(ms, m->desc, file_fmttime((uint32_t)p->q,
-		    0)) == -1)
+		if (file_printf(ms, desc, file_fmttime(buf, sizeof(buf),
+		    (uint32_t)p->q, 0)) == -1)
 			return -1;
 		t = ms->offset + sizeof(uint64_t);
 		break;
@@ -493,16 +1635,16 @@ mprint(struct magic_set *ms, struct magic *m)
   	case FILE_BEFLOAT:
   	case FILE_LEFLOAT:
 		vf = p->f;
-		switch (check_fmt(ms, m)) {
+		switch (check_fmt(ms, d)) {
 		case -1:
 			return -1;
 		case 1:
 			(void)snprintf(buf, sizeof(buf), "%g", vf);
-			if (file_printf(ms, m->desc, buf) == -1)
+			if (file_printf(ms, desc, buf) == -1)
 				return -1;
 			break;
 		default:
-			if (file_printf(ms, m->desc, vf) == -1)
+			if (file_printf(ms, desc, vf) == -1)
 				return -1;
 			break;
 		}
@@ -513,16 +1655,16 @@ mprint(struct magic_set *ms, struct magic *m)
   	case FILE_BEDOUBLE:
   	case FILE_LEDOUBLE:
 		vd = p->d;
-		switch (check_fmt(ms, m)) {
+		switch (check_fmt(ms, d)) {
 		case -1:
 			return -1;
 		case 1:
 			(void)snprintf(buf, sizeof(buf), "%g", vd);
-			if (file_printf(ms, m->desc, buf) == -1)
+			if (file_printf(ms, desc, buf) == -1)
 				return -1;
 			break;
 		default:
-			if (file_printf(ms, m->desc, vd) == -1)
+			if (file_printf(ms, desc, vd) == -1)
 				return -1;
 			break;
 		}
@@ -538,7 +1680,7 @@ mprint(struct magic_set *ms, struct magic *m)
 			file_oomem(ms, ms->search.rm_len);
 			return -1;
 		}
-		rval = file_printf(ms, m->desc, cp);
+		rval = file_printf(ms, desc, cp);
 		free(cp);
 
 		if (rval == -1)
@@ -552,7 +1694,7 @@ mprint(struct magic_set *ms, struct magic *m)
 	}
 
 	case FILE_SEARCH:
-	  	if (file_printf(ms, m->desc, m->value.s) == -1)
+	  	if (file_printf(ms, desc, m->value.s) == -1)
 			return -1;
 		if ((m->str_flags & REGEX_OFFSET_START))
 			t = ms->search.offset;
@@ -561,7 +1703,7 @@ mprint(struct magic_set *ms, struct magic *m)
 		break;
 
 	case FILE_DEFAULT:
-	  	if (file_printf(ms, m->desc, m->value.s) == -1)
+	  	if (file_printf(ms, desc, m->value.s) == -1)
 			return -1;
 		t = ms->offset;
 		break;
@@ -1011,29 +2153,207 @@ mcopy(struct magic_set *ms, union VALUETYPE *p, int type, int indir,
 	return 0;
 }
 
+/*
+ * How many bytes from its offset a test of the given type may look at
+ */
+private size_t
+mneed(const struct magic *m, int type)
+{
+	switch (type) {
+	case FILE_BYTE:
+		return 1;
+	case FILE_SHORT:
+	case FILE_BESHORT:
+	case FILE_LESHORT:
+		return 2;
+	case FILE_LONG:
+	case FILE_BELONG:
+	case FILE_LELONG:
+	case FILE_MELONG:
+	case FILE_DATE:
+	case FILE_BEDATE:
+	case FILE_LEDATE:
+	case FILE_MEDATE:
+	case FILE_LDATE:
+	case FILE_BELDATE:
+	case FILE_LELDATE:
+	case FILE_MELDATE:
+	case FILE_FLOAT:
+	case FILE_BEFLOAT:
+	case FILE_LEFLOAT:
+	case FILE_BEID3:
+	case FILE_LEID3:
+		return 4;
+	case FILE_QUAD:
+	case FILE_BEQUAD:
+	case FILE_LEQUAD:
+	case FILE_QDATE:
+	case FILE_BEQDATE:
+	case FILE_LEQDATE:
+	case FILE_QLDATE:
+	case FILE_BEQLDATE:
+	case FILE_LEQLDATE:
+	case FILE_DOUBLE:
+	case FILE_BEDOUBLE:
+	case FILE_LEDOUBLE:
+		return 8;
+	case FILE_SEARCH:
+		if (m->str_range != 0 &&
+		    m->str_range < (uint32_t)(READER_MAXWIN - m->vallen))
+			return m->str_range + m->vallen;
+		return READER_MAXWIN;
+	case FILE_REGEX:
+		return READER_MAXWIN;
+	case FILE_INDIRECT:
+		return READER_BLOCK;
+	case FILE_BESTRING16:
+	case FILE_LESTRING16:
+		return 2 * sizeof(union VALUETYPE);
+	default:
+		return sizeof(union VALUETYPE);
+	}
+}
+
+/*
+ * If s is the buffer given to magic_reader() and the len bytes at
+ * offset run past its end, point s and nbytes at a window on the file
+ * that starts at offset instead, and return offset; otherwise return
+ * 0.  The window is good until the reader is used again.
+ */
+private uint32_t
+mwindow(struct magic_set *ms, const unsigned char **s, size_t *nbytes,
+    uint32_t offset, size_t len)
+{
+	const unsigned char *w;
+	size_t n;
+
+	if (ms->rd.read == NULL || *s == NULL || *s != ms->rd.buf ||
+	    (offset <= *nbytes && len <= *nbytes - offset) ||
+	    ms->rd.base + *nbytes >= ms->rd.size ||
+	    ms->rd.base + offset >= ms->rd.size)
+		return 0;
+	if (len > READER_MAXWIN)
+		len = READER_MAXWIN;
+	if (len > ms->rd.size - ms->rd.base - offset)
+		len = (size_t)(ms->rd.size - ms->rd.base - offset);
+	if ((w = file_reader_get(ms, ms->rd.base + offset, len, &n)) == NULL ||
+	    n < len) {
+		/* what the tests see depends on how the read went */
+		ms->memo.bad = 1;
+		if (w == NULL)
+			return 0;
+	}
+	*s = w;
+	*nbytes = n;
+	return offset;
+}
+
+/*
+ * Match the nbytes at s, which are at offset in s0, for FILE_INDIRECT.
+ * When s0 is read through the reader the nested tests go on reading
+ * the file past s; if s is a window from the reader it is copied
+ * first, since they may refill it.
+ */
+private int
+mindirect(struct magic_set *ms, const unsigned char *s0,
+    const unsigned char *s, size_t nbytes, uint32_t offset, int window)
+{
+	const unsigned char *buf = ms->rd.buf;
+	uint64_t base = ms->rd.base;
+	unsigned int level = ms->res.base;
+	size_t off = ms->res.off;
+	struct arena_mark mark;
+	unsigned char *copy;
+	int rv;
+
+	/* Entries reached from here go below the indirect entry */
+	if (ms->res.ind != SIZE_MAX) {
+		ms->res.match[ms->res.ind].offset = off + offset;
+		ms->res.base = ms->res.match[ms->res.ind].level + 1;
+		ms->res.off = off + offset;
+		ms->res.ind = SIZE_MAX;
+	}
+
+	if (ms->rd.read == NULL || s0 == NULL || s0 != buf) {
+		rv = file_softmagic(ms, s, nbytes, BINTEST);
+		goto out;
+	}
+
+	file_arena_mark(ms, &mark);
+	if (window) {
+		ms->memo.bad = 1;
+		if ((copy = CAST(unsigned char *,
+		    file_arena_alloc(ms, nbytes))) == NULL) {
+			rv = -1;
+			goto out;
+		}
+		(void)memcpy(copy, s, nbytes);
+		s = copy;
+	}
+	ms->rd.buf = s;
+	ms->rd.base = base + offset;
+	rv = file_softmagic(ms, s, nbytes, BINTEST);
+	ms->rd.buf = buf;
+	ms->rd.base = base;
+	file_arena_release(ms, &mark);
+out:
+	ms->res.base = level;
+	ms->res.off = off;
+	return rv;
+}
+
 private int
 mget(struct magic_set *ms, const unsigned char *s,
-    struct magic *m, size_t nbytes, unsigned int cont_level)
+    struct magic *m, const struct magic_desc *d, size_t nbytes,
+    unsigned int cont_level)
 {
 	uint32_t offset = ms->offset;
 	uint32_t count = m->str_range;
 	union VALUETYPE *p = &ms->ms_value;
+	const unsigned char *s0 = s;
+	size_t nbytes0 = nbytes;
+	uint32_t delta;
 
-	if (mcopy(ms, p, m->type, m->flag & INDIR, s, offset, nbytes, count) == -1)
+	/*
+	 * Bytes past the buffer may come from the reader, in a window
+	 * that starts delta bytes into the buffer.  The checks below
+	 * compare against the end of the window, nbytes + delta.
+	 */
+	delta = mwindow(ms, &s, &nbytes, offset,
+	    mneed(m, (m->flag & INDIR) ? m->in_type : m->type));
+	if (mcopy(ms, p, m->type, m->flag & INDIR, s, offset - delta, nbytes,
+	    count) == -1)
 		return -1;
+	if (ms->memo.buf != NULL)
+		mtrackget(ms, m, (m->flag & INDIR) ? m->in_type : m->type,
+		    s0, s, nbytes, offset, delta);
+	nbytes += delta;
 
 	if ((ms->flags & MAGIC_DEBUG) != 0) {
 		mdebug(offset, (char *)(void *)p, sizeof(union VALUETYPE));
 #ifndef COMPILE_ONLY
-		file_mdump(m);
+		file_mdump(m, DESC_STR(d, desc));
 #endif
 	}
 
 	if (m->flag & INDIR) {
 		int off = m->in_offset;
 		if (m->in_op & FILE_OPINDIRECT) {
-			const union VALUETYPE *q = CAST(const union VALUETYPE *,
-			    ((const void *)(s + offset + off)));
+			const unsigned char *qs = s0;
+			size_t qn = nbytes0;
+			uint32_t qoff = offset + off;
+			const union VALUETYPE *q;
+
+			qoff -= mwindow(ms, &qs, &qn, qoff, mneed(m, m->in_type));
+			if (ms->memo.buf != NULL) {
+				/* q is read whether it is there or not */
+				if (qoff > qn || mneed(m, m->in_type) > qn - qoff)
+					ms->memo.bad = 1;
+				mtrack(ms, s0, offset + off, qs + qoff,
+				    mneed(m, m->in_type), 0);
+			}
+			q = CAST(const union VALUETYPE *,
+			    ((const void *)(qs + qoff)));
 			switch (m->in_type) {
 			case FILE_BYTE:
 				off = q->b;
@@ -1506,19 +2826,29 @@ mget(struct magic_set *ms, const unsigned char *s,
 		if (m->flag & INDIROFFADD) {
 			offset += ms->c.li[cont_level-1].off;
 		}
-		if (mcopy(ms, p, m->type, 0, s, offset, nbytes, count) == -1)
+		s = s0;
+		nbytes = nbytes0;
+		delta = mwindow(ms, &s, &nbytes, offset, mneed(m, m->type));
+		if (mcopy(ms, p, m->type, 0, s, offset - delta, nbytes,
+		    count) == -1)
 			return -1;
+		if (ms->memo.buf != NULL)
+			mtrackget(ms, m, m->type, s0, s, nbytes, offset, delta);
+		nbytes += delta;
 		ms->offset = offset;
 
 		if ((ms->flags & MAGIC_DEBUG) != 0) {
 			mdebug(offset, (char *)(void *)p,
 			    sizeof(union VALUETYPE));
 #ifndef COMPILE_ONLY
-			file_mdump(m);
+			file_mdump(m, DESC_STR(d, desc));
 #endif
 		}
 	}
 
+	if (m->type == FILE_SEARCH || m->type == FILE_REGEX)
+		ms->search.offset += delta;
+
 	/* Verify we have enough data to match magic type */
 	switch (m->type) {
 	case FILE_BYTE:
@@ -1572,13 +2902,13 @@ mget(struct magic_set *ms, const unsigned char *s,
 		break;
 
 	case FILE_INDIRECT:
-	  	if ((ms->flags & (MAGIC_MIME|MAGIC_APPLE)) == 0 &&
-		    file_printf(ms, "%s", m->desc) == -1)
+	  	if ((ms->flags & (MAGIC_MIME|MAGIC_APPLE)) == 0 && !ms->res.on &&
+		    file_printf(ms, "%s", DESC_STR(d, desc)) == -1)
 			return -1;
 		if (nbytes < offset)
 			return 0;
-		return file_softmagic(ms, s + offset, nbytes - offset,
-		    BINTEST);
+		return mindirect(ms, s0, s + (offset - delta),
+		    nbytes - offset, offset, delta != 0);
 
 	case FILE_DEFAULT:	/* nothing to check */
 	default:
@@ -1664,9 +2994,97 @@ file_strncmp16(const char *a, const char *b, size_t len, uint32_t flags)
 	return file_strncmp(a, b, len, flags);
 }
 
+/*
+ * Run the literal automaton of sr over reach bytes of the region, unless
+ * an earlier pass already covers them, noting where each literal first
+ * occurs.  Returns -1 if out of memory.
+ */
 private int
-magiccheck(struct magic_set *ms, struct magic *m)
+search_scan(struct magic_set *ms, const struct magic_search *sr,
+    size_t reach)
 {
+	const unsigned char *s = RCAST(const unsigned char *, ms->search.s);
+	const unsigned char *p;
+	size_t scan;
+	uint32_t *first, q, i;
+
+	if (ms->lit.sr == sr && s >= ms->lit.s && s + reach <= ms->lit.e)
+		return 0;
+	if (ms->lit.len < sr->nlit) {
+		if ((first = CAST(uint32_t *, realloc(ms->lit.first,
+		    sr->nlit * sizeof(*first)))) == NULL)
+			return -1;
+		ms->lit.first = first;
+		ms->lit.len = sr->nlit;
+	}
+	first = ms->lit.first;
+	(void)memset(first, 0xff, sr->nlit * sizeof(*first));
+	/* cover the other searches from here too */
+	scan = MIN(MAX(sr->reach, reach), ms->search.s_len);
+	for (q = 0, p = s; p < s + scan; p++) {
+		q = sr->delta[q * sr->nclass + sr->class[*p]];
+		for (i = sr->out[q]; i < sr->out[q + 1]; i++)
+			if (first[sr->outs[i]] == SEARCH_NOLIT)
+				first[sr->outs[i]] = CAST(uint32_t,
+				    p - s + 1 - sr->litlen[sr->outs[i]]);
+	}
+	ms->lit.sr = sr;
+	ms->lit.s = s;
+	ms->lit.e = s + scan;
+	return 0;
+}
+
+/*
+ * Find where a search for entry m, whose literal is lit, can first
+ * match, using one automaton pass over the region for all entries.
+ * Returns the index to start at or SIZE_MAX if there is no match.
+ */
+private size_t
+search_start(struct magic_set *ms, const struct magic_search *sr,
+    const struct magic *m, uint32_t lit)
+{
+	const unsigned char *s = RCAST(const unsigned char *, ms->search.s);
+	const unsigned char *p;
+	size_t reach = ms->search.s_len;
+
+	if (m->str_range != 0 &&
+	    m->str_range + MIN(m->vallen, sizeof(m->value.s)) < reach)
+		reach = m->str_range + MIN(m->vallen, sizeof(m->value.s));
+
+	if (search_scan(ms, sr, reach) == -1)
+		return 0;	/* just search */
+	if (ms->lit.first[lit] == SEARCH_NOLIT)
+		return SIZE_MAX;
+	p = ms->lit.s + ms->lit.first[lit];
+	return p < s ? 0 : CAST(size_t, p - s);
+}
+
+/*
+ * Tell whether the literal lit, which every match of a regex contains,
+ * is missing from the region, so that the regex cannot match there.
+ * The same pass as for the searches serves all regexes of the region.
+ */
+private int
+regex_absent(struct magic_set *ms, const struct magic_search *sr,
+    uint32_t lit)
+{
+	const unsigned char *s = RCAST(const unsigned char *, ms->search.s);
+	const unsigned char *p;
+
+	if (search_scan(ms, sr, ms->search.s_len) == -1)
+		return 0;	/* just run it */
+	if (ms->lit.first[lit] == SEARCH_NOLIT)
+		return 1;
+	/* an occurrence before the region says nothing about it */
+	p = ms->lit.s + ms->lit.first[lit];
+	return p >= s && p + sr->litlen[lit] > s + ms->search.s_len;
+}
+
+private int
+magiccheck(struct magic_set *ms, struct mlist *ml, uint32_t magindex)
+{
+	struct magic *m = &ml->magic[magindex];
+	struct magic_regex *mrx = ml->regex[magindex];
 	uint64_t l = m->value.q;
 	uint64_t v;
 	float fl, fv;
@@ -1807,7 +3225,17 @@ magiccheck(struct magic_set *ms, struct magic *m)
 		l = 0;
 		v = 0;
 
-		for (idx = 0; m->str_range == 0 || idx < m->str_range; idx++) {
+		idx = 0;
+		if (ml->search != NULL &&
+		    ml->search->lit[magindex] != SEARCH_NOLIT &&
+		    (idx = search_start(ms, ml->search, m,
+		    ml->search->lit[magindex])) == SIZE_MAX) {
+			v = 1;
+			break;
+		}
+		if (idx != 0)
+			v = 1;	/* in case idx is already out of range */
+		for (; m->str_range == 0 || idx < m->str_range; idx++) {
 			if (slen + idx > ms->search.s_len)
 				break;
 
@@ -1820,61 +3248,73 @@ magiccheck(struct magic_set *ms, struct magic *m)
 		break;
 	}
 	case FILE_REGEX: {
+		struct magic_regex *rxp = NULL;	/* taken here, not at load */
+		regmatch_t pmatch[1];
 		int rc;
-		regex_t rx;
 		char errmsg[512];
+#ifndef REG_STARTEND
+		char *rs;
+#endif
 
 		if (ms->search.s == NULL)
 			return 0;
 
 		l = 0;
-		rc = regcomp(&rx, m->value.s,
-		    REG_EXTENDED|REG_NEWLINE|
-		    ((m->str_flags & STRING_IGNORE_CASE) ? REG_ICASE : 0));
-		if (rc) {
-			(void)regerror(rc, &rx, errmsg, sizeof(errmsg));
-			file_magerror(ms, "regex error %d, (%s)",
-			    rc, errmsg);
-			v = (uint64_t)-1;
+		if (ml->search != NULL &&
+		    ml->search->lit[magindex] != SEARCH_NOLIT &&
+		    regex_absent(ms, ml->search, ml->search->lit[magindex])) {
+			v = 1;
+			break;
 		}
-		else {
-			regmatch_t pmatch[1];
-#ifndef REG_STARTEND
-#define	REG_STARTEND	0
-			size_t l = ms->search.s_len - 1;
-			char c = ms->search.s[l];
-			((char *)(intptr_t)ms->search.s)[l] = '\0';
+		/* one that did not compile at load time reports why */
+		if (mrx == NULL && (mrx = rxp = file_regcomp(ms, m->value.s,
+		    FILE_REGEX_CFLAGS(m))) == NULL)
+			return -1;
+#ifdef REG_STARTEND
+		/*
+		 * Bound the search with the match range rather than a NUL,
+		 * so that the input, which may be a read-only mapping shared
+		 * with other threads, is never written.
+		 */
+		pmatch[0].rm_so = 0;
+		pmatch[0].rm_eo = ms->search.s_len;
+		rc = file_regexec(mrx, (const char *)ms->search.s,
+		    1, pmatch, REG_STARTEND);
 #else
-			pmatch[0].rm_so = 0;
-			pmatch[0].rm_eo = ms->search.s_len;
-#endif
-			rc = regexec(&rx, (const char *)ms->search.s,
-			    1, pmatch, REG_STARTEND);
-#if REG_STARTEND == 0
-			((char *)(intptr_t)ms->search.s)[l] = c;
+		if ((rs = CAST(char *, malloc(ms->search.s_len + 1))) == NULL) {
+			if (rxp != NULL)
+				file_regfree(rxp);
+			file_oomem(ms, ms->search.s_len + 1);
+			return -1;
+		}
+		(void)memcpy(rs, ms->search.s, ms->search.s_len);
+		rs[ms->search.s_len] = '\0';
+		rc = file_regexec(mrx, rs, 1, pmatch, 0);
+		free(rs);
 #endif
-			switch (rc) {
-			case 0:
-				ms->search.s += (int)pmatch[0].rm_so;
-				ms->search.offset += (size_t)pmatch[0].rm_so;
-				ms->search.rm_len =
-				    (size_t)(pmatch[0].rm_eo - pmatch[0].rm_so);
-				v = 0;
-				break;
+		switch (rc) {
+		case 0:
+			ms->search.s += (int)pmatch[0].rm_so;
+			ms->search.offset += (size_t)pmatch[0].rm_so;
+			ms->search.rm_len =
+			    (size_t)(pmatch[0].rm_eo - pmatch[0].rm_so);
+			v = 0;
+			break;
 
-			case REG_NOMATCH:
-				v = 1;
-				break;
+		case REG_NOMATCH:
+			v = 1;
+			break;
 
-			default:
-				(void)regerror(rc, &rx, errmsg, sizeof(errmsg));
-				file_magerror(ms, "regexec error %d, (%s)",
-				    rc, errmsg);
-				v = (uint64_t)-1;
-				break;
-			}
-			regfree(&rx);
+		default:
+			/* the message does not depend on the pattern */
+			(void)regerror(rc, NULL, errmsg, sizeof(errmsg));
+			file_magerror(ms, "regexec error %d, (%s)",
+			    rc, errmsg);
+			v = (uint64_t)-1;
+			break;
 		}
+		if (rxp != NULL)
+			file_regfree(rxp);
 		if (v == (uint64_t)-1)
 			return -1;
 		break;
@@ -1978,19 +3418,58 @@ magiccheck(struct magic_set *ms, struct magic *m)
 	return matched;
 }
 
+/*
+ * Note for magic_buffer_matches() that entry magindex of ml matched at
+ * continuation level cont_level
+ */
 private int
-handle_annotation(struct magic_set *ms, struct magic *m)
+res_add(struct magic_set *ms, struct mlist *ml, uint32_t magindex,
+    unsigned int cont_level)
 {
+	struct magic *m = &ml->magic[magindex];
+	struct magic_match *r;
+	size_t size;
+
+	if (ms->res.n == ms->res.size) {
+		size = ms->res.size ? 2 * ms->res.size : 16;
+		if ((r = CAST(struct magic_match *, realloc(ms->res.match,
+		    size * sizeof(*r)))) == NULL) {
+			file_oomem(ms, size * sizeof(*r));
+			return -1;
+		}
+		ms->res.match = r;
+		ms->res.size = size;
+	}
+	r = &ms->res.match[ms->res.n++];
+	r->entry = ml->first + magindex;
+	r->level = ms->res.base + cont_level;
+	/* only top-level entries are ordered by it */
+	r->strength = m->cont_level != 0 ? 0 : CAST(unsigned int,
+	    file_magic_strength(m, DESC_STR(&ml->desc[magindex], desc)));
+	if (m->type == FILE_SEARCH || m->type == FILE_REGEX)
+		r->offset = ms->res.off + ms->search.offset;
+	else
+		r->offset = ms->res.off + ms->offset;
+	return 0;
+}
+
+private int
+handle_annotation(struct magic_set *ms, const struct magic_desc *d)
+{
+	const char *mime = DESC_STR(d, mimetype);
+
 	if (ms->flags & MAGIC_APPLE) {
-		if (file_printf(ms, "%.8s", m->apple) == -1)
+		if (file_printf(ms, "%.8s", DESC_STR(d, apple)) == -1)
 			return -1;
 		return 1;
 	}
-	if ((ms->flags & MAGIC_MIME_TYPE) && m->mimetype[0]) {
-		if (file_printf(ms, "%s", m->mimetype) == -1)
+	if ((ms->flags & MAGIC_MIME_TYPE) && mime[0]) {
+		if (file_printf(ms, "%s", mime) == -1)
 			return -1;
 		return 1;
 	}
+	if (mime[0])
+		file_setmime(ms, mime, NULL);
 	return 0;
 }
 
@@ -25,6 +25,9 @@
  * SUCH DAMAGE.
  */
 
+#include "file.h"
+
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -51,12 +54,15 @@ slurp(FILE *fp, size_t *final_len)
 	for (c = getc(fp); c != EOF; c = getc(fp)) {
 		if (s == l + len) {
 			l = (char *)xrealloc(l, len * 2);
+			s = l + len;
 			len *= 2;
 		}
 		*s++ = c;
 	}
-	if (s == l + len)
+	if (s == l + len) {
 		l = (char *)xrealloc(l, len + 1);
+		s = l + len;
+	}
 	*s++ = '\0';
 
 	*final_len = s - l;
@@ -64,19 +70,373 @@ slurp(FILE *fp, size_t *final_len)
 	return l;
 }
 
+/*
+ * Read the letters in TEST.flags, next to TEST.testfile, that ask for
+ * more than the classification of the file; none if there is no such
+ * file
+ */
+static void
+getflags(const char *testfile, char *flags, size_t len)
+{
+	static const char sfx[] = ".testfile";
+	size_t n = strlen(testfile);
+	char *fn;
+	FILE *fp;
+
+	flags[0] = '\0';
+	if (n < sizeof(sfx) - 1 ||
+	    strcmp(testfile + n - (sizeof(sfx) - 1), sfx) != 0)
+		return;
+	n -= sizeof(sfx) - 1;
+	fn = (char *)xrealloc(NULL, n + sizeof(".flags"));
+	(void)memcpy(fn, testfile, n);
+	(void)strcpy(fn + n, ".flags");
+	if ((fp = fopen(fn, "r")) != NULL) {
+		n = fread(flags, 1, len - 1, fp);
+		flags[n] = '\0';
+		fclose(fp);
+	}
+	free(fn);
+}
+
+static int
+compare(const char *what, const char *result, const char *desired)
+{
+	if (strcmp(result, desired) != 0) {
+		(void)fprintf(stderr, "Error: %s was\n%s\nexpected:\n%s\n",
+		    what, result, desired);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Classify the file twice through a handle on the database, keeping a
+ * memo, so that the second result is the one the memo kept
+ */
+static int
+memo(struct magic_set *ms, const char *testfile, const char *desired)
+{
+	struct magic_set *ctx;
+	const char *result;
+	char *data;
+	size_t len;
+	int i, rv = 0;
+	FILE *fp;
+
+	if ((fp = fopen(testfile, "rb")) == NULL) {
+		(void)fprintf(stderr, "ERROR opening `%s': ", testfile);
+		perror(NULL);
+		return 13;
+	}
+	data = slurp(fp, &len);
+	fclose(fp);
+	if (magic_db_memo(magic_getdb(ms), 16) == -1 ||
+	    (ctx = magic_ctx_open(magic_getdb(ms), MAGIC_NONE)) == NULL) {
+		(void)fprintf(stderr, "ERROR keeping a memo: out of memory\n");
+		return 10;
+	}
+	for (i = 0; i < 2 && rv == 0; i++) {
+		if ((result = magic_buffer(ctx, data, len - 1)) == NULL) {
+			(void)fprintf(stderr, "ERROR classifying %s: %s\n",
+			    testfile, magic_error(ctx));
+			rv = 12;
+		} else
+			rv = compare(i == 0 ? "result with a memo" :
+			    "result from the memo", result, desired);
+	}
+	magic_close(ctx);
+	free(data);
+	return rv;
+}
+
+/*
+ * Read len bytes at offset off of the file, for magic_reader()
+ */
+static ssize_t
+readat(void *cookie, void *buf, size_t len, unsigned long long off)
+{
+	FILE *fp = (FILE *)cookie;
+
+	if (fseek(fp, (long)off, SEEK_SET) == -1)
+		return -1;
+	return (ssize_t)fread(buf, 1, len, fp);
+}
+
+/*
+ * Classify the file with only its first few bytes in the buffer, so
+ * that offsets the file gives are read through readat()
+ */
+static int
+reader(struct magic_set *ms, const char *testfile, const char *desired)
+{
+	unsigned char buf[16];
+	const char *result;
+	size_t nb;
+	long size;
+	int rv;
+	FILE *fp;
+
+	if ((fp = fopen(testfile, "rb")) == NULL) {
+		(void)fprintf(stderr, "ERROR opening `%s': ", testfile);
+		perror(NULL);
+		return 13;
+	}
+	if (fseek(fp, 0L, SEEK_END) == -1 || (size = ftell(fp)) == -1 ||
+	    fseek(fp, 0L, SEEK_SET) == -1) {
+		(void)fprintf(stderr, "ERROR sizing `%s': ", testfile);
+		perror(NULL);
+		fclose(fp);
+		return 13;
+	}
+	nb = fread(buf, 1, sizeof(buf), fp);
+	if ((result = magic_reader(ms, buf, nb, (unsigned long long)size,
+	    readat, fp)) == NULL) {
+		(void)fprintf(stderr, "ERROR reading %s: %s\n", testfile,
+		    magic_error(ms));
+		rv = 12;
+	} else
+		rv = compare("result through the reader", result, desired);
+	fclose(fp);
+	return rv;
+}
+
+/*
+ * Classify the file again with MAGIC_MIME_FIELDS; the MIME type and
+ * encoding found along with the description must be both the desired
+ * ones and what MAGIC_MIME gives
+ */
+static int
+mime(struct magic_set *ms, const char *testfile, const char *desired)
+{
+	const char *type, *encoding, *result;
+	char *line;
+	int rv;
+
+	if (magic_setflags(ms, MAGIC_MIME_FIELDS) == -1 ||
+	    magic_file(ms, testfile) == NULL ||
+	    magic_getmime(ms, &type, &encoding) == -1) {
+		(void)fprintf(stderr, "ERROR finding the MIME type of %s: %s\n",
+		    testfile, magic_error(ms) ? magic_error(ms) : "none");
+		return 12;
+	}
+	line = (char *)xrealloc(NULL, strlen(type) + strlen(encoding) +
+	    sizeof("; charset="));
+	(void)sprintf(line, "%s; charset=%s", type, encoding);
+	rv = compare("MIME fields", line, desired);
+	free(line);
+	if (rv != 0)
+		return rv;
+	if (magic_setflags(ms, MAGIC_MIME) == -1 ||
+	    (result = magic_file(ms, testfile)) == NULL) {
+		(void)fprintf(stderr, "ERROR loading file %s: %s\n", testfile,
+		    magic_error(ms));
+		return 12;
+	}
+	return compare("MIME result", result, desired);
+}
+
+/*
+ * Classify each line of the file, and the whole file, in one batch
+ * through a handle on the database; every result must be the one
+ * magic_buffer() gives for the same buffer, and the whole file's the
+ * desired one
+ */
+static int
+batch(struct magic_set *ms, const char *testfile, const char *desired)
+{
+	struct magic_set *ctx;
+	const void **bufs;
+	const char **results, *result;
+	size_t *lens, len, n, i;
+	char *data, *p, *q;
+	int rv = 0;
+	FILE *fp;
+
+	if ((fp = fopen(testfile, "rb")) == NULL) {
+		(void)fprintf(stderr, "ERROR opening `%s': ", testfile);
+		perror(NULL);
+		return 13;
+	}
+	data = slurp(fp, &len);
+	fclose(fp);
+	len--;
+	for (n = 1, p = data; p < data + len; p = q + 1, n++)
+		if ((q = memchr(p, '\n', (size_t)(data + len - p))) == NULL)
+			q = data + len;
+	bufs = (const void **)xrealloc(NULL, n * sizeof(*bufs));
+	lens = (size_t *)xrealloc(NULL, n * sizeof(*lens));
+	results = (const char **)xrealloc(NULL, n * sizeof(*results));
+	bufs[0] = data;
+	lens[0] = len;
+	for (n = 1, p = data; p < data + len; p = q + 1, n++) {
+		if ((q = memchr(p, '\n', (size_t)(data + len - p))) == NULL)
+			q = data + len;
+		bufs[n] = p;
+		lens[n] = (size_t)(q - p);
+	}
+
+	if ((ctx = magic_ctx_open(magic_getdb(ms), MAGIC_NONE)) == NULL) {
+		(void)fprintf(stderr, "ERROR opening a context: out of memory\n");
+		return 10;
+	}
+	if (magic_buffer_batch(ctx, bufs, lens, n, results) != 0) {
+		(void)fprintf(stderr, "ERROR classifying the lines of %s: %s\n",
+		    testfile, magic_error(ctx));
+		rv = 12;
+	} else
+		rv = compare("batch result", results[0], desired);
+	/* the results stay until the next call with ctx */
+	for (i = 0; i < n && rv == 0; i++) {
+		if ((result = magic_buffer(ms, bufs[i], lens[i])) == NULL) {
+			(void)fprintf(stderr, "ERROR classifying line %lu of %s: "
+			    "%s\n", (unsigned long)i, testfile, magic_error(ms));
+			rv = 12;
+		} else
+			rv = compare("batch result of a line", results[i],
+			    result);
+	}
+	magic_close(ctx);
+	free(results);
+	free(lens);
+	free(bufs);
+	free(data);
+	return rv;
+}
+
+/*
+ * List the entries that matched the file, one per line after the stage
+ * that named it, with where they are in the magic file, their place in
+ * its chain of continuations, the offset and the strength; the list
+ * must be the desired one
+ */
+static int
+matches(struct magic_set *ms, const char *testfile, const char *desired)
+{
+	struct magic_result res;
+	struct magic_entry_info info;
+	char *data, *list;
+	size_t len, i, used;
+	int rv;
+	FILE *fp;
+
+	if ((fp = fopen(testfile, "rb")) == NULL) {
+		(void)fprintf(stderr, "ERROR opening `%s': ", testfile);
+		perror(NULL);
+		return 13;
+	}
+	data = slurp(fp, &len);
+	fclose(fp);
+	if (magic_buffer_matches(ms, data, len - 1, &res) == -1) {
+		(void)fprintf(stderr, "ERROR matching %s: %s\n", testfile,
+		    magic_error(ms));
+		free(data);
+		return 12;
+	}
+	/* a line is at most this long, but for the description */
+	list = (char *)xrealloc(NULL, sizeof("stage -2147483648"));
+	used = (size_t)sprintf(list, "stage %d", res.stage);
+	for (i = 0; i < res.nmatch; i++) {
+		if (magic_getentry(ms, res.match[i].entry, &info) == -1) {
+			(void)fprintf(stderr, "ERROR looking up entry %u\n",
+			    res.match[i].entry);
+			free(list);
+			free(data);
+			return 12;
+		}
+		list = (char *)xrealloc(list, used + strlen(info.file) +
+		    strlen(info.desc) + 160);
+		used += (size_t)sprintf(list + used, "\nentry %u %s:%u "
+		    "level %u top %u offset %llu strength %u: %s",
+		    res.match[i].entry, info.file, info.line,
+		    res.match[i].level, info.top, res.match[i].offset,
+		    res.match[i].strength, info.desc);
+	}
+	rv = compare("list of matches", list, desired);
+	free(list);
+	free(data);
+	return rv;
+}
+
+/*
+ * Compile the magic into a file here, damage the size of its strings
+ * in the table of sections of the header, so that they run past the
+ * end, and load it; the error must be the desired one
+ */
+static int
+corrupt(const char *magicfile, const char *desired)
+{
+	struct magic_set *ms;
+	const char *base, *error;
+	char *dbname;
+	unsigned int size = 0xffffffff;
+	int rv;
+	FILE *fp;
+
+	if (magicfile == NULL) {
+		(void)fprintf(stderr, "ERROR compiling: MAGIC is not set\n");
+		return 11;
+	}
+	/* magic_compile() leaves out the directory */
+	if ((base = strrchr(magicfile, '/')) != NULL)
+		base++;
+	else
+		base = magicfile;
+	dbname = (char *)xrealloc(NULL, strlen(base) + sizeof(".mgc"));
+	(void)sprintf(dbname, "%s.mgc", base);
+	if ((ms = magic_open(MAGIC_NONE)) == NULL) {
+		(void)fprintf(stderr, "ERROR opening MAGIC_NONE: out of memory\n");
+		return 10;
+	}
+	if (magic_compile(ms, magicfile) == -1) {
+		(void)fprintf(stderr, "ERROR compiling: %s\n", magic_error(ms));
+		return 11;
+	}
+	magic_close(ms);
+	if ((fp = fopen(dbname, "r+b")) == NULL ||
+	    fseek(fp, (long)offsetof(struct magic_hdr,
+	    sect[MAGIC_SECT_STRS].size), SEEK_SET) == -1 ||
+	    fwrite(&size, sizeof(size), 1, fp) != 1 || fclose(fp) == EOF) {
+		(void)fprintf(stderr, "ERROR damaging `%s': ", dbname);
+		perror(NULL);
+		return 13;
+	}
+
+	if ((ms = magic_open(MAGIC_NONE)) == NULL) {
+		(void)fprintf(stderr, "ERROR opening MAGIC_NONE: out of memory\n");
+		return 10;
+	}
+	if (magic_load(ms, dbname) == 0) {
+		(void)fprintf(stderr, "Error: loaded the damaged `%s'\n",
+		    dbname);
+		rv = 1;
+	} else {
+		error = magic_error(ms);
+		rv = compare("load error", error ? error : "", desired);
+	}
+	magic_close(ms);
+	(void)remove(dbname);
+	free(dbname);
+	return rv;
+}
+
 int
 main(int argc, char **argv)
 {
 	struct magic_set *ms;
 	const char *result;
-	char *desired;
+	char *desired, *second;
 	size_t desired_len;
+	char flags[32];
 	int i;
 	FILE *fp;
 
-	ms = magic_open(MAGIC_NONE);
+	getflags(argc > 1 ? argv[1] : "", flags, sizeof(flags));
+
+	/* z: look inside compressed files, as file -z does */
+	ms = magic_open(strchr(flags, 'z') != NULL ? MAGIC_COMPRESS : MAGIC_NONE);
 	if (ms == NULL) {
-		(void)fprintf(stderr, "ERROR opening MAGIC_NONE: out of memory\n");
+		(void)fprintf(stderr, "ERROR opening the magic: out of memory\n");
 		return 10;
 	}
 	if (magic_load(ms, NULL) == -1) {
@@ -100,11 +460,32 @@ main(int argc, char **argv)
 				}
 				desired = slurp(fp, &desired_len);
 				fclose(fp);
+				/* e, i and c: the rest is what they want */
+				second = NULL;
+				if (strpbrk(flags, "eic") != NULL &&
+				    (second = strchr(desired, '\n')) != NULL)
+					*second++ = '\0';
 				(void)printf("%s: %s\n", argv[1], result);
-                                if (strcmp(result, desired) != 0) {
-					(void)fprintf(stderr, "Error: result was\n%s\nexpected:\n%s\n", result, desired);
+				if (compare("result", result, desired) != 0)
 					return 1;
-                                }
+				if (strchr(flags, 'm') != NULL &&
+				    (i = memo(ms, argv[1], desired)) != 0)
+					return i;
+				if (strchr(flags, 'r') != NULL &&
+				    (i = reader(ms, argv[1], desired)) != 0)
+					return i;
+				if (strchr(flags, 'b') != NULL &&
+				    (i = batch(ms, argv[1], desired)) != 0)
+					return i;
+				if (strchr(flags, 'e') != NULL &&
+				    (i = matches(ms, argv[1], second ? second : "")) != 0)
+					return i;
+				if (strchr(flags, 'i') != NULL &&
+				    (i = mime(ms, argv[1], second ? second : "")) != 0)
+					return i;
+				if (strchr(flags, 'c') != NULL &&
+				    (i = corrupt(getenv("MAGIC"), second ? second : "")) != 0)
+					return i;
 			}
 		}
 	}
@@ -33,6 +33,8 @@ static reg_errcode_t create_initial_state (re_dfa_t *dfa);
 static void optimize_utf8 (re_dfa_t *dfa);
 #endif
 static reg_errcode_t analyze (regex_t *preg);
+static reg_errcode_t extract_literals (regex_t *preg);
+static reg_errcode_t collect_literals (void *extra, bin_tree_t *node);
 static reg_errcode_t preorder (bin_tree_t *root,
 			       reg_errcode_t (fn (void *, bin_tree_t *)),
 			       void *extra);
@@ -585,6 +587,8 @@ free_dfa_content (re_dfa_t *dfa)
   re_free (dfa->eclosures);
   re_free (dfa->inveclosures);
   re_free (dfa->nodes);
+  re_free (dfa->prefix);
+  re_free (dfa->must);
 
   if (dfa->state_table)
     for (i = 0; i <= dfa->state_hash_mask; ++i)
@@ -779,6 +783,15 @@ re_compile_internal (regex_t *preg, const char * pattern, size_t length,
   if (BE (err != REG_NOERROR, 0))
     goto re_compile_internal_free_return;
 
+  /* Case folding and translation make the subject differ from the
+     pattern byte for byte, so only look for literals without them.  */
+  if (!(syntax & RE_ICASE) && preg->translate == NULL)
+    {
+      err = extract_literals (preg);
+      if (BE (err != REG_NOERROR, 0))
+	goto re_compile_internal_free_return;
+    }
+
 #ifdef RE_ENABLE_I18N
   /* If possible, do searching in single byte encoding to speed things up.  */
   if (dfa->is_utf8 && !(syntax & RE_ICASE) && preg->translate == NULL)
@@ -1082,6 +1095,124 @@ optimize_utf8 (re_dfa_t *dfa)
 }
 #endif
 
+/* Scratch area for extract_literals.  ITEMS holds, from left to right,
+   one entry for each element that every match passes through exactly
+   once: the byte of a literal character, LIT_BREAK for anything else
+   that consumes input, or LIT_BOL for a leading `^'.  */
+
+#define LIT_BREAK -1
+#define LIT_BOL -2
+
+struct literal_scan
+{
+  int *items;
+  int nitems;
+};
+
+static reg_errcode_t
+collect_literals (void *extra, bin_tree_t *node)
+{
+  struct literal_scan *ls = (struct literal_scan *) extra;
+  bin_tree_t *p;
+
+  /* Skip everything below an alternation or a repetition; only the
+     top-level concatenation is certain to appear in a match.  */
+  for (p = node->parent; p != NULL; p = p->parent)
+    if (p->token.type != CONCAT && p->token.type != SUBEXP)
+      return REG_NOERROR;
+
+  switch (node->token.type)
+    {
+    case CHARACTER:
+      ls->items[ls->nitems++] = node->token.opr.c;
+      break;
+    case ANCHOR:
+      /* Anchors take no input; only a leading `^' is kept, so that
+	 the search can insist on a line start before the prefix.  */
+      if (ls->nitems == 0 && node->token.opr.ctx_type == LINE_FIRST)
+	ls->items[ls->nitems++] = LIT_BOL;
+      break;
+    case CONCAT:
+    case SUBEXP:
+    case OP_OPEN_SUBEXP:
+    case OP_CLOSE_SUBEXP:
+    case END_OF_RE:
+      break;
+    default:
+      if (ls->nitems == 0 || ls->items[ls->nitems - 1] != LIT_BREAK)
+	ls->items[ls->nitems++] = LIT_BREAK;
+      break;
+    }
+  return REG_NOERROR;
+}
+
+/* Find the literal string that every match of the pattern begins with,
+   and the longest one that every match contains elsewhere.  regexec
+   uses the first to skip straight to the places a match can start, and
+   the second to give up at once on a subject that lacks it.  */
+
+static reg_errcode_t
+extract_literals (regex_t *preg)
+{
+  re_dfa_t *dfa = (re_dfa_t *) preg->buffer;
+  struct literal_scan ls;
+  int i, j, first, best, best_len;
+
+  ls.items = re_malloc (int, dfa->nodes_len + 1);
+  if (BE (ls.items == NULL, 0))
+    return REG_ESPACE;
+  ls.nitems = 0;
+  preorder (dfa->str_tree, collect_literals, &ls);
+
+  first = (ls.nitems > 0 && ls.items[0] == LIT_BOL);
+  for (i = first; i < ls.nitems && ls.items[i] >= 0; ++i)
+    ;
+  if (i > first)
+    {
+      dfa->prefix = re_malloc (unsigned char, i - first);
+      if (BE (dfa->prefix == NULL, 0))
+	{
+	  re_free (ls.items);
+	  return REG_ESPACE;
+	}
+      for (j = first; j < i; ++j)
+	dfa->prefix[j - first] = ls.items[j];
+      dfa->prefix_len = i - first;
+      dfa->prefix_bol = first;
+    }
+
+  /* The prefix is already looked for; pick the longest later run.  */
+  best = best_len = 0;
+  while (i < ls.nitems)
+    {
+      for (; i < ls.nitems && ls.items[i] < 0; ++i)
+	;
+      for (j = i; j < ls.nitems && ls.items[j] >= 0; ++j)
+	;
+      if (j - i > best_len)
+	{
+	  best = i;
+	  best_len = j - i;
+	}
+      i = j;
+    }
+  if (best_len > dfa->prefix_len)
+    {
+      dfa->must = re_malloc (unsigned char, best_len);
+      if (BE (dfa->must == NULL, 0))
+	{
+	  re_free (ls.items);
+	  return REG_ESPACE;
+	}
+      for (j = 0; j < best_len; ++j)
+	dfa->must[j] = ls.items[best + j];
+      dfa->must_len = best_len;
+    }
+
+  re_free (ls.items);
+  return REG_NOERROR;
+}
+
 /* Analyze the structure tree, and calculate "first", "next", "edest",
    "eclosure", and "inveclosure".  */
 
@@ -510,6 +510,10 @@ struct re_dfastate_t
   re_node_set inveclosure;
   re_node_set *entrance_nodes;
   struct re_dfastate_t **trtable, **word_trtable;
+  /* Transitions that also start a new match; see build_search_trtable.
+     SEARCH_NL is the newline_anchor they were built for.  */
+  struct re_dfastate_t **search_trtable;
+  unsigned int search_nl : 1;
   unsigned int context : 4;
   unsigned int halt : 1;
   /* If this state can accept `multi byte'.
@@ -664,6 +668,15 @@ struct re_dfa_t
   bitset_t word_char;
   reg_syntax_t syntax;
   int *subexp_map;
+
+  /* Literal bytes every match starts with, after a line start if
+     PREFIX_BOL, and a longer run every match contains later on.  Both
+     are left unset for case-folded or translated patterns.  */
+  unsigned char *prefix;
+  int prefix_len;
+  unsigned int prefix_bol : 1;
+  unsigned char *must;
+  int must_len;
 #ifdef DEBUG
   char* re_str;
 #endif
@@ -36,6 +36,10 @@ static void sift_ctx_init (re_sift_context_t *sctx, re_dfastate_t **sifted_sts,
 			   re_dfastate_t **limited_sts, int last_node,
 			   int last_str_idx)
      internal_function;
+static int find_literal (const char *string, int from, int to, int lim,
+			 const unsigned char *lit, int len) internal_function;
+static int find_prefix (const regex_t *preg, const char *string, int from,
+			int to, int lim, int eflags) internal_function;
 static reg_errcode_t re_search_internal (const regex_t *preg,
 					 const char *string, int length,
 					 int start, int range, int stop,
@@ -59,6 +63,16 @@ static int check_matching (re_match_context_t *mctx, int fl_longest_match,
 static int check_halt_state_context (const re_match_context_t *mctx,
 				     const re_dfastate_t *state, int idx)
      internal_function;
+static unsigned int sb_context_at (const regex_t *preg, const char *string,
+				   int idx, int length, int eflags)
+     internal_function;
+static re_dfastate_t **build_search_trtable (reg_errcode_t *err,
+					     const regex_t *preg,
+					     re_dfastate_t *state)
+     internal_function;
+static int check_any_match (const regex_t *preg, const char *string,
+			    int length, int start, int last_start, int stop,
+			    int eflags) internal_function;
 static void update_regs (const re_dfa_t *dfa, regmatch_t *pmatch,
 			 regmatch_t *prev_idx_match, int cur_node,
 			 int cur_idx, int nmatch) internal_function;
@@ -214,6 +228,11 @@ static reg_errcode_t extend_buffers (re_match_context_t *mctx)
    EFLAGS specifies `execution flags' which affect matching: if
    REG_NOTBOL is set, then ^ does not match at the beginning of the
    string; if REG_NOTEOL is set, then $ does not match at the end.
+   If REG_STARTEND is set, PMATCH[0] gives the range of STRING to
+   search; STRING need not be NUL terminated and no byte at or past
+   PMATCH[0].rm_eo is read.  The offsets returned are still relative
+   to STRING.  A negative start or an end before the start matches
+   nothing.
 
    We return 0 if we find a match and REG_NOMATCH if not.  */
 
@@ -236,6 +255,11 @@ regexec (preg, string, nmatch, pmatch, eflags)
     {
       start = pmatch[0].rm_so;
       length = pmatch[0].rm_eo;
+      /* An invalid range has nothing to match: REG_NOMATCH, as
+	 glibc and the BSDs give, since the pattern itself is fine and
+	 there is no REG_INVARG here.  */
+      if (BE (start < 0 || length < start, 0))
+	return REG_NOMATCH;
     }
   else
     {
@@ -605,6 +629,52 @@ re_exec (s)
 }
 #endif /* _REGEX_RE_COMP */
 
+/* Return the first index in [FROM, TO] at which the LEN bytes of LIT
+   start in STRING without running past LIM, or -1 if there is none.  */
+
+static int
+internal_function
+find_literal (const char *string, int from, int to, int lim,
+	      const unsigned char *lit, int len)
+{
+  const char *p;
+
+  if (to > lim - len)
+    to = lim - len;
+  while (from <= to)
+    {
+      p = memchr (string + from, lit[0], to - from + 1);
+      if (p == NULL)
+	return -1;
+      if (memcmp (p + 1, lit + 1, len - 1) == 0)
+	return p - string;
+      from = p - string + 1;
+    }
+  return -1;
+}
+
+/* Return the first index in [FROM, TO] at which a match of PREG can
+   start, judging by the literal prefix of the pattern, or -1.  */
+
+static int
+internal_function
+find_prefix (const regex_t *preg, const char *string, int from, int to,
+	     int lim, int eflags)
+{
+  const re_dfa_t *dfa = (const re_dfa_t *) preg->buffer;
+
+  for (;; ++from)
+    {
+      from = find_literal (string, from, to, lim, dfa->prefix,
+			   dfa->prefix_len);
+      if (from < 0 || !dfa->prefix_bol)
+	return from;
+      if (from == 0 ? !(eflags & REG_NOTBOL)
+	  : preg->newline_anchor && string[from - 1] == '\n')
+	return from;
+    }
+}
+
 /* Internal entry point.  */
 
 /* Searches for a compiled pattern PREG in the string STRING, whose
@@ -630,7 +700,7 @@ re_search_internal (preg, string, length, start, range, stop, nmatch, pmatch,
   int left_lim, right_lim, incr;
   int fl_longest_match, match_first, match_kind, match_last = -1;
   int extra_nmatch;
-  int sb, ch;
+  int sb, ch, lim;
 #if defined _LIBC || (defined __STDC_VERSION__ && __STDC_VERSION__ >= 199901L)
   re_match_context_t mctx = { .dfa = dfa };
 #else
@@ -672,6 +742,39 @@ re_search_internal (preg, string, length, start, range, stop, nmatch, pmatch,
       start = range = 0;
     }
 
+  /* Give up before setting anything up if the subject lacks a literal
+     that every match contains, or that every match starts with.  */
+  lim = (stop < length) ? stop : length;
+  sb = dfa->mb_cur_max == 1;
+  left_lim = (range < 0) ? start + range : start;
+  right_lim = (range < 0) ? start : start + range;
+  if (dfa->must != NULL && t == NULL
+      && find_literal (string, left_lim, lim, lim, dfa->must,
+		       dfa->must_len) < 0)
+    return REG_NOMATCH;
+  if (dfa->prefix != NULL && t == NULL
+      && find_prefix (preg, string, left_lim, right_lim, lim, eflags) < 0)
+    return REG_NOMATCH;
+
+  /* Without back-references or multibyte and translated characters,
+     find out in one pass whether there is a match at all.  That rules
+     out most subjects at the cost of a single DFA walk; otherwise the
+     leftmost match starts no later than the first match found ends.  */
+  if (range >= 0 && sb && !dfa->nbackref && !dfa->has_mb_node && t == NULL)
+    {
+      match_first = check_any_match (preg, string, length, start, right_lim,
+				     lim, eflags);
+      if (match_first == -1)
+	return REG_NOMATCH;
+      if (BE (match_first == -2, 0))
+	return REG_ESPACE;
+      if (match_first < right_lim)
+	{
+	  range = match_first - start;
+	  right_lim = match_first;
+	}
+    }
+
   /* We must check the longest matching, if nmatch > 0.  */
   fl_longest_match = (nmatch != 0 || dfa->nbackref);
 
@@ -709,9 +812,6 @@ re_search_internal (preg, string, length, start, range, stop, nmatch, pmatch,
 
   /* Check incrementally whether of not the input string match.  */
   incr = (range < 0) ? -1 : 1;
-  left_lim = (range < 0) ? start + range : start;
-  right_lim = (range < 0) ? start : start + range;
-  sb = dfa->mb_cur_max == 1;
   match_kind =
     (fastmap
      ? ((sb || !(preg->syntax & RE_ICASE || t) ? 4 : 0)
@@ -729,7 +829,16 @@ re_search_internal (preg, string, length, start, range, stop, nmatch, pmatch,
 	 find a plausible place to start matching.  This may be done
 	 with varying efficiency, so there are various possibilities:
 	 only the most common of them are specialized, in order to
-	 save on code size.  We use a switch statement for speed.  */
+	 save on code size.  We use a switch statement for speed.  When
+	 the pattern starts with a literal, searching forward, jump
+	 straight to its next occurrence first.  */
+      if (dfa->prefix != NULL && t == NULL && incr > 0)
+	{
+	  match_first = find_prefix (preg, string, match_first, right_lim,
+				     lim, eflags);
+	  if (match_first < 0)
+	    goto free_return;
+	}
       switch (match_kind)
 	{
 	case 8:
@@ -1017,6 +1126,35 @@ prune_impossible_nodes (mctx)
   return ret;
 }
 
+/* Return the initial state for a match that starts after a character
+   of context CONTEXT.  Only called if the initial state has constraints
+   like "\<", "^", etc..  */
+
+static inline re_dfastate_t *
+__attribute ((always_inline)) internal_function
+init_state_context (reg_errcode_t *err, const re_dfa_t *dfa,
+		    unsigned int context)
+{
+  if (IS_WORD_CONTEXT (context))
+    return dfa->init_state_word;
+  else if (IS_ORDINARY_CONTEXT (context))
+    return dfa->init_state;
+  else if (IS_BEGBUF_CONTEXT (context) && IS_NEWLINE_CONTEXT (context))
+    return dfa->init_state_begbuf;
+  else if (IS_NEWLINE_CONTEXT (context))
+    return dfa->init_state_nl;
+  else if (IS_BEGBUF_CONTEXT (context))
+    {
+      /* It is relatively rare case, then calculate on demand.  */
+      return re_acquire_state_context (err, dfa,
+				       dfa->init_state->entrance_nodes,
+				       context);
+    }
+  else
+    /* Must not happen?  */
+    return dfa->init_state;
+}
+
 /* Acquire an initial state and return it.
    We must select appropriate initial state depending on the context,
    since initial states may have constraints like "\<", "^", etc..  */
@@ -1028,28 +1166,9 @@ acquire_init_state_context (reg_errcode_t *err, const re_match_context_t *mctx,
 {
   const re_dfa_t *const dfa = mctx->dfa;
   if (dfa->init_state->has_constraint)
-    {
-      unsigned int context;
-      context = re_string_context_at (&mctx->input, idx - 1, mctx->eflags);
-      if (IS_WORD_CONTEXT (context))
-	return dfa->init_state_word;
-      else if (IS_ORDINARY_CONTEXT (context))
-	return dfa->init_state;
-      else if (IS_BEGBUF_CONTEXT (context) && IS_NEWLINE_CONTEXT (context))
-	return dfa->init_state_begbuf;
-      else if (IS_NEWLINE_CONTEXT (context))
-	return dfa->init_state_nl;
-      else if (IS_BEGBUF_CONTEXT (context))
-	{
-	  /* It is relatively rare case, then calculate on demand.  */
-	  return re_acquire_state_context (err, dfa,
-					   dfa->init_state->entrance_nodes,
-					   context);
-	}
-      else
-	/* Must not happen?  */
-	return dfa->init_state;
-    }
+    return init_state_context (err, dfa,
+			       re_string_context_at (&mctx->input, idx - 1,
+						     mctx->eflags));
   else
     return dfa->init_state;
 }
@@ -1231,6 +1350,198 @@ check_halt_state_context (const re_match_context_t *mctx,
   return 0;
 }
 
+/* Functions for the one pass search that tells whether a pattern
+   without back-references matches anywhere in a single byte string.  */
+
+/* Return the context of the byte at IDX of STRING, which is LENGTH bytes
+   long, the way re_string_context_at does for an untranslated string,
+   upper-cased when the pattern ignores case.  */
+
+static unsigned int
+internal_function
+sb_context_at (const regex_t *preg, const char *string, int idx, int length,
+	       int eflags)
+{
+  const re_dfa_t *dfa = (const re_dfa_t *) preg->buffer;
+  unsigned char c;
+
+  if (BE (idx < 0, 0))
+    return ((eflags & REG_NOTBOL) ? CONTEXT_BEGBUF
+	    : CONTEXT_NEWLINE | CONTEXT_BEGBUF);
+  if (BE (idx == length, 0))
+    return ((eflags & REG_NOTEOL) ? CONTEXT_ENDBUF
+	    : CONTEXT_NEWLINE | CONTEXT_ENDBUF);
+  c = string[idx];
+  if (preg->syntax & RE_ICASE)
+    c = toupper (c);
+  if (bitset_contain (dfa->word_char, c))
+    return CONTEXT_WORD;
+  return IS_NEWLINE (c) && preg->newline_anchor ? CONTEXT_NEWLINE : 0;
+}
+
+/* Build the search transition table of STATE.  Its entry for a byte is
+   the state reached on that byte by the matches STATE stands for, merged
+   with the initial state of a match that starts right after the byte.
+   Like the ordinary table it is kept with STATE for later searches.
+   Return the table, or NULL in case of an error.  */
+
+static re_dfastate_t **
+internal_function
+build_search_trtable (reg_errcode_t *err, const regex_t *preg,
+		      re_dfastate_t *state)
+{
+  const re_dfa_t *dfa = (const re_dfa_t *) preg->buffer;
+  re_dfastate_t **trtable, *dest, *init;
+  unsigned char contexts[SBC_MAX];
+  re_node_set union_set;
+  int ch, prev;
+
+  if (state->trtable == NULL && !build_trtable (dfa, state))
+    {
+      *err = REG_ESPACE;
+      return NULL;
+    }
+  trtable = re_malloc (re_dfastate_t *, SBC_MAX);
+  if (BE (trtable == NULL, 0))
+    {
+      *err = REG_ESPACE;
+      return NULL;
+    }
+
+  for (ch = 0; ch < SBC_MAX; ++ch)
+    {
+      dest = state->trtable[ch];
+      contexts[ch] = (bitset_contain (dfa->word_char, ch) ? CONTEXT_WORD
+		      : (IS_NEWLINE (ch) && preg->newline_anchor)
+		      ? CONTEXT_NEWLINE : 0);
+
+      /* Most bytes lead to a destination met before.  */
+      for (prev = 0; prev < ch; ++prev)
+	if (state->trtable[prev] == dest && contexts[prev] == contexts[ch])
+	  break;
+      if (prev < ch)
+	{
+	  trtable[ch] = trtable[prev];
+	  continue;
+	}
+
+      init = (dfa->init_state->has_constraint
+	      ? init_state_context (err, dfa, contexts[ch]) : dfa->init_state);
+      if (init->nodes.nelem == 0)
+	trtable[ch] = dest;
+      else if (dest == NULL || dest == init)
+	trtable[ch] = init;
+      else
+	{
+	  /* INIT has been filtered by the context CH leaves, and so has
+	     DEST if it has constraints at all, except that build_trtable
+	     always gives a newline the newline context.  The nodes INIT
+	     keeps without newline_anchor all pass that context too.  */
+	  *err = re_node_set_init_union (&union_set, &dest->nodes,
+					 &init->nodes);
+	  if (BE (*err != REG_NOERROR, 0))
+	    {
+	      re_free (trtable);
+	      return NULL;
+	    }
+	  trtable[ch] = re_acquire_state_context (err, dfa, &union_set,
+						  (dest->has_constraint
+						   ? dest->context
+						   : contexts[ch]));
+	  re_node_set_free (&union_set);
+	  if (BE (trtable[ch] == NULL, 0))
+	    {
+	      re_free (trtable);
+	      return NULL;
+	    }
+	}
+    }
+
+  re_free (state->search_trtable);
+  state->search_trtable = trtable;
+  state->search_nl = preg->newline_anchor;
+  return trtable;
+}
+
+/* Tell in one pass over STRING whether a match of PREG starts between
+   START and LAST_START and ends by STOP.  This runs the DFA for all the
+   starting points at once, rather than once from each of them, so it
+   is only used for untranslated single byte searches of patterns
+   without back-references.  Like the upper-cased copy re_string_t
+   makes, the bytes are upper-cased when the pattern ignores case.
+   Return the index at which the first such match to be found ends, -1
+   if there is none, or -2 in case of an error.  */
+
+static int
+internal_function
+check_any_match (const regex_t *preg, const char *string, int length,
+		 int start, int last_start, int stop, int eflags)
+{
+  const re_dfa_t *dfa = (const re_dfa_t *) preg->buffer;
+  re_dfastate_t *state, **trtable;
+  reg_errcode_t err = REG_NOERROR;
+  unsigned int context;
+  int idx, i, icase = preg->syntax & RE_ICASE;
+  unsigned char ch;
+
+  state = (dfa->init_state->has_constraint
+	   ? init_state_context (&err, dfa,
+				 sb_context_at (preg, string, start - 1,
+						length, eflags))
+	   : dfa->init_state);
+  if (BE (state == NULL && err != REG_NOERROR, 0))
+    return -2;
+
+  for (idx = start; ; ++idx)
+    {
+      if (state != NULL && state->halt)
+	{
+	  context = sb_context_at (preg, string, idx, length, eflags);
+	  for (i = 0; i < state->nodes.nelem; ++i)
+	    if (check_halt_node_context (dfa, state->nodes.elems[i], context))
+	      return idx;
+	}
+      if (idx >= stop)
+	return -1;
+
+      if (idx < last_start)
+	{
+	  /* A match may still start after this byte.  */
+	  if (state == NULL)
+	    {
+	      context = sb_context_at (preg, string, idx, length, eflags);
+	      state = (dfa->init_state->has_constraint
+		       ? init_state_context (&err, dfa, context)
+		       : dfa->init_state);
+	      if (state->nodes.nelem == 0)
+		state = NULL;
+	      continue;
+	    }
+	  trtable = state->search_trtable;
+	  if (trtable == NULL || state->search_nl != preg->newline_anchor)
+	    {
+	      trtable = build_search_trtable (&err, preg, state);
+	      if (BE (trtable == NULL, 0))
+		return -2;
+	    }
+	}
+      else
+	{
+	  if (state == NULL)
+	    return -1;
+	  trtable = state->trtable;
+	  if (trtable == NULL)
+	    {
+	      if (!build_trtable (dfa, state))
+		return -2;
+	      trtable = state->trtable;
+	    }
+	}
+      ch = string[idx];
+      state = trtable[icase ? toupper (ch) : ch];
+    }
+}
+
 /* Compute the next node to which "NFA" transit from NODE("NFA" is a NFA
    corresponding to the DFA).
    Return the destination node, and update EPS_VIA_NODES, return -1 in case